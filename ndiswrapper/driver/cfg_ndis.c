@@ -0,0 +1,890 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <net/cfg80211.h>
+
+#include "cfg_ndis.h"
+#include "iw_ndis.h"
+#include "wrapndis.h"
+
+#ifdef WRAP_CFG80211
+
+/* miniport scans in the background after OID_802_11_BSSID_LIST_SCAN;
+ * BSSID list is collected a few times during the scan so that BSSes
+ * already found are reported without waiting for complete scan */
+#define CFG_NDIS_SCAN_PASSES		3
+#define CFG_NDIS_SCAN_INTERVAL		HZ
+#define CFG_NDIS_CONNECT_TIMEOUT	(10 * HZ)
+#define CFG_NDIS_ASSOC_IES_MAX		512
+
+enum cfg_ndis_state {
+	CFG_NDIS_IDLE, CFG_NDIS_CONNECTING, CFG_NDIS_CONNECTED
+};
+
+#define CHAN2G(freq) {						\
+	.band = NL80211_BAND_2GHZ, .center_freq = (freq),	\
+	.hw_value = (freq), .max_power = 20 }
+
+#define CHAN5G(chan) {						\
+	.band = NL80211_BAND_5GHZ, .center_freq = 5000 + 5 * (chan),	\
+	.hw_value = (chan), .max_power = 20 }
+
+static const struct ieee80211_channel cfg_ndis_channels_2ghz[] = {
+	CHAN2G(2412), CHAN2G(2417), CHAN2G(2422), CHAN2G(2427),
+	CHAN2G(2432), CHAN2G(2437), CHAN2G(2442), CHAN2G(2447),
+	CHAN2G(2452), CHAN2G(2457), CHAN2G(2462), CHAN2G(2467),
+	CHAN2G(2472), CHAN2G(2484),
+};
+
+static const struct ieee80211_channel cfg_ndis_channels_5ghz[] = {
+	CHAN5G(36), CHAN5G(40), CHAN5G(44), CHAN5G(48),
+	CHAN5G(52), CHAN5G(56), CHAN5G(60), CHAN5G(64),
+	CHAN5G(100), CHAN5G(104), CHAN5G(108), CHAN5G(112),
+	CHAN5G(116), CHAN5G(120), CHAN5G(124), CHAN5G(128),
+	CHAN5G(132), CHAN5G(136), CHAN5G(140), CHAN5G(149),
+	CHAN5G(153), CHAN5G(157), CHAN5G(161), CHAN5G(165),
+};
+
+/* in units of 100 kbps; 5 GHz band doesn't use the 802.11b rates */
+static const struct ieee80211_rate cfg_ndis_rates[] = {
+	{ .bitrate = 10 }, { .bitrate = 20 },
+	{ .bitrate = 55 }, { .bitrate = 110 },
+	{ .bitrate = 60 }, { .bitrate = 90 },
+	{ .bitrate = 120 }, { .bitrate = 180 },
+	{ .bitrate = 240 }, { .bitrate = 360 },
+	{ .bitrate = 480 }, { .bitrate = 540 },
+};
+#define CFG_NDIS_RATES_5GHZ 4
+
+struct cfg_ndis_priv {
+	struct ndis_device *wnd;
+	struct wireless_dev wdev;
+	struct cfg80211_scan_request *scan_req;
+	struct delayed_work scan_work;
+	int scan_pass;
+	struct delayed_work connect_work;
+	int state;
+	u32 cipher;
+	u32 cipher_suites[4];
+	struct ieee80211_supported_band band_2ghz;
+	struct ieee80211_supported_band band_5ghz;
+	struct ieee80211_channel channels_2ghz[
+		ARRAY_SIZE(cfg_ndis_channels_2ghz)];
+	struct ieee80211_channel channels_5ghz[
+		ARRAY_SIZE(cfg_ndis_channels_5ghz)];
+	struct ieee80211_rate rates[ARRAY_SIZE(cfg_ndis_rates)];
+};
+
+/* association request/response IEs, kept until BSSID is known */
+struct cfg_ndis_assoc_ies {
+	size_t req_ie_len;
+	size_t resp_ie_len;
+	u8 ies[];
+};
+
+static struct cfg_ndis_priv *cfg_ndis_priv(struct ndis_device *wnd)
+{
+	return container_of(wnd->wdev, struct cfg_ndis_priv, wdev);
+}
+
+static int cfg_ndis_error(NDIS_STATUS res)
+{
+	if (res == NDIS_STATUS_SUCCESS)
+		return 0;
+	if (res == NDIS_STATUS_INVALID_DATA)
+		return -EINVAL;
+	return -EOPNOTSUPP;
+}
+
+static int cfg_ndis_set_essid(struct ndis_device *wnd, const u8 *ssid,
+			      size_t ssid_len)
+{
+	struct ndis_essid req;
+	NDIS_STATUS res;
+
+	if (ssid_len > NDIS_ESSID_MAX_SIZE)
+		return -EINVAL;
+	memset(&req, 0, sizeof(req));
+	req.length = ssid_len;
+	memcpy(req.essid, ssid, ssid_len);
+	res = mp_set(wnd, OID_802_11_SSID, &req, sizeof(req));
+	if (res) {
+		WARNING("setting essid failed (%08X)", res);
+		return cfg_ndis_error(res);
+	}
+	memcpy(&wnd->essid, &req, sizeof(req));
+	return 0;
+}
+
+static void cfg_ndis_disassociate(struct ndis_device *wnd)
+{
+	NDIS_STATUS res;
+	u8 buf[NDIS_ESSID_MAX_SIZE];
+	int i;
+
+	res = mp_set(wnd, OID_802_11_DISASSOCIATE, NULL, 0);
+	if (res)
+		TRACE2("disassociate failed (%08X)", res);
+	/* disassociation turns radio off; set ssid to random to
+	 * enable radio, so scanning still works */
+	get_random_bytes(buf, sizeof(buf));
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + (buf[i] % 26);
+	cfg_ndis_set_essid(wnd, buf, sizeof(buf));
+}
+
+/* index must be 0 - N, as per NDIS */
+static int cfg_ndis_add_wep_key(struct ndis_device *wnd, int index,
+				const u8 *key, int key_len)
+{
+	struct ndis_encr_key ndis_key;
+	NDIS_STATUS res;
+
+	ENTER2("key index: %d, length: %d", index, key_len);
+	if (key_len <= 0 || key_len > NDIS_ENCODING_TOKEN_MAX ||
+	    index < 0 || index >= MAX_ENCR_KEYS)
+		EXIT2(return -EINVAL);
+	memset(&ndis_key, 0, sizeof(ndis_key));
+	ndis_key.struct_size = sizeof(ndis_key);
+	ndis_key.index = index;
+	ndis_key.length = key_len;
+	memcpy(ndis_key.key, key, key_len);
+	if (index == wnd->encr_info.tx_key_index)
+		ndis_key.index |= (1 << 31);
+	res = mp_set(wnd, OID_802_11_ADD_WEP, &ndis_key, sizeof(ndis_key));
+	if (res) {
+		WARNING("adding encryption key %d failed (%08X)",
+			index + 1, res);
+		EXIT2(return -EINVAL);
+	}
+	wnd->encr_info.keys[index].length = key_len;
+	memcpy(wnd->encr_info.keys[index].key, key, key_len);
+	EXIT2(return 0);
+}
+
+static int cfg_ndis_add_wpa_key(struct ndis_device *wnd, int index,
+				bool pairwise, const u8 *mac_addr,
+				struct key_params *params)
+{
+	struct ndis_add_key ndis_key;
+	NDIS_STATUS res;
+	int i;
+
+	ENTER2("%d, %d, %d", index, pairwise, params->key_len);
+	if (params->key_len > sizeof(ndis_key.key))
+		EXIT2(return -EINVAL);
+	memset(&ndis_key, 0, sizeof(ndis_key));
+	ndis_key.struct_size =
+		sizeof(ndis_key) - sizeof(ndis_key.key) + params->key_len;
+	ndis_key.length = params->key_len;
+	ndis_key.index = index;
+
+	if (params->seq && params->seq_len > 0) {
+		for (i = 0; i < params->seq_len && i < 6; i++)
+			ndis_key.rsc |= (((u64)params->seq[i]) << (i * 8));
+		ndis_key.index |= 1 << 29;
+	}
+
+	if (pairwise) {
+		if (!mac_addr)
+			EXIT2(return -EINVAL);
+		ndis_key.index |= (1 << 30) | (1 << 31);
+		memcpy(ndis_key.bssid, mac_addr, ETH_ALEN);
+	} else if (wnd->infrastructure_mode == Ndis802_11IBSS ||
+		   mp_query(wnd, OID_802_11_BSSID, ndis_key.bssid, ETH_ALEN))
+		memset(ndis_key.bssid, 0xff, ETH_ALEN);
+	TRACE2(MACSTRSEP, MAC2STR(ndis_key.bssid));
+
+	if (params->cipher == WLAN_CIPHER_SUITE_TKIP &&
+	    params->key_len == 32) {
+		/* Michael MIC TX/RX keys are in different order than
+		 * NDIS wants */
+		memcpy(ndis_key.key, params->key, 16);
+		memcpy(ndis_key.key + 16, params->key + 24, 8);
+		memcpy(ndis_key.key + 24, params->key + 16, 8);
+	} else
+		memcpy(ndis_key.key, params->key, params->key_len);
+
+	res = mp_set(wnd, OID_802_11_ADD_KEY, &ndis_key, ndis_key.struct_size);
+	if (res) {
+		TRACE2("adding key failed (%08X), %u",
+		       res, ndis_key.struct_size);
+		EXIT2(return cfg_ndis_error(res));
+	}
+	wnd->encr_info.keys[index].length = params->key_len;
+	memcpy(wnd->encr_info.keys[index].key, ndis_key.key, params->key_len);
+	EXIT2(return 0);
+}
+
+static int cfg_ndis_add_key(struct wiphy *wiphy, struct net_device *dev,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+			    int link_id,
+#endif
+			    u8 key_index, bool pairwise, const u8 *mac_addr,
+			    struct key_params *params)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+
+	if (key_index >= MAX_ENCR_KEYS)
+		return -EINVAL;
+	switch (params->cipher) {
+	case WLAN_CIPHER_SUITE_WEP40:
+	case WLAN_CIPHER_SUITE_WEP104:
+		return cfg_ndis_add_wep_key(wnd, key_index, params->key,
+					    params->key_len);
+	case WLAN_CIPHER_SUITE_TKIP:
+	case WLAN_CIPHER_SUITE_CCMP:
+		return cfg_ndis_add_wpa_key(wnd, key_index, pairwise,
+					    mac_addr, params);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int cfg_ndis_del_key(struct wiphy *wiphy, struct net_device *dev,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+			    int link_id,
+#endif
+			    u8 key_index, bool pairwise, const u8 *mac_addr)
+{
+	struct cfg_ndis_priv *priv = wiphy_priv(wiphy);
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_remove_key rmkey;
+	NDIS_STATUS res;
+
+	ENTER2("%d, %d", key_index, pairwise);
+	if (key_index >= MAX_ENCR_KEYS)
+		EXIT2(return -EINVAL);
+	wnd->encr_info.keys[key_index].length = 0;
+	if (priv->cipher == WLAN_CIPHER_SUITE_TKIP ||
+	    priv->cipher == WLAN_CIPHER_SUITE_CCMP) {
+		rmkey.struct_size = sizeof(rmkey);
+		rmkey.index = key_index;
+		if (pairwise && mac_addr) {
+			rmkey.index |= (1 << 30);
+			memcpy(rmkey.bssid, mac_addr, sizeof(rmkey.bssid));
+		} else
+			memset(rmkey.bssid, 0xff, sizeof(rmkey.bssid));
+		res = mp_set(wnd, OID_802_11_REMOVE_KEY, &rmkey,
+			     sizeof(rmkey));
+	} else
+		res = mp_set_int(wnd, OID_802_11_REMOVE_WEP, key_index);
+	if (res) {
+		TRACE2("removing key %d failed (%08X)", key_index, res);
+		EXIT2(return cfg_ndis_error(res));
+	}
+	EXIT2(return 0);
+}
+
+static int cfg_ndis_set_default_key(struct wiphy *wiphy,
+				    struct net_device *dev,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+				    int link_id,
+#endif
+				    u8 key_index, bool unicast,
+				    bool multicast)
+{
+	struct cfg_ndis_priv *priv = wiphy_priv(wiphy);
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct encr_key key;
+
+	ENTER2("%d", key_index);
+	if (key_index >= MAX_ENCR_KEYS)
+		EXIT2(return -EINVAL);
+	wnd->encr_info.tx_key_index = key_index;
+	/* with WEP, transmit key is marked when key is added, so add
+	 * it again */
+	key = wnd->encr_info.keys[key_index];
+	if ((priv->cipher == WLAN_CIPHER_SUITE_WEP40 ||
+	     priv->cipher == WLAN_CIPHER_SUITE_WEP104) && key.length > 0)
+		EXIT2(return cfg_ndis_add_wep_key(wnd, key_index, key.key,
+						  key.length));
+	EXIT2(return 0);
+}
+
+static ULONG cfg_ndis_auth_mode(struct cfg80211_connect_params *sme)
+{
+	bool psk = sme->crypto.n_akm_suites > 0 &&
+		sme->crypto.akm_suites[0] == WLAN_AKM_SUITE_PSK;
+
+	if (sme->crypto.wpa_versions & NL80211_WPA_VERSION_2)
+		return psk ? Ndis802_11AuthModeWPA2PSK : Ndis802_11AuthModeWPA2;
+	if (sme->crypto.wpa_versions & NL80211_WPA_VERSION_1)
+		return psk ? Ndis802_11AuthModeWPAPSK : Ndis802_11AuthModeWPA;
+	switch (sme->auth_type) {
+	case NL80211_AUTHTYPE_SHARED_KEY:
+		return Ndis802_11AuthModeShared;
+	case NL80211_AUTHTYPE_AUTOMATIC:
+		return Ndis802_11AuthModeAutoSwitch;
+	default:
+		return Ndis802_11AuthModeOpen;
+	}
+}
+
+static ULONG cfg_ndis_encr_mode(u32 cipher)
+{
+	switch (cipher) {
+	case WLAN_CIPHER_SUITE_CCMP:
+		return Ndis802_11Encryption3Enabled;
+	case WLAN_CIPHER_SUITE_TKIP:
+		return Ndis802_11Encryption2Enabled;
+	case WLAN_CIPHER_SUITE_WEP40:
+	case WLAN_CIPHER_SUITE_WEP104:
+		return Ndis802_11Encryption1Enabled;
+	default:
+		return Ndis802_11EncryptionDisabled;
+	}
+}
+
+static int cfg_ndis_connect(struct wiphy *wiphy, struct net_device *dev,
+			    struct cfg80211_connect_params *sme)
+{
+	struct cfg_ndis_priv *priv = wiphy_priv(wiphy);
+	struct ndis_device *wnd = netdev_priv(dev);
+	ULONG auth_mode, encr_mode, priv_filter;
+	NDIS_STATUS res;
+	u32 cipher;
+	int ret;
+
+	ENTER2("%.*s", (int)sme->ssid_len, sme->ssid);
+	if (sme->crypto.n_ciphers_pairwise > 0)
+		cipher = sme->crypto.ciphers_pairwise[0];
+	else if (sme->crypto.cipher_group)
+		cipher = sme->crypto.cipher_group;
+	else if (sme->privacy)
+		cipher = WLAN_CIPHER_SUITE_WEP104;
+	else
+		cipher = 0;
+	auth_mode = cfg_ndis_auth_mode(sme);
+	encr_mode = cfg_ndis_encr_mode(cipher);
+	if (sme->crypto.wpa_versions)
+		priv_filter = Ndis802_11PrivFilter8021xWEP;
+	else
+		priv_filter = Ndis802_11PrivFilterAcceptAll;
+	TRACE2("auth: %u, encr: %u, filter: %u", auth_mode, encr_mode,
+	       priv_filter);
+
+	/* changing mode removes keys, so set it only if needed */
+	if (wnd->infrastructure_mode != Ndis802_11Infrastructure) {
+		res = mp_set_int(wnd, OID_802_11_INFRASTRUCTURE_MODE,
+				 Ndis802_11Infrastructure);
+		if (res) {
+			WARNING("setting operating mode failed (%08X)", res);
+			EXIT2(return cfg_ndis_error(res));
+		}
+		wnd->infrastructure_mode = Ndis802_11Infrastructure;
+	}
+	res = mp_set_int(wnd, OID_802_11_AUTHENTICATION_MODE, auth_mode);
+	if (res) {
+		WARNING("setting auth mode to %u failed (%08X)",
+			auth_mode, res);
+		EXIT2(return cfg_ndis_error(res));
+	}
+	res = mp_set_int(wnd, OID_802_11_PRIVACY_FILTER, priv_filter);
+	if (res)
+		TRACE2("setting privacy filter to %u failed (%08X)",
+		       priv_filter, res);
+	res = mp_set_int(wnd, OID_802_11_ENCRYPTION_STATUS, encr_mode);
+	if (res) {
+		WARNING("setting encryption mode to %u failed (%08X)",
+			encr_mode, res);
+		EXIT2(return cfg_ndis_error(res));
+	}
+	priv->cipher = cipher;
+
+	if (sme->key && sme->key_len > 0) {
+		wnd->encr_info.tx_key_index = sme->key_idx;
+		ret = cfg_ndis_add_wep_key(wnd, sme->key_idx, sme->key,
+					   sme->key_len);
+		if (ret)
+			EXIT2(return ret);
+	}
+	if (sme->bssid) {
+		res = mp_set(wnd, OID_802_11_BSSID, (void *)sme->bssid,
+			     ETH_ALEN);
+		/* not all drivers allow setting BSSID; ssid is enough */
+		if (res)
+			TRACE2("setting BSSID failed (%08X)", res);
+	}
+
+	/* setting ssid starts association; media connect indication
+	 * completes it */
+	priv->state = CFG_NDIS_CONNECTING;
+	ret = cfg_ndis_set_essid(wnd, sme->ssid, sme->ssid_len);
+	if (ret) {
+		priv->state = CFG_NDIS_IDLE;
+		EXIT2(return ret);
+	}
+	queue_delayed_work(wnd->wq, &priv->connect_work,
+			   CFG_NDIS_CONNECT_TIMEOUT);
+	EXIT2(return 0);
+}
+
+static int cfg_ndis_disconnect(struct wiphy *wiphy, struct net_device *dev,
+			       u16 reason_code)
+{
+	struct cfg_ndis_priv *priv = wiphy_priv(wiphy);
+	struct ndis_device *wnd = netdev_priv(dev);
+	int state;
+
+	ENTER2("%d", reason_code);
+	cancel_delayed_work(&priv->connect_work);
+	state = xchg(&priv->state, CFG_NDIS_IDLE);
+	cfg_ndis_disassociate(wnd);
+	if (state == CFG_NDIS_CONNECTED)
+		cfg80211_disconnected(dev, reason_code, NULL, 0, true,
+				      GFP_KERNEL);
+	EXIT2(return 0);
+}
+
+static void cfg_ndis_connect_worker(struct work_struct *work)
+{
+	struct cfg_ndis_priv *priv;
+	struct ndis_device *wnd;
+	mac_address bssid;
+
+	priv = container_of(work, struct cfg_ndis_priv, connect_work.work);
+	wnd = priv->wnd;
+	ENTER2("%d", priv->state);
+	/* if miniport was associated with this network already, media
+	 * state doesn't change and there is no indication */
+	if (netif_carrier_ok(wnd->net_dev) &&
+	    mp_query(wnd, OID_802_11_BSSID, bssid, ETH_ALEN) ==
+	    NDIS_STATUS_SUCCESS &&
+	    cmpxchg(&priv->state, CFG_NDIS_CONNECTING,
+		    CFG_NDIS_CONNECTED) == CFG_NDIS_CONNECTING) {
+		cfg80211_connect_result(wnd->net_dev, bssid, NULL, 0, NULL, 0,
+					WLAN_STATUS_SUCCESS, GFP_KERNEL);
+		EXIT2(return);
+	}
+	if (cmpxchg(&priv->state, CFG_NDIS_CONNECTING, CFG_NDIS_IDLE) ==
+	    CFG_NDIS_CONNECTING)
+		cfg80211_connect_timeout(wnd->net_dev, NULL, NULL, 0,
+					 GFP_KERNEL,
+					 NL80211_TIMEOUT_UNSPECIFIED);
+	EXIT2(return);
+}
+
+static void cfg_ndis_link_ap_done(struct ndis_device *wnd,
+				  struct ndis_oid_request *req)
+{
+	struct cfg_ndis_assoc_ies *ies = req->ctx;
+	struct cfg_ndis_priv *priv;
+
+	/* link may have gone down while query was pending; if query
+	 * failed, connect_work checks again */
+	if (req->status != NDIS_STATUS_SUCCESS || !wnd->wdev ||
+	    !netif_carrier_ok(wnd->net_dev)) {
+		TRACE2("res: %08X", req->status);
+		goto out;
+	}
+	priv = cfg_ndis_priv(wnd);
+	TRACE2(MACSTRSEP, MAC2STR(req->buf));
+	if (cmpxchg(&priv->state, CFG_NDIS_CONNECTING,
+		    CFG_NDIS_CONNECTED) != CFG_NDIS_CONNECTING) {
+		TRACE2("not connecting: %d", priv->state);
+		goto out;
+	}
+	cancel_delayed_work(&priv->connect_work);
+	if (ies)
+		cfg80211_connect_result(wnd->net_dev, req->buf,
+					ies->ies, ies->req_ie_len,
+					ies->ies + ies->req_ie_len,
+					ies->resp_ie_len,
+					WLAN_STATUS_SUCCESS, GFP_KERNEL);
+	else
+		cfg80211_connect_result(wnd->net_dev, req->buf, NULL, 0,
+					NULL, 0, WLAN_STATUS_SUCCESS,
+					GFP_KERNEL);
+out:
+	kfree(ies);
+}
+
+static void cfg_ndis_link_assoc_done(struct ndis_device *wnd,
+				     struct ndis_oid_request *req)
+{
+	struct ndis_assoc_info *info;
+	struct cfg_ndis_assoc_ies *ies = NULL;
+
+	info = (struct ndis_assoc_info *)req->buf;
+	if (req->status == NDIS_STATUS_SUCCESS &&
+	    req->written >= sizeof(*info) &&
+	    (u64)info->offset_req_ies + info->req_ie_length <= req->written &&
+	    (u64)info->offset_resp_ies + info->resp_ie_length <=
+	    req->written) {
+		ies = kmalloc(sizeof(*ies) + info->req_ie_length +
+			      info->resp_ie_length, GFP_KERNEL);
+		if (ies) {
+			ies->req_ie_len = info->req_ie_length;
+			ies->resp_ie_len = info->resp_ie_length;
+			memcpy(ies->ies, req->buf + info->offset_req_ies,
+			       ies->req_ie_len);
+			memcpy(ies->ies + ies->req_ie_len,
+			       req->buf + info->offset_resp_ies,
+			       ies->resp_ie_len);
+		}
+	} else
+		TRACE2("query assoc_info failed (%08X)", req->status);
+
+	if (mp_query_async(wnd, OID_802_11_BSSID, ETH_ALEN,
+			   cfg_ndis_link_ap_done, ies)) {
+		ERROR("couldn't allocate memory");
+		kfree(ies);
+	}
+}
+
+void cfg_ndis_link_on(struct ndis_device *wnd)
+{
+	ENTER2("");
+	if (mp_query_async(wnd, OID_802_11_ASSOCIATION_INFORMATION,
+			   sizeof(struct ndis_assoc_info) +
+			   CFG_NDIS_ASSOC_IES_MAX,
+			   cfg_ndis_link_assoc_done, NULL))
+		ERROR("couldn't allocate memory");
+	EXIT2(return);
+}
+
+void cfg_ndis_link_off(struct ndis_device *wnd)
+{
+	struct cfg_ndis_priv *priv = cfg_ndis_priv(wnd);
+
+	ENTER2("%d", priv->state);
+	/* link of previous association may go down while connecting;
+	 * only loss of established connection is reported */
+	if (cmpxchg(&priv->state, CFG_NDIS_CONNECTED, CFG_NDIS_IDLE) ==
+	    CFG_NDIS_CONNECTED)
+		cfg80211_disconnected(wnd->net_dev, WLAN_REASON_UNSPECIFIED,
+				      NULL, 0, false, GFP_KERNEL);
+	EXIT2(return);
+}
+
+static void cfg_ndis_inform_bss(struct wiphy *wiphy,
+				struct ndis_wlan_bssid *bssid)
+{
+	struct ndis_wlan_bssid_ex *bssid_ex;
+	struct ieee80211_channel *chan;
+	struct cfg80211_bss *bss;
+	u8 ie_buf[2 + NDIS_ESSID_MAX_SIZE + 2 + NDIS_MAX_RATES];
+	const u8 *ie;
+	size_t ie_len;
+	__le64 tsf = 0;
+	u16 capa, beacon_period;
+	int i, n, nrates;
+
+	bssid_ex = (struct ndis_wlan_bssid_ex *)bssid;
+	/* ds_config is in kHz */
+	chan = ieee80211_get_channel(wiphy, bssid->config.ds_config / 1000);
+	if (!chan) {
+		TRACE2("no channel for %u kHz", bssid->config.ds_config);
+		return;
+	}
+	if (bssid->length > offsetof(struct ndis_wlan_bssid_ex, var) &&
+	    bssid_ex->ie_length > sizeof(bssid_ex->fixed)) {
+		ie = (const u8 *)bssid_ex->var;
+		ie_len = min_t(size_t,
+			       bssid_ex->ie_length - sizeof(bssid_ex->fixed),
+			       bssid->length -
+			       offsetof(struct ndis_wlan_bssid_ex, var));
+		memcpy(&tsf, bssid_ex->fixed.time_stamp, sizeof(tsf));
+		capa = bssid_ex->fixed.capa;
+		beacon_period = bssid_ex->fixed.beacon_interval;
+	} else {
+		/* driver doesn't give IEs; build SSID and rates IEs */
+		n = 0;
+		ie_buf[n++] = WLAN_EID_SSID;
+		ie_buf[n++] = min_t(ULONG, bssid->ssid.length,
+				    NDIS_ESSID_MAX_SIZE);
+		memcpy(&ie_buf[n], bssid->ssid.essid, ie_buf[n - 1]);
+		n += ie_buf[n - 1];
+		nrates = 0;
+		for (i = 0; i < NDIS_MAX_RATES; i++)
+			if (bssid->rates[i] & 0x7f)
+				ie_buf[n + 2 + nrates++] = bssid->rates[i];
+		if (nrates > 0) {
+			ie_buf[n++] = WLAN_EID_SUPP_RATES;
+			ie_buf[n++] = nrates;
+			n += nrates;
+		}
+		ie = ie_buf;
+		ie_len = n;
+		if (bssid->mode == Ndis802_11IBSS)
+			capa = WLAN_CAPABILITY_IBSS;
+		else
+			capa = WLAN_CAPABILITY_ESS;
+		if (bssid->privacy)
+			capa |= WLAN_CAPABILITY_PRIVACY;
+		beacon_period = bssid->config.beacon_period;
+	}
+	TRACE2(MACSTRSEP ", %d MHz, %d dBm, %zu", MAC2STR(bssid->mac),
+	       chan->center_freq, bssid->rssi, ie_len);
+	bss = cfg80211_inform_bss(wiphy, chan, CFG80211_BSS_FTYPE_UNKNOWN,
+				  bssid->mac, le64_to_cpu(tsf), capa,
+				  beacon_period, ie, ie_len,
+				  bssid->rssi * 100, GFP_KERNEL);
+	if (bss)
+		cfg80211_put_bss(wiphy, bss);
+}
+
+static void cfg_ndis_scan_worker(struct work_struct *work)
+{
+	struct cfg_ndis_priv *priv;
+	struct ndis_device *wnd;
+	struct cfg80211_scan_request *req;
+	struct cfg80211_scan_info info;
+	struct ndis_bssid_list *bssid_list;
+	struct ndis_wlan_bssid *cur_item;
+	ULONG data_len;
+	unsigned int i;
+	bool aborted;
+
+	priv = container_of(work, struct cfg_ndis_priv, scan_work.work);
+	wnd = priv->wnd;
+	ENTER2("%d", priv->scan_pass);
+	bssid_list = query_bssid_list(wnd, &data_len);
+	aborted = (bssid_list == NULL);
+	if (bssid_list && data_len > offsetof(struct ndis_bssid_list, bssid)) {
+		/* some drivers don't set num_items to 0 if there are
+		 * no items, so check data length, too */
+		data_len -= offsetof(struct ndis_bssid_list, bssid);
+		cur_item = &bssid_list->bssid[0];
+		TRACE2("items: %d", bssid_list->num_items);
+		for (i = 0; i < bssid_list->num_items; i++) {
+			/* drop truncated items */
+			if (cur_item->length < sizeof(*cur_item) ||
+			    cur_item->length > data_len)
+				break;
+			cfg_ndis_inform_bss(priv->wdev.wiphy, cur_item);
+			data_len -= cur_item->length;
+			cur_item = (struct ndis_wlan_bssid *)
+				((char *)cur_item + cur_item->length);
+		}
+	}
+	kfree(bssid_list);
+
+	if (!aborted && ++priv->scan_pass < CFG_NDIS_SCAN_PASSES) {
+		queue_delayed_work(wnd->wq, &priv->scan_work,
+				   CFG_NDIS_SCAN_INTERVAL);
+		EXIT2(return);
+	}
+	req = xchg(&priv->scan_req, NULL);
+	if (req) {
+		memset(&info, 0, sizeof(info));
+		info.aborted = aborted;
+		cfg80211_scan_done(req, &info);
+	}
+	EXIT2(return);
+}
+
+static int cfg_ndis_scan(struct wiphy *wiphy,
+			 struct cfg80211_scan_request *request)
+{
+	struct cfg_ndis_priv *priv = wiphy_priv(wiphy);
+	struct ndis_device *wnd = priv->wnd;
+	NDIS_STATUS res;
+
+	ENTER2("");
+	if (priv->scan_req)
+		EXIT2(return -EBUSY);
+	res = mp_set(wnd, OID_802_11_BSSID_LIST_SCAN, NULL, 0);
+	if (res) {
+		WARNING("scanning failed (%08X)", res);
+		EXIT2(return -EOPNOTSUPP);
+	}
+	wnd->scan_timestamp = jiffies;
+	priv->scan_pass = 0;
+	priv->scan_req = request;
+	queue_delayed_work(wnd->wq, &priv->scan_work, CFG_NDIS_SCAN_INTERVAL);
+	EXIT2(return 0);
+}
+
+static int cfg_ndis_get_station(struct wiphy *wiphy, struct net_device *dev,
+				const u8 *mac, struct station_info *sinfo)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	mac_address bssid;
+	ndis_rssi rssi;
+	ULONG speed;
+
+	/* BSSID, RSSI and link speed are answered from OID cache, so
+	 * frequent polling doesn't reach miniport */
+	if (!netif_carrier_ok(dev) ||
+	    mp_query(wnd, OID_802_11_BSSID, bssid, ETH_ALEN) ||
+	    !ether_addr_equal(mac, bssid))
+		return -ENOENT;
+	if (mp_query(wnd, OID_802_11_RSSI, &rssi, sizeof(rssi)) ==
+	    NDIS_STATUS_SUCCESS) {
+		sinfo->signal = rssi;
+		sinfo->filled |= BIT_ULL(NL80211_STA_INFO_SIGNAL);
+	}
+	if (mp_query_int(wnd, OID_GEN_LINK_SPEED, &speed) ==
+	    NDIS_STATUS_SUCCESS) {
+		/* link speed is in 100 bps, bitrate in 100 kbps */
+		sinfo->txrate.legacy = speed / 1000;
+		sinfo->filled |= BIT_ULL(NL80211_STA_INFO_TX_BITRATE);
+	}
+	return 0;
+}
+
+static int cfg_ndis_dump_station(struct wiphy *wiphy, struct net_device *dev,
+				 int idx, u8 *mac, struct station_info *sinfo)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+
+	/* only station is the AP */
+	if (idx != 0 || !netif_carrier_ok(dev) ||
+	    mp_query(wnd, OID_802_11_BSSID, mac, ETH_ALEN))
+		return -ENOENT;
+	return cfg_ndis_get_station(wiphy, dev, mac, sinfo);
+}
+
+static const struct cfg80211_ops cfg_ndis_ops = {
+	.scan = cfg_ndis_scan,
+	.connect = cfg_ndis_connect,
+	.disconnect = cfg_ndis_disconnect,
+	.add_key = cfg_ndis_add_key,
+	.del_key = cfg_ndis_del_key,
+	.set_default_key = cfg_ndis_set_default_key,
+	.get_station = cfg_ndis_get_station,
+	.dump_station = cfg_ndis_dump_station,
+};
+
+static bool cfg_ndis_has_5ghz(struct ndis_device *wnd)
+{
+	struct network_type_list *net_types;
+	ULONG buf[8];
+	int i;
+
+	memset(buf, 0, sizeof(buf));
+	if (mp_query(wnd, OID_802_11_NETWORK_TYPES_SUPPORTED, buf,
+		     sizeof(buf)) != NDIS_STATUS_SUCCESS)
+		return false;
+	net_types = (struct network_type_list *)buf;
+	for (i = 0; i < net_types->num && i < ARRAY_SIZE(buf) - 1; i++)
+		if (net_types->types[i] == Ndis802_11OFDM5)
+			return true;
+	return false;
+}
+
+int cfg_ndis_register(struct ndis_device *wnd)
+{
+	struct net_device *net_dev = wnd->net_dev;
+	struct cfg_ndis_priv *priv;
+	struct wiphy *wiphy;
+	int n, ret;
+
+	ENTER1("%p", wnd);
+	wiphy = wiphy_new(&cfg_ndis_ops, sizeof(*priv));
+	if (!wiphy) {
+		ERROR("couldn't allocate wiphy");
+		EXIT1(return -ENOMEM);
+	}
+	priv = wiphy_priv(wiphy);
+	priv->wnd = wnd;
+	priv->state = CFG_NDIS_IDLE;
+	INIT_DELAYED_WORK(&priv->scan_work, cfg_ndis_scan_worker);
+	INIT_DELAYED_WORK(&priv->connect_work, cfg_ndis_connect_worker);
+
+	memcpy(priv->rates, cfg_ndis_rates, sizeof(priv->rates));
+	memcpy(priv->channels_2ghz, cfg_ndis_channels_2ghz,
+	       sizeof(priv->channels_2ghz));
+	priv->band_2ghz.band = NL80211_BAND_2GHZ;
+	priv->band_2ghz.channels = priv->channels_2ghz;
+	priv->band_2ghz.n_channels = ARRAY_SIZE(priv->channels_2ghz);
+	priv->band_2ghz.bitrates = priv->rates;
+	priv->band_2ghz.n_bitrates = ARRAY_SIZE(priv->rates);
+	wiphy->bands[NL80211_BAND_2GHZ] = &priv->band_2ghz;
+	if (cfg_ndis_has_5ghz(wnd)) {
+		memcpy(priv->channels_5ghz, cfg_ndis_channels_5ghz,
+		       sizeof(priv->channels_5ghz));
+		priv->band_5ghz.band = NL80211_BAND_5GHZ;
+		priv->band_5ghz.channels = priv->channels_5ghz;
+		priv->band_5ghz.n_channels = ARRAY_SIZE(priv->channels_5ghz);
+		priv->band_5ghz.bitrates = priv->rates + CFG_NDIS_RATES_5GHZ;
+		priv->band_5ghz.n_bitrates =
+			ARRAY_SIZE(priv->rates) - CFG_NDIS_RATES_5GHZ;
+		wiphy->bands[NL80211_BAND_5GHZ] = &priv->band_5ghz;
+	}
+
+	n = 0;
+	if (test_bit(Ndis802_11Encryption1Enabled, &wnd->capa.encr)) {
+		priv->cipher_suites[n++] = WLAN_CIPHER_SUITE_WEP40;
+		priv->cipher_suites[n++] = WLAN_CIPHER_SUITE_WEP104;
+	}
+	if (test_bit(Ndis802_11Encryption2Enabled, &wnd->capa.encr))
+		priv->cipher_suites[n++] = WLAN_CIPHER_SUITE_TKIP;
+	if (test_bit(Ndis802_11Encryption3Enabled, &wnd->capa.encr))
+		priv->cipher_suites[n++] = WLAN_CIPHER_SUITE_CCMP;
+	wiphy->cipher_suites = priv->cipher_suites;
+	wiphy->n_cipher_suites = n;
+
+	wiphy->interface_modes = BIT(NL80211_IFTYPE_STATION);
+	wiphy->signal_type = CFG80211_SIGNAL_TYPE_MBM;
+	wiphy->max_scan_ssids = 1;
+	memcpy(wiphy->perm_addr, net_dev->dev_addr, ETH_ALEN);
+	set_wiphy_dev(wiphy, net_dev->dev.parent);
+
+	ret = wiphy_register(wiphy);
+	if (ret) {
+		ERROR("couldn't register wiphy: %d", ret);
+		wiphy_free(wiphy);
+		EXIT1(return ret);
+	}
+	priv->wdev.wiphy = wiphy;
+	priv->wdev.iftype = NL80211_IFTYPE_STATION;
+	priv->wdev.netdev = net_dev;
+	net_dev->ieee80211_ptr = &priv->wdev;
+	wnd->wdev = &priv->wdev;
+	EXIT1(return 0);
+}
+
+/* called when interface is brought down; cfg80211 expects pending
+ * scan to be finished by then */
+void cfg_ndis_stop(struct ndis_device *wnd)
+{
+	struct cfg_ndis_priv *priv;
+	struct cfg80211_scan_request *req;
+	struct cfg80211_scan_info info;
+
+	if (!wnd->wdev)
+		return;
+	priv = cfg_ndis_priv(wnd);
+	cancel_delayed_work_sync(&priv->scan_work);
+	req = xchg(&priv->scan_req, NULL);
+	if (req) {
+		memset(&info, 0, sizeof(info));
+		info.aborted = true;
+		cfg80211_scan_done(req, &info);
+	}
+}
+
+/* called after net device is unregistered */
+void cfg_ndis_unregister(struct ndis_device *wnd)
+{
+	struct cfg_ndis_priv *priv;
+	struct wiphy *wiphy;
+
+	if (!wnd->wdev)
+		return;
+	priv = cfg_ndis_priv(wnd);
+	wiphy = priv->wdev.wiphy;
+	cancel_delayed_work_sync(&priv->scan_work);
+	cancel_delayed_work_sync(&priv->connect_work);
+	wnd->net_dev->ieee80211_ptr = NULL;
+	wnd->wdev = NULL;
+	wiphy_unregister(wiphy);
+	wiphy_free(wiphy);
+}
+
+#endif // WRAP_CFG80211
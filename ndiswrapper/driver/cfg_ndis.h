@@ -0,0 +1,61 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _CFG_NDIS_H_
+#define _CFG_NDIS_H_
+
+#include "ndis.h"
+
+/* cfg80211 interface needs cfg80211_scan_info, cfg80211_connect_timeout
+ * etc., so older kernels use only wireless extensions */
+#if defined(ENABLE_CFG80211) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#define WRAP_CFG80211
+#endif
+
+#ifdef WRAP_CFG80211
+
+int cfg_ndis_register(struct ndis_device *wnd);
+void cfg_ndis_unregister(struct ndis_device *wnd);
+void cfg_ndis_stop(struct ndis_device *wnd);
+void cfg_ndis_link_on(struct ndis_device *wnd);
+void cfg_ndis_link_off(struct ndis_device *wnd);
+
+#else
+
+static inline int cfg_ndis_register(struct ndis_device *wnd)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline void cfg_ndis_unregister(struct ndis_device *wnd)
+{
+}
+
+static inline void cfg_ndis_stop(struct ndis_device *wnd)
+{
+}
+
+static inline void cfg_ndis_link_on(struct ndis_device *wnd)
+{
+}
+
+static inline void cfg_ndis_link_off(struct ndis_device *wnd)
+{
+}
+
+#endif // WRAP_CFG80211
+
+#endif // CFG_NDIS_H
@@ -1211,6 +1211,156 @@ static char *ndis_translate_scan(struct net_device *dev,
 	EXIT2(return event);
 }
 
+static unsigned int bss_hash(const u8 *mac)
+{
+	return mac[ETH_ALEN - 1] % BSS_CACHE_HASH_SIZE;
+}
+
+static struct bss_cache_entry *bss_cache_find(struct bss_cache *cache,
+					      const u8 *mac)
+{
+	struct bss_cache_entry *entry;
+
+	nt_list_for_each_entry(entry, &cache->hash[bss_hash(mac)], list) {
+		if (memcmp(entry->mac, mac, ETH_ALEN) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* called with cache mutex held */
+static int bss_cache_update(struct ndis_device *wnd)
+{
+	struct bss_cache *cache = &wnd->bss_cache;
+	struct ndis_bssid_list *bssid_list;
+	struct ndis_wlan_bssid *cur_item;
+	struct bss_cache_entry *entry;
+	struct nt_list *cur, *next;
+	ULONG data_len;
+	unsigned int i;
+
+	ENTER2("");
+	bssid_list = query_bssid_list(wnd, &data_len);
+	if (!bssid_list)
+		EXIT2(return -EOPNOTSUPP);
+
+	TRACE2("items: %d", bssid_list->num_items);
+	if (data_len > offsetof(struct ndis_bssid_list, bssid))
+		data_len -= offsetof(struct ndis_bssid_list, bssid);
+	else
+		data_len = 0;
+	cur_item = &bssid_list->bssid[0];
+	for (i = 0; i < bssid_list->num_items; i++) {
+		TRACE2("item %d: len %d, remaining data %d",
+		       i, cur_item->length, data_len);
+		/* drop truncated items */
+		if (cur_item->length < sizeof(*cur_item) ||
+		    cur_item->length > data_len)
+			break;
+		entry = bss_cache_find(cache, cur_item->mac);
+		if (entry && entry->length != cur_item->length) {
+			RemoveEntryList(&entry->list);
+			kfree(entry);
+			cache->count--;
+			entry = NULL;
+		}
+		if (!entry) {
+			entry = kmalloc(sizeof(*entry) + cur_item->length,
+					GFP_KERNEL);
+			if (!entry) {
+				ERROR("couldn't allocate memory");
+				break;
+			}
+			memcpy(entry->mac, cur_item->mac, ETH_ALEN);
+			entry->length = cur_item->length;
+			InsertTailList(&cache->hash[bss_hash(entry->mac)],
+				       &entry->list);
+			cache->count++;
+		}
+		memcpy(entry->data, cur_item, cur_item->length);
+		entry->seen = jiffies;
+		data_len -= cur_item->length;
+		cur_item = (struct ndis_wlan_bssid *)((char *)cur_item +
+						      cur_item->length);
+	}
+	kfree(bssid_list);
+
+	/* drop BSSes not reported for a while */
+	for (i = 0; i < BSS_CACHE_HASH_SIZE; i++) {
+		nt_list_for_each_safe(cur, next, &cache->hash[i]) {
+			entry = container_of(cur, struct bss_cache_entry, list);
+			if (time_after(jiffies,
+				       entry->seen + BSS_CACHE_EXPIRE)) {
+				RemoveEntryList(cur);
+				kfree(entry);
+				cache->count--;
+			}
+		}
+	}
+	/* generation 0 means cache was never updated */
+	if (++cache->gen == 0)
+		cache->gen = 1;
+	cache->updated = jiffies;
+	TRACE2("%u entries, generation %u", cache->count, cache->gen);
+	EXIT2(return 0);
+}
+
+static void bss_cache_scan_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+	union iwreq_data wrqu;
+	int ret;
+
+	wnd = container_of(work, struct ndis_device, bss_cache.scan_work.work);
+	mutex_lock(&wnd->bss_cache.mutex);
+	ret = bss_cache_update(wnd);
+	mutex_unlock(&wnd->bss_cache.mutex);
+	/* tell user space results are ready, so it doesn't poll */
+	if (ret == 0) {
+		memset(&wrqu, 0, sizeof(wrqu));
+		wireless_send_event(wnd->net_dev, SIOCGIWSCAN, &wrqu, NULL);
+	}
+}
+
+void bss_cache_init(struct ndis_device *wnd)
+{
+	struct bss_cache *cache = &wnd->bss_cache;
+	int i;
+
+	mutex_init(&cache->mutex);
+	for (i = 0; i < BSS_CACHE_HASH_SIZE; i++)
+		InitializeListHead(&cache->hash[i]);
+	cache->count = 0;
+	cache->gen = 0;
+	cache->updated = 0;
+	cache->events = NULL;
+	cache->events_len = 0;
+	cache->events_gen = 0;
+	cache->events_flags = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	INIT_DELAYED_WORK(&cache->scan_work, bss_cache_scan_worker);
+}
+
+void bss_cache_free(struct ndis_device *wnd)
+{
+	struct bss_cache *cache = &wnd->bss_cache;
+	struct nt_list *ent;
+	int i;
+
+	cancel_delayed_work_sync(&cache->scan_work);
+	mutex_lock(&cache->mutex);
+	for (i = 0; i < BSS_CACHE_HASH_SIZE; i++) {
+		while ((ent = RemoveHeadList(&cache->hash[i])))
+			kfree(container_of(ent, struct bss_cache_entry, list));
+	}
+	cache->count = 0;
+	cache->gen = 0;
+	kfree(cache->events);
+	cache->events = NULL;
+	mutex_unlock(&cache->mutex);
+}
+
 static int set_scan(struct ndis_device *wnd)
 {
 	NDIS_STATUS res;
@@ -1222,6 +1372,9 @@ static int set_scan(struct ndis_device *wnd)
 		EXIT2(return -EOPNOTSUPP);
 	}
 	wnd->scan_timestamp = jiffies;
+	/* results are collected once, when scan is done */
+	cancel_delayed_work(&wnd->bss_cache.scan_work);
+	queue_delayed_work(wnd->wq, &wnd->bss_cache.scan_work, 3 * HZ);
 	EXIT2(return 0);
 }
 
@@ -1236,69 +1389,70 @@ static int iw_get_scan(struct net_device *dev, struct iw_request_info *info,
 		       union iwreq_data *wrqu, char *extra)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
-	unsigned int i, buf_len, needed, data_len;
-	NDIS_STATUS res;
-	struct ndis_bssid_list *bssid_list = NULL;
+	struct bss_cache *cache = &wnd->bss_cache;
+	struct bss_cache_entry *entry;
+	unsigned int flags;
 	char *event = extra;
-	struct ndis_wlan_bssid *cur_item;
+	int i, ret = 0;
 
 	ENTER2("");
-	if (time_before(jiffies, wnd->scan_timestamp + 3 * HZ))
+	/* scan in progress */
+	if (delayed_work_pending(&cache->scan_work))
 		return -EAGAIN;
-	/* try with space for a few scan items */
-	buf_len = sizeof(ULONG) + offsetof(struct ndis_wlan_bssid_ex, var) * 8;
-
-	/* Try many times, as the needed space may grow between queries */
-	for (i = 0; i < 10; i++) {
-		bssid_list = kzalloc(buf_len, GFP_KERNEL);
-		if (!bssid_list) {
-			ERROR("couldn't allocate %u bytes for scan results",
-			      buf_len);
-			return -ENOMEM;
-		}
-
-		needed = 0;
-		data_len = 0;
-		res = mp_query_info(wnd, OID_802_11_BSSID_LIST, bssid_list,
-				    buf_len, &data_len, &needed);
-		TRACE2("try %d: given %d bytes, needed %d, written %d",
-		       i, buf_len, needed, data_len);
-		if (needed <= buf_len)
-			break;
-		kfree(bssid_list);
-		buf_len = needed;
+	mutex_lock(&cache->mutex);
+	/* without scan requested by us, results are what miniport
+	 * found on its own */
+	if ((cache->gen == 0 ||
+	     time_after(jiffies, cache->updated + BSS_CACHE_EXPIRE)) &&
+	    bss_cache_update(wnd)) {
+		ret = -EOPNOTSUPP;
+		goto out;
 	}
-	if (res) {
-		WARNING("getting BSSID list failed (%08X)", res);
-		kfree(bssid_list);
-		EXIT2(return -EOPNOTSUPP);
+
+	/* event layout depends on whether caller is compat task */
+#ifdef IW_REQUEST_FLAG_COMPAT
+	flags = info->flags & IW_REQUEST_FLAG_COMPAT;
+#else
+	flags = 0;
+#endif
+	if (cache->events && cache->events_gen == cache->gen &&
+	    cache->events_flags == flags) {
+		cache->hits++;
+		if (cache->events_len > wrqu->data.length) {
+			ret = -E2BIG;
+			goto out;
+		}
+		memcpy(extra, cache->events, cache->events_len);
+		wrqu->data.length = cache->events_len;
+		wrqu->data.flags = 0;
+		goto out;
 	}
 
-	/* some drivers don't set bssid_list->num_items to 0 if
-	   OID_802_11_BSSID_LIST returns no items (prism54 driver, e.g.,) */
-	TRACE2("items: %d", bssid_list->num_items);
-	cur_item = &bssid_list->bssid[0];
-	for (i = 0; i < bssid_list->num_items; i++) {
-		TRACE2("item %d: len %d, remaining data %d",
-		       i, cur_item->length, data_len);
-		/* drop truncated items */
-		if (cur_item->length > data_len)
-			break;
-		event = ndis_translate_scan(dev, info, event,
-					    extra + wrqu->data.length,
-					    cur_item);
-		if (!event) {
-			kfree(bssid_list);
-			return -E2BIG;
+	cache->misses++;
+	for (i = 0; i < BSS_CACHE_HASH_SIZE; i++) {
+		nt_list_for_each_entry(entry, &cache->hash[i], list) {
+			event = ndis_translate_scan(dev, info, event,
+						    extra + wrqu->data.length,
+						    entry->data);
+			if (!event) {
+				ret = -E2BIG;
+				goto out;
+			}
 		}
-		data_len -= cur_item->length;
-		cur_item = (struct ndis_wlan_bssid *)((char *)cur_item +
-						      cur_item->length);
 	}
 	wrqu->data.length = event - extra;
 	wrqu->data.flags = 0;
-	kfree(bssid_list);
-	EXIT2(return 0);
+	kfree(cache->events);
+	cache->events = kmalloc(wrqu->data.length, GFP_KERNEL);
+	if (cache->events) {
+		memcpy(cache->events, extra, wrqu->data.length);
+		cache->events_len = wrqu->data.length;
+		cache->events_gen = cache->gen;
+		cache->events_flags = flags;
+	}
+out:
+	mutex_unlock(&cache->mutex);
+	EXIT2(return ret);
 }
 
 static int iw_set_power_mode(struct net_device *dev,
@@ -1394,6 +1548,7 @@ static int iw_set_sensitivity(struct net_device *dev,
 		return -EINVAL;
 	if (res)
 		return -EOPNOTSUPP;
+	wnd->rssi_trigger = rssi_trigger;
 	return 0;
 }
 
@@ -1401,8 +1556,7 @@ static int iw_get_ndis_stats(struct net_device *dev,
 			     struct iw_request_info *info,
 			     union iwreq_data *wrqu, char *extra)
 {
-	struct ndis_device *wnd = netdev_priv(dev);
-	struct iw_statistics *stats = &wnd->iw_stats;
+	struct iw_statistics *stats = get_iw_stats(dev);
 	memcpy(&wrqu->qual, &stats->qual, sizeof(stats->qual));
 	return 0;
 }
@@ -174,6 +174,8 @@ int set_iw_encr_mode(struct ndis_device *wnd, int cipher_pairwise,
 int get_ndis_auth_mode(struct ndis_device *wnd);
 NDIS_STATUS disassociate(struct ndis_device *wnd, int reset_ssid);
 void set_default_iw_params(struct ndis_device *wnd);
+void bss_cache_init(struct ndis_device *wnd);
+void bss_cache_free(struct ndis_device *wnd);
 extern const struct iw_handler_def ndis_handler_def;
 
 #define PRIV_RESET			SIOCIWFIRSTPRIV+16
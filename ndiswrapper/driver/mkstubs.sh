@@ -2,7 +2,9 @@
 
 for file in "$@"; do
 	echo
-	echo "# automatically generated from $file"
+	# C comment, as the output is also included from C with
+	# WIN2LIN_PROFILE
+	echo "/* automatically generated from $file */"
 	sed -n \
 		-e 's/.*WIN_FUNC(\([^\,]\+\) *\, *\([0-9]\+\)).*/\
 		   win2lin(\1, \2)/p'   \
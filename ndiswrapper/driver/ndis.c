@@ -18,6 +18,8 @@
 #include "wrapndis.h"
 #include "pnp.h"
 #include "loader.h"
+#include "wrapper.h"
+#include "trace_ndis.h"
 #include <linux/kernel_stat.h>
 #include <asm/dma.h>
 #include "ndis_exports.h"
@@ -26,9 +28,6 @@
 	#define PCI_DMA_TODEVICE DMA_TO_DEVICE
 #endif
 
-#define MAX_ALLOCATED_NDIS_PACKETS TX_RING_SIZE
-#define MAX_ALLOCATED_NDIS_BUFFERS TX_RING_SIZE
-
 static struct work_struct ndis_work;
 static struct nt_list ndis_work_list;
 static spinlock_t ndis_work_list_lock;
@@ -896,40 +895,62 @@ wstdcall void WIN_FUNC(NdisInitializeReadWriteLock,1)
 	return;
 }
 
-/* read/write locks are implemented in a rather simplistic way - we
- * should probably use Linux's rw_lock implementation */
+/* As in Windows, a reader raises IRQL to DISPATCH_LEVEL and counts
+ * itself in the ref_count slot of its processor only, so readers on
+ * different processors don't share a cache line. There are only
+ * MAXIMUM_PROCESSORS slots, so processors from MAXIMUM_PROCESSORS - 1
+ * on share the last one. A writer takes klock and sets 'writer',
+ * which stops new readers, and then waits for all slots to drain. A
+ * reader that finds its slot already in use (i.e., it is acquiring
+ * the lock recursively on this processor, or, in the shared slot,
+ * another processor holds it) doesn't wait for a pending writer, as
+ * that would deadlock. */
 
 wstdcall void WIN_FUNC(NdisAcquireReadWriteLock,3)
 	(struct ndis_rw_lock *rw_lock, BOOLEAN write,
 	 struct lock_state *lock_state)
 {
+	volatile LONG *count;
+	int cpu, i, n;
+
+	lock_state->irql = raise_irql(DISPATCH_LEVEL);
 	if (write) {
-		while (1) {
-			if (cmpxchg(&rw_lock->count, 0, -1) == 0)
-				return;
-			while (rw_lock->count)
+		nt_spin_lock(&rw_lock->klock);
+		xchg(&rw_lock->writer, 1);
+		n = min_t(int, nr_cpu_ids, MAXIMUM_PROCESSORS);
+		for (i = 0; i < n; i++)
+			while (rw_lock->ref_count[i].count)
 				cpu_relax();
-		}
+		lock_state->state = NDIS_RW_LOCK_WRITE;
 		return;
 	}
-	while (1) {
-		typeof(rw_lock->count) count;
-		while ((count = rw_lock->count) < 0)
-			cpu_relax();
-		if (cmpxchg(&rw_lock->count, count, count + 1) == count)
-			return;
+	cpu = min_t(int, smp_processor_id(), MAXIMUM_PROCESSORS - 1);
+	count = &rw_lock->ref_count[cpu].count;
+	if (pre_atomic_add(*count, 1) == 0) {
+		while (unlikely(rw_lock->writer)) {
+			atomic_dec_var(*count);
+			while (rw_lock->writer)
+				cpu_relax();
+			atomic_inc_var(*count);
+		}
 	}
+	lock_state->state = cpu;
 }
 
 wstdcall void WIN_FUNC(NdisReleaseReadWriteLock,2)
 	(struct ndis_rw_lock *rw_lock, struct lock_state *lock_state)
 {
-	if (rw_lock->count > 0)
-		pre_atomic_add(rw_lock->count, -1);
-	else if (rw_lock->count == -1)
-		rw_lock->count = 0;
-	else
-		WARNING("invalid state: %d", rw_lock->count);
+	if (lock_state->state == NDIS_RW_LOCK_WRITE) {
+		rw_lock->writer = 0;
+		nt_spin_unlock(&rw_lock->klock);
+	} else if (lock_state->state < MAXIMUM_PROCESSORS &&
+		   rw_lock->ref_count[lock_state->state].count > 0)
+		atomic_dec_var(rw_lock->ref_count[lock_state->state].count);
+	else {
+		WARNING("invalid state: %d", lock_state->state);
+		return;
+	}
+	lower_irql(lock_state->irql);
 }
 
 wstdcall NDIS_STATUS WIN_FUNC(NdisMAllocateMapRegisters,5)
@@ -1282,7 +1303,8 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 		EXIT4(return);
 	}
 	pool = buffer->pool;
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_BUFFERS) {
+	/* keep as many descriptors for reuse as pool may hand out */
+	if (pool->num_allocated_descr > pool->max_descr) {
 		/* NB NB NB: set mdl's 'pool' field to NULL before
 		 * calling free_mdl; otherwise free_mdl calls
 		 * NdisFreeBuffer back */
@@ -1551,8 +1573,10 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 	packet_length = sizeof(*packet) - 1 + pool->proto_rsvd_length +
 		sizeof(struct ndis_packet_oob_data);
 	spin_lock_bh(&pool->lock);
-	if ((packet = pool->free_descr))
+	if ((packet = pool->free_descr)) {
 		pool->free_descr = (void *)packet->reserved[0];
+		pool->hits++;
+	}
 	spin_unlock_bh(&pool->lock);
 	if (!packet) {
 		packet = kmalloc(packet_length, irql_gfp());
@@ -1563,6 +1587,7 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 			return;
 		}
 		atomic_inc_var(pool->num_allocated_descr);
+		atomic_inc_var(pool->allocs);
 	}
 	TRACE4("%p, %p", pool, packet);
 	atomic_inc_var(pool->num_used_descr);
@@ -1601,7 +1626,7 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 		kfree((void *)packet->reserved[1]);
 		packet->reserved[1] = 0;
 	}
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_PACKETS) {
+	if (pool->num_allocated_descr > pool->max_descr) {
 		TRACE3("%p", pool);
 		atomic_dec_var(pool->num_allocated_descr);
 		kfree(packet);
@@ -1903,6 +1928,8 @@ wstdcall void deserialized_irq_handler(struct kdpc *kdpc, void *ctx,
 
 	TRACE6("%p", irq_handler);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
+	wrap_latency_hist_add(wnd->dpc_latency_hist, ktime_to_ns(ktime_get()) -
+			      wnd->irq_dpc_queued);
 	LIN2WIN1(irq_handler, wnd->nmb->mp_ctx);
 	if (mp->enable_interrupt)
 		LIN2WIN1(mp->enable_interrupt, wnd->nmb->mp_ctx);
@@ -1918,6 +1945,8 @@ wstdcall void serialized_irq_handler(struct kdpc *kdpc, void *ctx,
 
 	TRACE6("%p, %p, %p", wnd, irq_handler, arg2);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
+	wrap_latency_hist_add(wnd->dpc_latency_hist, ktime_to_ns(ktime_get()) -
+			      wnd->irq_dpc_queued);
 	serialize_lock(wnd);
 	LIN2WIN1(irq_handler, arg2);
 	serialize_unlock(wnd);
@@ -1932,6 +1961,7 @@ wstdcall BOOLEAN ndis_isr(struct kinterrupt *kinterrupt, void *ctx)
 	BOOLEAN recognized = TRUE, queue_handler = TRUE;
 
 	TRACE6("%p", wnd);
+	trace_ndis_isr_entry(wnd);
 	/* kernel may call ISR when registering interrupt, in
 	 * the same context if DEBUG_SHIRQ is enabled */
 	assert_irql(_irql_ == DIRQL || _irql_ == PASSIVE_LEVEL);
@@ -1947,11 +1977,20 @@ wstdcall BOOLEAN ndis_isr(struct kinterrupt *kinterrupt, void *ctx)
 	}
 	if (recognized) {
 		if (queue_handler) {
+			u64 queued = wnd->irq_dpc_queued;
+
 			TRACE5("%p", &wnd->irq_kdpc);
-			queue_kdpc(&wnd->irq_kdpc);
+			/* DPC may run on another CPU before queue_kdpc
+			 * returns, so time is stored before queueing */
+			wnd->irq_dpc_queued = ktime_to_ns(ktime_get());
+			/* if already queued, it was queued at old time */
+			if (!queue_kdpc(&wnd->irq_kdpc))
+				wnd->irq_dpc_queued = queued;
 		}
+		trace_ndis_isr_exit(wnd, TRUE, queue_handler);
 		EXIT6(return TRUE);
 	}
+	trace_ndis_isr_exit(wnd, FALSE, FALSE);
 	EXIT6(return FALSE);
 }
 WIN_FUNC_DECL(ndis_isr,2)
@@ -2028,7 +2067,7 @@ wstdcall void WIN_FUNC(NdisMDeregisterInterrupt,1)
 	nmb->wnd->mp_interrupt = NULL;
 	if (dequeue_kdpc(&nmb->wnd->irq_kdpc))
 		TRACE2("interrupt kdpc was pending");
-	flush_workqueue(wrapndis_wq);
+	flush_workqueue(nmb->wnd->wq);
 	IoDisconnectInterrupt(mp_interrupt->kinterrupt);
 	EXIT1(return);
 }
@@ -2050,9 +2089,11 @@ wstdcall void WIN_FUNC(NdisMIndicateStatus,4)
 	ENTER2("status=0x%x len=%d", status, len);
 	switch (status) {
 	case NDIS_STATUS_MEDIA_CONNECT:
+		oid_cache_invalidate(wnd);
 		set_media_state(wnd, NdisMediaStateConnected);
 		break;
 	case NDIS_STATUS_MEDIA_DISCONNECT:
+		oid_cache_invalidate(wnd);
 		set_media_state(wnd, NdisMediaStateDisconnected);
 		break;
 	case NDIS_STATUS_MEDIA_SPECIFIC_INDICATION:
@@ -2164,7 +2205,14 @@ wstdcall void WIN_FUNC(NdisMIndicateStatus,4)
 		}
 #endif
 		default:
-			/* is this RSSI indication? */
+			/* with OID_802_11_RSSI_TRIGGER programmed, RSSI
+			 * crossing it is indicated as bare ndis_rssi,
+			 * without status type */
+			if (wnd->rssi_trigger && len == sizeof(ndis_rssi)) {
+				iw_stats_rssi_indication(wnd,
+							 *(ndis_rssi *)buf);
+				break;
+			}
 			TRACE2("unknown indication: %x", si->status_type);
 			break;
 		}
@@ -2184,7 +2232,7 @@ wstdcall void WIN_FUNC(NdisMIndicateStatusComplete,1)
 	struct ndis_device *wnd = nmb->wnd;
 	ENTER2("%p", wnd);
 	if (wnd->tx_ok)
-		queue_work(wrapndis_wq, &wnd->tx_work);
+		queue_tx_work(wnd);
 }
 
 /* called via function pointer */
@@ -2194,6 +2242,7 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 	struct ndis_device *wnd = nmb->wnd;
 	ENTER4("%p, %08X", packet, status);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
+	trace_ndis_send_complete(wnd, packet, status);
 	if (deserialized_driver(wnd))
 		free_tx_packet(wnd, packet, status);
 	else {
@@ -2218,7 +2267,7 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 		 */
 		if (xchg(&wnd->tx_ok, 1) == 0) {
 			TRACE3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-			queue_work(wrapndis_wq, &wnd->tx_work);
+			queue_tx_work(wnd);
 		}
 	}
 	EXIT3(return);
@@ -2230,28 +2279,41 @@ wstdcall void NdisMSendResourcesAvailable(struct ndis_mp_block *nmb)
 	struct ndis_device *wnd = nmb->wnd;
 	ENTER3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
 	wnd->tx_ok = 1;
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	queue_tx_work(wnd);
 	EXIT3(return);
 }
 
-wstdcall void return_packet(void *arg1, void *arg2)
+/* return all packets queued by NdisMIndicateReceivePacket with one
+ * raise of IRQL */
+void return_packets_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
-	struct ndis_packet *packet;
+	struct ndis_packet *packet, *next;
 	struct miniport *mp;
 	KIRQL irql;
 
-	wnd = arg1;
-	packet = arg2;
+	wnd = container_of(work, struct ndis_device, return_packets_work);
+	spin_lock_bh(&wnd->return_packets_lock);
+	packet = wnd->return_packets_head;
+	wnd->return_packets_head = NULL;
+	wnd->return_packets_tail = NULL;
+	spin_unlock_bh(&wnd->return_packets_lock);
 	ENTER4("%p, %p", wnd, packet);
+	if (!packet)
+		EXIT4(return);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	irql = serialize_lock_irql(wnd);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
-	LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+	while (packet) {
+		next = NDIS_PACKET_RETURN_NEXT(packet);
+		LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+		wnd->rx_deferred_returns++;
+		packet = next;
+	}
 	serialize_unlock_irql(wnd, irql);
+	wnd->rx_return_batches++;
 	EXIT4(return);
 }
-WIN_FUNC_DECL(return_packet,2)
 
 /* called via function pointer */
 wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
@@ -2260,7 +2322,7 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 {
 	struct ndis_device *wnd;
 	ndis_buffer *buffer;
-	struct ndis_packet *packet;
+	struct ndis_packet *packet, *head, *tail;
 	struct sk_buff *skb;
 	ULONG i, length, total_length;
 	struct ndis_packet_oob_data *oob_data;
@@ -2270,6 +2332,8 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 	ENTER3("%p, %d", nmb, nr_packets);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
 	wnd = nmb->wnd;
+	trace_ndis_rx_indicate(wnd, nr_packets);
+	head = tail = NULL;
 	for (i = 0; i < nr_packets; i++) {
 		packet = packets[i];
 		if (!packet) {
@@ -2296,8 +2360,7 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 			}
 			skb->dev = wnd->net_dev;
 			skb->protocol = eth_type_trans(skb, wnd->net_dev);
-			pre_atomic_add(wnd->net_stats.rx_bytes, total_length);
-			atomic_inc_var(wnd->net_stats.rx_packets);
+			ndis_stats_packet(wnd, rx, total_length);
 			csum.value = (typeof(csum.value))(ULONG_PTR)
 				oob_data->ext.info[TcpIpChecksumPacketInfo];
 			TRACE3("0x%05x", csum.value);
@@ -2319,7 +2382,7 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 
 		} else {
 			WARNING("couldn't allocate skb; packet dropped");
-			atomic_inc_var(wnd->net_stats.rx_dropped);
+			ndis_stats_inc(wnd, rx_dropped);
 		}
 
 		/* serialized drivers check the status upon return
@@ -2342,8 +2405,23 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		 * MiniportReturnPacket from here is not correct - the
 		 * driver doesn't expect it (at least Centrino driver
 		 * crashes) */
-		schedule_ntos_work_item(WIN_FUNC_PTR(return_packet,2),
-					wnd, packet);
+		NDIS_PACKET_RETURN_NEXT(packet) = NULL;
+		if (tail)
+			NDIS_PACKET_RETURN_NEXT(tail) = packet;
+		else
+			head = packet;
+		tail = packet;
+	}
+	if (head) {
+		spin_lock_bh(&wnd->return_packets_lock);
+		if (wnd->return_packets_tail)
+			NDIS_PACKET_RETURN_NEXT(wnd->return_packets_tail) =
+				head;
+		else
+			wnd->return_packets_head = head;
+		wnd->return_packets_tail = tail;
+		spin_unlock_bh(&wnd->return_packets_lock);
+		queue_work(ntos_wq, &wnd->return_packets_work);
 	}
 	EXIT3(return);
 }
@@ -2371,6 +2449,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 		ERROR("nmb is NULL");
 		EXIT3(return);
 	}
+	trace_ndis_rx_indicate(wnd, 1);
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(4,11,0)
 	wnd->net_dev->last_rx = jiffies;
 #endif
@@ -2383,7 +2462,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 
 		NdisAllocatePacket(&res, &packet, wnd->tx_packet_pool);
 		if (res != NDIS_STATUS_SUCCESS) {
-			atomic_inc_var(wnd->net_stats.rx_dropped);
+			ndis_stats_inc(wnd, rx_dropped);
 			EXIT3(return);
 		}
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
@@ -2401,7 +2480,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 					    bytes_txed);
 			if (!skb) {
 				ERROR("couldn't allocate skb; packet dropped");
-				atomic_inc_var(wnd->net_stats.rx_dropped);
+				ndis_stats_inc(wnd, rx_dropped);
 				NdisFreePacket(packet);
 				return;
 			}
@@ -2431,7 +2510,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 			if (!oob_data->look_ahead) {
 				NdisFreePacket(packet);
 				ERROR("packet dropped");
-				atomic_inc_var(wnd->net_stats.rx_dropped);
+				ndis_stats_inc(wnd, rx_dropped);
 				EXIT3(return);
 			}
 			assert(sizeof(oob_data->header) == header_size);
@@ -2443,7 +2522,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 			EXIT3(return);
 		} else {
 			WARNING("packet dropped: %08X", res);
-			atomic_inc_var(wnd->net_stats.rx_dropped);
+			ndis_stats_inc(wnd, rx_dropped);
 			NdisFreePacket(packet);
 			EXIT3(return);
 		}
@@ -2459,8 +2538,7 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 	if (skb) {
 		skb->dev = wnd->net_dev;
 		skb->protocol = eth_type_trans(skb, wnd->net_dev);
-		pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
-		atomic_inc_var(wnd->net_stats.rx_packets);
+		ndis_stats_packet(wnd, rx, skb_size);
 		#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,18,0)
 			if (in_interrupt())
 				netif_rx(skb);
@@ -2503,7 +2581,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 		kfree(oob_data->look_ahead);
 		NdisFreePacket(packet);
 		ERROR("couldn't allocate skb; packet dropped");
-		atomic_inc_var(wnd->net_stats.rx_dropped);
+		ndis_stats_inc(wnd, rx_dropped);
 		EXIT3(return);
 	}
 	memcpy_skb(skb, oob_data->header, sizeof(oob_data->header));
@@ -2518,8 +2596,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	NdisFreePacket(packet);
 	skb->dev = wnd->net_dev;
 	skb->protocol = eth_type_trans(skb, wnd->net_dev);
-	pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
-	atomic_inc_var(wnd->net_stats.rx_packets);
+	ndis_stats_packet(wnd, rx, skb_size);
 
 	csum.value = (typeof(csum.value))(ULONG_PTR)
 		oob_data->ext.info[TcpIpChecksumPacketInfo];
@@ -2554,6 +2631,8 @@ wstdcall void NdisMQueryInformationComplete(struct ndis_mp_block *nmb,
 	typeof(wnd->ndis_req_task) task;
 
 	ENTER2("nmb: %p, wnd: %p, %08X", nmb, wnd, status);
+	if (oid_req_complete(wnd, status))
+		EXIT2(return);
 	wnd->ndis_req_status = status;
 	wnd->ndis_req_done = 1;
 	if ((task = xchg(&wnd->ndis_req_task, NULL)))
@@ -2571,6 +2650,8 @@ wstdcall void NdisMSetInformationComplete(struct ndis_mp_block *nmb,
 	typeof(wnd->ndis_req_task) task;
 
 	ENTER2("status = %08X", status);
+	if (oid_req_complete(wnd, status))
+		EXIT2(return);
 	wnd->ndis_req_status = status;
 	wnd->ndis_req_done = 1;
 	if ((task = xchg(&wnd->ndis_req_task, NULL)))
@@ -2888,6 +2969,8 @@ wstdcall void WIN_FUNC(NdisMCoRequestComplete,3)
 	typeof(wnd->ndis_req_task) task;
 
 	ENTER3("%08X", status);
+	if (oid_req_complete(wnd, status))
+		EXIT3(return);
 	wnd->ndis_req_status = status;
 	wnd->ndis_req_done = 1;
 	if ((task = xchg(&wnd->ndis_req_task, NULL)))
@@ -2997,6 +3080,10 @@ int ndis_init_device(struct ndis_device *wnd)
 	KeInitializeSpinLock(&nmb->lock);
 	wnd->mp_interrupt = NULL;
 	wnd->wrap_timer_slist.next = NULL;
+	wnd->timer_slack = timer_slack_jiffies(timer_slack);
+	wnd->timer_fires = 0;
+	wnd->timer_wakeups = 0;
+	wnd->timer_last_wakeup = jiffies;
 	if (wnd->wd->driver->ndis_driver)
 		wnd->wd->driver->ndis_driver->mp.shutdown = NULL;
 
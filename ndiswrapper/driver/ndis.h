@@ -17,6 +17,7 @@
 #define _NDIS_H_
 
 #include "ntoskernel.h"
+#include "nl_ndis.h"
 
 //#define ALLOW_POOL_OVERFLOW 1
 
@@ -214,6 +215,9 @@ struct ndis_packet_pool {
 	UINT num_allocated_descr;
 	UINT num_used_descr;
 	UINT proto_rsvd_length;
+	/* packets allocated with kmalloc and reused from free_descr */
+	unsigned long allocs;
+	unsigned long hits;
 };
 
 struct ndis_packet_stack {
@@ -267,6 +271,11 @@ struct ndis_packet {
 	UCHAR protocol_reserved[1];
 };
 
+/* packets from deserialized drivers waiting for MiniportReturnPacket
+ * are linked through wrapper's reserved area */
+#define NDIS_PACKET_RETURN_NEXT(packet)					\
+	(*(struct ndis_packet **)(packet)->deserialized_reserved.wrapper_reserved_ex)
+
 /* OOB data */
 struct ndis_packet_oob_data {
 	union {
@@ -463,23 +472,28 @@ struct ndis_spinlock {
 
 union ndis_rw_lock_refcount {
 	UCHAR cache_line[16];
+	/* ndiswrapper specific: number of readers on this processor */
+	volatile LONG count;
 };
 
 struct ndis_rw_lock {
 	union {
 		struct {
+			/* held by writer */
 			NT_SPIN_LOCK klock;
-			void *context;
+			/* ndiswrapper specific: set while a writer waits
+			 * for (or holds) the lock */
+			volatile ULONG_PTR writer;
 		};
 		UCHAR reserved[16];
 	};
-	union {
-		union ndis_rw_lock_refcount ref_count[MAXIMUM_PROCESSORS];
-		/* ndiswrapper specific */
-		volatile int count;
-	};
+	union ndis_rw_lock_refcount ref_count[MAXIMUM_PROCESSORS];
 };
 
+/* lock_state->state for a write lock; for read locks, it is the index
+ * of ref_count used */
+#define NDIS_RW_LOCK_WRITE MAXIMUM_PROCESSORS
+
 struct lock_state {
 	USHORT state;
 	KIRQL irql;
@@ -838,6 +852,133 @@ struct ndis_mp_block {
 	struct ndis_device *wnd;
 };
 
+/* latencies are in nanoseconds */
+struct wrap_wq_stats {
+	unsigned long queued;
+	unsigned long run;
+	int depth;
+	int max_depth;
+	u64 total_latency;
+	u64 max_latency;
+	unsigned long latency_hist[NDIS_LATENCY_BUCKETS];
+};
+
+static inline void wrap_latency_hist_add(unsigned long *hist, u64 latency)
+{
+	int i = fls64(div_u64(latency, NSEC_PER_USEC));
+
+	if (i >= NDIS_LATENCY_BUCKETS)
+		i = NDIS_LATENCY_BUCKETS - 1;
+	hist[i]++;
+}
+
+/* tx_ring indices are u8 */
+#define TX_RING_MAX_SIZE 128
+#define TX_RING_OCCUPANCY_BUCKETS 8
+
+/* interface counters are kept per CPU, so packets completed on
+ * different CPUs don't share cache lines */
+struct ndis_counters {
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 tx_dropped;
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 rx_dropped;
+	/* packets that filled tx_ring */
+	u64 tx_ring_full;
+	/* sends returned with NDIS_STATUS_RESOURCES */
+	u64 tx_resources;
+	/* sends completed later with NdisMSendComplete */
+	u64 tx_pending;
+};
+
+struct ndis_pcpu_stats {
+	struct ndis_counters c;
+	struct u64_stats_sync syncp;
+};
+
+/* results of queries of OIDs polled for statistics are cached for
+ * ttl jiffies, as each query takes ndis_req_mutex and serialize lock;
+ * cache is invalidated when any OID is set, device is reset or media
+ * state changes */
+#define OID_CACHE_SIZE 16
+#define OID_CACHE_DATA_SIZE 256
+
+struct oid_cache_entry {
+	ndis_oid oid;
+	unsigned long ttl;
+	unsigned long expires;
+	ULONG length;
+	BOOLEAN valid;
+	unsigned long hits;
+	unsigned long misses;
+	u8 data[OID_CACHE_DATA_SIZE];
+};
+
+/* scan results are kept by BSSID and updated once per scan, so that
+ * repeated SIOCGIWSCAN don't query miniport; events translated from
+ * them are kept until next update */
+#define BSS_CACHE_HASH_SIZE 32
+#define BSS_CACHE_EXPIRE (30 * HZ)
+
+struct bss_cache_entry {
+	struct nt_list list;
+	mac_address mac;
+	unsigned long seen;
+	ULONG length;
+	/* struct ndis_wlan_bssid or ndis_wlan_bssid_ex */
+	u8 data[0];
+};
+
+struct bss_cache {
+	struct mutex mutex;
+	struct nt_list hash[BSS_CACHE_HASH_SIZE];
+	unsigned int count;
+	unsigned int gen;
+	unsigned long updated;
+	struct delayed_work scan_work;
+	char *events;
+	unsigned int events_len;
+	unsigned int events_gen;
+	unsigned int events_flags;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* wireless stats are collected when read, at most once every
+ * IW_STATS_MIN_AGE; timer keeps them fresh for regular readers, and
+ * its interval doubles up to IW_STATS_MAX_BACKOFF while nobody reads */
+#define IW_STATS_MIN_AGE HZ
+#define IW_STATS_MAX_BACKOFF (300 * HZ)
+/* RSSI (dBm) programmed with OID_802_11_RSSI_TRIGGER on link-on */
+#define IW_STATS_RSSI_TRIGGER -80
+
+struct ndis_device;
+struct ndis_oid_request;
+
+typedef void (*ndis_oid_callback)(struct ndis_device *wnd,
+				  struct ndis_oid_request *req);
+
+/* OID request queued with mp_request_async; queries of same OID and
+ * length queued before the first one is sent to miniport are added
+ * to its dups and completed with it */
+struct ndis_oid_request {
+	struct nt_list list;
+	struct nt_list dups;
+	enum ndis_request_type type;
+	ndis_oid oid;
+	ULONG buflen;
+	ULONG written;
+	ULONG needed;
+	NDIS_STATUS status;
+	unsigned int cache_gen;
+	BOOLEAN cached;
+	ndis_oid_callback callback;
+	void *ctx;
+	u8 buf[0];
+};
+
 struct ndis_device {
 	struct ndis_mp_block *nmb;
 	struct wrap_device *wd;
@@ -845,16 +986,46 @@ struct ndis_device {
 	void *shutdown_ctx;
 	struct ndis_mp_interrupt *mp_interrupt;
 	struct kdpc irq_kdpc;
+	/* time irq_kdpc was queued by ndis_isr */
+	u64 irq_dpc_queued;
+	unsigned long dpc_latency_hist[NDIS_LATENCY_BUCKETS];
 	unsigned long mem_start;
 	unsigned long mem_end;
 
+	struct ndis_pcpu_stats __percpu *stats;
+	/* for kernels without ndo_get_stats64 */
 	struct net_device_stats net_stats;
 	struct iw_statistics iw_stats;
 	BOOLEAN iw_stats_enabled;
+	unsigned long iw_stats_read;
+	unsigned long iw_stats_updated;
+	/* last RSSI indicated by miniport, if it does */
+	unsigned long iw_stats_rssi_indicated;
+	unsigned long iw_stats_collected;
+	unsigned long iw_stats_rssi_indications;
+	/* RSSI trigger programmed in miniport, 0 if none */
+	ndis_rssi rssi_trigger;
 	struct ndis_wireless_stats ndis_stats;
 
+	/* tx_work and ndis_work of this device run in wq */
+	struct workqueue_struct *wq;
+	/* bus device and driver names, so queues of devices differ */
+	char wq_name[MAX_DRIVER_NAME_LEN + 32];
+	struct wrap_wq_stats wq_stats;
+	u64 tx_work_queued;
+	u64 ndis_work_queued;
+
+	/* received packets to be returned to deserialized driver */
+	struct work_struct return_packets_work;
+	struct ndis_packet *return_packets_head;
+	struct ndis_packet *return_packets_tail;
+	spinlock_t return_packets_lock;
+
 	struct work_struct tx_work;
-	struct ndis_packet *tx_ring[TX_RING_SIZE];
+	/* tx_ring has tx_ring_size (TX_RING_SIZE initially) entries;
+	 * it can be resized with ethtool */
+	struct ndis_packet **tx_ring;
+	unsigned int tx_ring_size;
 	u8 tx_ring_start;
 	u8 tx_ring_end;
 	u8 is_tx_ring_full;
@@ -862,7 +1033,28 @@ struct ndis_device {
 	spinlock_t tx_ring_lock;
 	struct mutex tx_ring_mutex;
 	unsigned int max_tx_packets;
+	/* OID_GEN_MAXIMUM_SEND_PACKETS of serialized miniport; 0 for
+	 * deserialized miniport */
+	unsigned int mp_max_tx_packets;
+	/* packets in tx_ring after queuing a packet, in buckets of
+	 * powers of 2 */
+	unsigned long tx_ring_occupancy[TX_RING_OCCUPANCY_BUCKETS];
+	unsigned long rx_deferred_returns;
+	unsigned long rx_return_batches;
 	struct mutex ndis_req_mutex;
+	/* asynchronous OID requests; only one request, synchronous or
+	 * asynchronous, is given to miniport at a time */
+	struct nt_list oid_req_list;
+	struct nt_list oid_req_done_list;
+	struct ndis_oid_request *oid_req_active;
+	spinlock_t oid_req_lock;
+	wait_queue_head_t oid_req_wait;
+	struct work_struct oid_req_work;
+	unsigned long oid_req_queued;
+	unsigned long oid_req_deduped;
+	struct oid_cache_entry oid_cache[OID_CACHE_SIZE];
+	spinlock_t oid_cache_lock;
+	unsigned int oid_cache_gen;
 	struct task_struct *ndis_req_task;
 	int ndis_req_done;
 	NDIS_STATUS ndis_req_status;
@@ -875,8 +1067,12 @@ struct ndis_device {
 	int hangcheck_interval;
 	struct timer_list hangcheck_timer;
 	int iw_stats_interval;
+	int iw_stats_backoff;
 	struct timer_list iw_stats_timer;
 	unsigned long scan_timestamp;
+	struct bss_cache bss_cache;
+	/* size of last OID_802_11_BSSID_LIST, with some room to grow */
+	ULONG bssid_list_hint;
 	struct encr_info encr_info;
 	char nick[IW_ESSID_MAX_SIZE + 1];
 	struct ndis_essid essid;
@@ -902,8 +1098,14 @@ struct ndis_device {
 	struct v4_checksum rx_csum;
 	struct v4_checksum tx_csum;
 	enum ndis_physical_medium physical_medium;
+	/* cfg80211 interface; NULL if wireless extensions are used */
+	struct wireless_dev *wdev;
 	ULONG ndis_wolopts;
 	struct nt_slist wrap_timer_slist;
+	unsigned long timer_slack;
+	unsigned long timer_fires;
+	unsigned long timer_wakeups;
+	unsigned long timer_last_wakeup;
 	int drv_ndis_version;
 	struct ndis_pnp_capabilities pnp_capa;
 };
@@ -914,6 +1116,7 @@ int ndis_init(void);
 void ndis_exit(void);
 int ndis_init_device(struct ndis_device *wnd);
 void ndis_exit_device(struct ndis_device *wnd);
+void return_packets_worker(struct work_struct *work);
 
 int wrap_procfs_add_ndis_device(struct ndis_device *wnd);
 void wrap_procfs_remove_ndis_device(struct ndis_device *wnd);
@@ -953,6 +1156,11 @@ ULONG NDIS_BUFFER_TO_SPAN_PAGES(ndis_buffer *buffer) wstdcall;
 BOOLEAN NdisWaitEvent(struct ndis_event *event, UINT timeout) wstdcall;
 void NdisSetEvent(struct ndis_event *event) wstdcall;
 void NdisMDeregisterInterrupt(struct ndis_mp_interrupt *mp_interrupt) wstdcall;
+void NdisInitializeReadWriteLock(struct ndis_rw_lock *rw_lock) wstdcall;
+void NdisAcquireReadWriteLock(struct ndis_rw_lock *rw_lock, BOOLEAN write,
+			      struct lock_state *lock_state) wstdcall;
+void NdisReleaseReadWriteLock(struct ndis_rw_lock *rw_lock,
+			      struct lock_state *lock_state) wstdcall;
 void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 			  char *header1, char *header, UINT header_size,
 			  void *look_ahead, UINT look_ahead_size,
@@ -0,0 +1,286 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <net/genetlink.h>
+
+#include "ndis.h"
+#include "wrapndis.h"
+
+#ifdef WRAP_GENL
+
+/* statistics are copied from counters kept by the driver; unlike
+ * proc files, no OID is queried to answer requests */
+
+enum nl_ndis_mcgrp {
+	NL_NDIS_MCGRP_LINK,
+};
+
+static struct genl_family ndis_genl_family;
+
+static int nl_ndis_put_stats(struct sk_buff *skb, struct ndis_device *wnd)
+{
+	struct net_device *net_dev = wnd->net_dev;
+	struct ndis_genl_oid_cache cache[OID_CACHE_SIZE];
+	struct ndis_genl_counters counters;
+	struct ndis_genl_tx_ring ring;
+	struct ndis_genl_memory mem;
+	struct ndis_genl_wq wq;
+	struct ndis_genl_oid oid;
+	struct ndis_counters sum;
+	u64 hist[NDIS_LATENCY_BUCKETS];
+	int i, n;
+
+	if (nla_put_u32(skb, NDIS_ATTR_IFINDEX, net_dev->ifindex) ||
+	    nla_put_string(skb, NDIS_ATTR_IFNAME, net_dev->name) ||
+	    nla_put_u8(skb, NDIS_ATTR_LINK, netif_carrier_ok(net_dev)))
+		return -EMSGSIZE;
+
+	get_ndis_counters(wnd, &sum);
+	counters.tx_packets = sum.tx_packets;
+	counters.tx_bytes = sum.tx_bytes;
+	counters.tx_dropped = sum.tx_dropped;
+	counters.rx_packets = sum.rx_packets;
+	counters.rx_bytes = sum.rx_bytes;
+	counters.rx_dropped = sum.rx_dropped;
+	counters.tx_ring_full = sum.tx_ring_full;
+	counters.tx_resources = sum.tx_resources;
+	counters.tx_pending = sum.tx_pending;
+	if (nla_put(skb, NDIS_ATTR_COUNTERS, sizeof(counters), &counters))
+		return -EMSGSIZE;
+
+	ring.size = wnd->tx_ring_size;
+	ring.start = wnd->tx_ring_start;
+	ring.end = wnd->tx_ring_end;
+	ring.full = wnd->is_tx_ring_full;
+	ring.tx_ok = wnd->tx_ok;
+	ring.max_tx_packets = wnd->max_tx_packets;
+	ring.queue_stopped = netif_queue_stopped(net_dev);
+	if (nla_put(skb, NDIS_ATTR_TX_RING, sizeof(ring), &ring))
+		return -EMSGSIZE;
+
+	wq.queued = wnd->wq_stats.queued;
+	wq.run = wnd->wq_stats.run;
+	wq.total_latency_ns = wnd->wq_stats.total_latency;
+	wq.max_latency_ns = wnd->wq_stats.max_latency;
+	wq.depth = wnd->wq_stats.depth;
+	wq.max_depth = wnd->wq_stats.max_depth;
+	if (nla_put(skb, NDIS_ATTR_WQ, sizeof(wq), &wq))
+		return -EMSGSIZE;
+
+	for (i = 0; i < NDIS_LATENCY_BUCKETS; i++)
+		hist[i] = wnd->wq_stats.latency_hist[i];
+	if (nla_put(skb, NDIS_ATTR_WQ_LATENCY, sizeof(hist), hist))
+		return -EMSGSIZE;
+	for (i = 0; i < NDIS_LATENCY_BUCKETS; i++)
+		hist[i] = wnd->dpc_latency_hist[i];
+	if (nla_put(skb, NDIS_ATTR_DPC_LATENCY, sizeof(hist), hist))
+		return -EMSGSIZE;
+
+	oid.requests_queued = wnd->oid_req_queued;
+	oid.requests_deduped = wnd->oid_req_deduped;
+	if (nla_put(skb, NDIS_ATTR_OID, sizeof(oid), &oid))
+		return -EMSGSIZE;
+
+	for (i = 0, n = 0; i < OID_CACHE_SIZE; i++) {
+		struct oid_cache_entry *entry = &wnd->oid_cache[i];
+
+		/* free entries have oid 0 */
+		if (!entry->oid)
+			continue;
+		cache[n].oid = entry->oid;
+		cache[n].ttl_ms = jiffies_to_msecs(entry->ttl);
+		cache[n].hits = entry->hits;
+		cache[n].misses = entry->misses;
+		n++;
+	}
+	if (n && nla_put(skb, NDIS_ATTR_OID_CACHE, n * sizeof(cache[0]),
+			 cache))
+		return -EMSGSIZE;
+
+	memset(&mem, 0, sizeof(mem));
+	if (wnd->tx_packet_pool) {
+		mem.tx_packets_used = wnd->tx_packet_pool->num_used_descr;
+		mem.tx_packets_max = wnd->tx_packet_pool->max_descr;
+	}
+	mem.bss_cache_entries = wnd->bss_cache.count;
+#if ALLOC_DEBUG
+	mem.kmalloc = alloc_size(ALLOC_TYPE_KMALLOC_ATOMIC) +
+		alloc_size(ALLOC_TYPE_KMALLOC_NON_ATOMIC);
+	mem.vmalloc = alloc_size(ALLOC_TYPE_VMALLOC_ATOMIC) +
+		alloc_size(ALLOC_TYPE_VMALLOC_NON_ATOMIC);
+	mem.slack = alloc_size(ALLOC_TYPE_SLACK);
+	mem.pages = alloc_size(ALLOC_TYPE_PAGES);
+#endif
+	if (nla_put(skb, NDIS_ATTR_MEMORY, sizeof(mem), &mem))
+		return -EMSGSIZE;
+	return 0;
+}
+
+static int nl_ndis_get_stats(struct sk_buff *skb, struct genl_info *info)
+{
+	struct net_device *net_dev;
+	struct ndis_device *wnd;
+	struct sk_buff *msg;
+	void *hdr;
+	int ret;
+
+	if (!info->attrs[NDIS_ATTR_IFINDEX])
+		return -EINVAL;
+	net_dev = dev_get_by_index(genl_info_net(info),
+				   nla_get_u32(info->attrs[NDIS_ATTR_IFINDEX]));
+	if (!net_dev)
+		return -ENODEV;
+	wnd = get_ndis_device(net_dev);
+	if (!wnd) {
+		ret = -ENODEV;
+		goto out;
+	}
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &ndis_genl_family, 0, NDIS_CMD_GET_STATS);
+	if (!hdr || nl_ndis_put_stats(msg, wnd)) {
+		nlmsg_free(msg);
+		ret = -EMSGSIZE;
+		goto out;
+	}
+	genlmsg_end(msg, hdr);
+	ret = genlmsg_reply(msg, info);
+out:
+	dev_put(net_dev);
+	return ret;
+}
+
+/* cb->args[0] is the number of devices already dumped */
+static int nl_ndis_dump_stats(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct net_device *net_dev;
+	struct ndis_device *wnd;
+	int i = 0;
+	void *hdr;
+
+	rcu_read_lock();
+	for_each_netdev_rcu(sock_net(skb->sk), net_dev) {
+		wnd = get_ndis_device(net_dev);
+		if (!wnd)
+			continue;
+		if (i < cb->args[0]) {
+			i++;
+			continue;
+		}
+		hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid,
+				  cb->nlh->nlmsg_seq, &ndis_genl_family,
+				  NLM_F_MULTI, NDIS_CMD_GET_STATS);
+		if (!hdr)
+			break;
+		if (nl_ndis_put_stats(skb, wnd)) {
+			genlmsg_cancel(skb, hdr);
+			break;
+		}
+		genlmsg_end(skb, hdr);
+		i++;
+	}
+	rcu_read_unlock();
+	cb->args[0] = i;
+	return skb->len;
+}
+
+/* called from set_media_state, which may be in atomic context */
+void nl_ndis_link_event(struct ndis_device *wnd, int link)
+{
+	struct net_device *net_dev = wnd->net_dev;
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = nlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (!msg)
+		return;
+	hdr = genlmsg_put(msg, 0, 0, &ndis_genl_family, 0,
+			  NDIS_CMD_LINK_EVENT);
+	if (!hdr ||
+	    nla_put_u32(msg, NDIS_ATTR_IFINDEX, net_dev->ifindex) ||
+	    nla_put_string(msg, NDIS_ATTR_IFNAME, net_dev->name) ||
+	    nla_put_u8(msg, NDIS_ATTR_LINK, link)) {
+		nlmsg_free(msg);
+		return;
+	}
+	genlmsg_end(msg, hdr);
+	genlmsg_multicast(&ndis_genl_family, msg, 0, NL_NDIS_MCGRP_LINK,
+			  GFP_ATOMIC);
+}
+
+static const struct nla_policy ndis_genl_policy[NDIS_ATTR_MAX + 1] = {
+	[NDIS_ATTR_IFINDEX] = { .type = NLA_U32 },
+};
+
+static const struct genl_ops ndis_genl_ops[] = {
+	{
+		.cmd = NDIS_CMD_GET_STATS,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+		.validate = GENL_DONT_VALIDATE_STRICT |
+			GENL_DONT_VALIDATE_DUMP,
+#else
+		.policy = ndis_genl_policy,
+#endif
+		.doit = nl_ndis_get_stats,
+		.dumpit = nl_ndis_dump_stats,
+		/* as proc files, statistics are for administrators */
+		.flags = GENL_ADMIN_PERM,
+	},
+};
+
+static const struct genl_multicast_group ndis_genl_mcgrps[] = {
+	[NL_NDIS_MCGRP_LINK] = { .name = NDIS_GENL_MCGRP_LINK, },
+};
+
+static struct genl_family ndis_genl_family = {
+	.name = NDIS_GENL_NAME,
+	.version = NDIS_GENL_VERSION,
+	.maxattr = NDIS_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	.policy = ndis_genl_policy,
+#endif
+	.module = THIS_MODULE,
+	.ops = ndis_genl_ops,
+	.n_ops = ARRAY_SIZE(ndis_genl_ops),
+	.mcgrps = ndis_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(ndis_genl_mcgrps),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+	.resv_start_op = NDIS_CMD_MAX + 1,
+#endif
+};
+
+int nl_ndis_init(void)
+{
+	int ret;
+
+	ENTER1("");
+	ret = genl_register_family(&ndis_genl_family);
+	if (ret)
+		ERROR("couldn't register netlink family: %d", ret);
+	EXIT1(return ret);
+}
+
+void nl_ndis_exit(void)
+{
+	ENTER1("");
+	genl_unregister_family(&ndis_genl_family);
+	EXIT1(return);
+}
+
+#endif // WRAP_GENL
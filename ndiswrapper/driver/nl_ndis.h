@@ -0,0 +1,153 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _NL_NDIS_H_
+#define _NL_NDIS_H_
+
+/* generic netlink family for statistics; this file is shared with
+ * utils, so the structures below are the ABI and must only be
+ * extended at the end */
+
+#include <linux/types.h>
+
+#define NDIS_GENL_NAME		"ndiswrapper"
+#define NDIS_GENL_VERSION	1
+#define NDIS_GENL_MCGRP_LINK	"link"
+
+/* latencies are counted in buckets of powers of 2 usec: bucket 0 is
+ * below 1 usec, bucket i is from 2^(i-1) to 2^i usec and the last one
+ * has all longer latencies */
+#define NDIS_LATENCY_BUCKETS	16
+
+enum ndis_genl_cmd {
+	NDIS_CMD_UNSPEC,
+	/* request has NDIS_ATTR_IFINDEX, or is a dump of all devices */
+	NDIS_CMD_GET_STATS,
+	/* sent to NDIS_GENL_MCGRP_LINK with NDIS_ATTR_IFINDEX,
+	 * NDIS_ATTR_IFNAME and NDIS_ATTR_LINK */
+	NDIS_CMD_LINK_EVENT,
+	__NDIS_CMD_MAX,
+};
+#define NDIS_CMD_MAX (__NDIS_CMD_MAX - 1)
+
+enum ndis_genl_attr {
+	NDIS_ATTR_UNSPEC,
+	NDIS_ATTR_IFINDEX,		/* u32 */
+	NDIS_ATTR_IFNAME,		/* string */
+	NDIS_ATTR_LINK,			/* u8: 1 if carrier is on */
+	NDIS_ATTR_COUNTERS,		/* struct ndis_genl_counters */
+	NDIS_ATTR_TX_RING,		/* struct ndis_genl_tx_ring */
+	NDIS_ATTR_WQ,			/* struct ndis_genl_wq */
+	NDIS_ATTR_WQ_LATENCY,		/* u64[NDIS_LATENCY_BUCKETS] */
+	NDIS_ATTR_DPC_LATENCY,		/* u64[NDIS_LATENCY_BUCKETS] */
+	NDIS_ATTR_OID,			/* struct ndis_genl_oid */
+	NDIS_ATTR_OID_CACHE,		/* struct ndis_genl_oid_cache[] */
+	NDIS_ATTR_MEMORY,		/* struct ndis_genl_memory */
+	__NDIS_ATTR_MAX,
+};
+#define NDIS_ATTR_MAX (__NDIS_ATTR_MAX - 1)
+
+struct ndis_genl_counters {
+	__u64 tx_packets;
+	__u64 tx_bytes;
+	__u64 tx_dropped;
+	__u64 rx_packets;
+	__u64 rx_bytes;
+	__u64 rx_dropped;
+	__u64 tx_ring_full;
+	__u64 tx_resources;
+	__u64 tx_pending;
+};
+
+struct ndis_genl_tx_ring {
+	__u32 size;
+	__u32 start;
+	__u32 end;
+	__u32 full;
+	__u32 tx_ok;
+	__u32 max_tx_packets;
+	__u32 queue_stopped;
+};
+
+struct ndis_genl_wq {
+	__u64 queued;
+	__u64 run;
+	__u64 total_latency_ns;
+	__u64 max_latency_ns;
+	__u32 depth;
+	__u32 max_depth;
+};
+
+struct ndis_genl_oid {
+	__u64 requests_queued;
+	__u64 requests_deduped;
+};
+
+struct ndis_genl_oid_cache {
+	__u32 oid;
+	__u32 ttl_ms;
+	__u64 hits;
+	__u64 misses;
+};
+
+/* pool usage of the device and, if module is built with ALLOC_DEBUG,
+ * bytes allocated by the module and Windows drivers */
+struct ndis_genl_memory {
+	__u32 tx_packets_used;
+	__u32 tx_packets_max;
+	__u32 bss_cache_entries;
+	__u32 pad;
+	__u64 kmalloc;
+	__u64 vmalloc;
+	__u64 slack;
+	__u64 pages;
+};
+
+#ifdef __KERNEL__
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define WRAP_GENL
+#endif
+
+struct ndis_device;
+
+#ifdef WRAP_GENL
+
+int nl_ndis_init(void);
+void nl_ndis_exit(void);
+void nl_ndis_link_event(struct ndis_device *wnd, int link);
+
+#else
+
+static inline int nl_ndis_init(void)
+{
+	return 0;
+}
+
+static inline void nl_ndis_exit(void)
+{
+}
+
+static inline void nl_ndis_link_event(struct ndis_device *wnd, int link)
+{
+}
+
+#endif // WRAP_GENL
+
+#endif // __KERNEL__
+
+#endif // NL_NDIS_H
@@ -18,8 +18,11 @@
 #include "usb.h"
 #include "pnp.h"
 #include "loader.h"
+#include "wrapper.h"
+#include "trace_ndis.h"
 #include "ntoskernel_exports.h"
 #include "nvmalloc.h"
+#include <linux/hash.h>
 
 /* MDLs describe a range of virtual address with an array of physical
  * pages right after the header. For different ranges of virtual
@@ -38,11 +41,33 @@ struct wrap_mdl {
 	struct mdl mdl[0];
 };
 
+/* USB drivers allocate an IRP for every transfer, so IRPs with up to
+ * IRP_CACHE_STACKS(IRP_CACHE_BUCKETS - 1) stack locations are
+ * allocated from caches, one cache for each power of 2 stack count;
+ * bigger IRPs are allocated with kmalloc. IRPs built with IoBuild*
+ * functions carry their MDL and system buffer after the stack
+ * locations (inline_size bytes), so they are freed with the IRP */
+#define IRP_CACHE_STACKS(bucket) (2 << (bucket))
+struct wrap_irp {
+	unsigned long bucket;
+	unsigned int inline_size;
+	/* size of irp->user_buf for METHOD_BUFFERED output */
+	ULONG user_buf_len;
+	/* when IRP was allocated, in ns */
+	u64 alloc_time;
+	struct irp irp[0];
+};
+
 /* everything here is for all drivers/devices - not per driver/device */
 static spinlock_t dispatcher_lock;
 spinlock_t ntoskernel_lock;
 static void *mdl_cache;
 static struct nt_list wrap_mdl_list;
+static struct kmem_cache *irp_cache[IRP_CACHE_BUCKETS];
+static const char *irp_cache_names[IRP_CACHE_BUCKETS] = {
+	DRIVER_NAME "_irp2", DRIVER_NAME "_irp4", DRIVER_NAME "_irp8",
+};
+struct irp_cache_stats irp_cache_stats;
 
 static struct work_struct kdpc_work;
 static void kdpc_worker(struct work_struct *dummy);
@@ -65,6 +90,11 @@ static struct nt_list bus_driver_list;
 static struct work_struct ntos_work;
 static struct nt_list ntos_work_list;
 static spinlock_t ntos_work_lock;
+/* work items are taken from this pool; kmalloc is used only if the
+ * pool is exhausted */
+#define NTOS_WORK_POOL_SIZE 64
+static struct ntos_work_item ntos_work_pool[NTOS_WORK_POOL_SIZE];
+static struct nt_list ntos_work_free_list;
 static void ntos_work_worker(struct work_struct *dummy);
 spinlock_t irp_cancel_lock;
 static NT_SPIN_LOCK nt_list_lock;
@@ -411,6 +441,39 @@ static void initialize_object(struct dispatcher_header *dh, enum dh_type type,
 	InitializeListHead(&dh->wait_blocks);
 }
 
+/* tolerance, in HZ, by which a periodic timer can be delayed so it
+ * expires along with other timers; it is limited to a quarter of the
+ * period so drivers don't notice it */
+static unsigned long wrap_timer_slack(struct wrap_timer *wrap_timer)
+{
+	unsigned long slack;
+
+	if (wrap_timer->repeat <= 0)
+		return 0;
+	if (wrap_timer->wnd)
+		slack = wrap_timer->wnd->timer_slack;
+	else
+		slack = timer_slack_jiffies(timer_slack);
+	if (slack > (unsigned long)wrap_timer->repeat / 4)
+		slack = (unsigned long)wrap_timer->repeat / 4;
+	return slack;
+}
+
+/* align expiry of timer to next multiple of slack, so that all timers
+ * with same slack expire at the same jiffy; the nominal expiry is
+ * kept in wrap_timer so periodic timers don't drift */
+static unsigned long wrap_timer_expires(struct wrap_timer *wrap_timer,
+					unsigned long expires)
+{
+	unsigned long slack;
+
+	wrap_timer->expires = expires;
+	slack = wrap_timer_slack(wrap_timer);
+	if (slack < 2)
+		return expires;
+	return expires + (slack - expires % slack) % slack;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
 static void timer_proc(struct timer_list *tl)
 #else
@@ -423,6 +486,7 @@ static void timer_proc(unsigned long data)
 	struct wrap_timer *wrap_timer = (struct wrap_timer *)data;
 #endif
 	struct nt_timer *nt_timer;
+	struct ndis_device *wnd;
 	struct kdpc *kdpc;
 
 	nt_timer = wrap_timer->nt_timer;
@@ -431,9 +495,30 @@ static void timer_proc(unsigned long data)
 	BUG_ON(wrap_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
 	BUG_ON(nt_timer->wrap_timer_magic != WRAP_TIMER_MAGIC);
 #endif
+	wnd = wrap_timer->wnd;
+	if (wnd) {
+		unsigned long now = jiffies;
+
+		atomic_inc_var(wnd->timer_fires);
+		/* count timers expiring in the same jiffy as one wakeup */
+		if (xchg(&wnd->timer_last_wakeup, now) != now)
+			atomic_inc_var(wnd->timer_wakeups);
+	}
+	trace_nt_timer_fire(nt_timer, nt_timer->kdpc, wrap_timer->repeat);
 	KeSetEvent((struct nt_event *)nt_timer, 0, FALSE);
-	if (wrap_timer->repeat)
-		mod_timer(&wrap_timer->timer, jiffies + wrap_timer->repeat);
+	if (wrap_timer->repeat) {
+		unsigned long expires;
+
+		if (wrap_timer_slack(wrap_timer) < 2)
+			expires = jiffies + wrap_timer->repeat;
+		else {
+			expires = wrap_timer->expires + wrap_timer->repeat;
+			if (time_before_eq(expires, jiffies))
+				expires = jiffies + wrap_timer->repeat;
+		}
+		mod_timer(&wrap_timer->timer,
+			  wrap_timer_expires(wrap_timer, expires));
+	}
 	kdpc = nt_timer->kdpc;
 	if (kdpc)
 		queue_kdpc(kdpc);
@@ -472,6 +557,7 @@ void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 	timer_setup(&wrap_timer->timer, timer_proc, 0);
 #endif
 	wrap_timer->nt_timer = nt_timer;
+	wrap_timer->wnd = nmb ? nmb->wnd : NULL;
 #ifdef TIMER_DEBUG
 	wrap_timer->wrap_timer_magic = WRAP_TIMER_MAGIC;
 #endif
@@ -535,7 +621,8 @@ BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
 	KeClearEvent((struct nt_event *)nt_timer);
 	nt_timer->kdpc = kdpc;
 	wrap_timer->repeat = repeat_hz;
-	if (mod_timer(&wrap_timer->timer, jiffies + expires_hz))
+	if (mod_timer(&wrap_timer->timer,
+		      wrap_timer_expires(wrap_timer, jiffies + expires_hz)))
 		TIMEREXIT(return TRUE);
 	else
 		TIMEREXIT(return FALSE);
@@ -611,6 +698,7 @@ static void kdpc_worker(struct work_struct *dummy)
 {
 	struct nt_list *entry;
 	struct kdpc *kdpc;
+	DPC func;
 	unsigned long flags;
 	KIRQL irql;
 
@@ -631,7 +719,10 @@ static void kdpc_worker(struct work_struct *dummy)
 		WORKTRACE("%p, %p, %p, %p, %p", kdpc, kdpc->func, kdpc->ctx,
 			  kdpc->arg1, kdpc->arg2);
 		assert_irql(_irql_ == DISPATCH_LEVEL);
-		LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
+		func = kdpc->func;
+		trace_nt_dpc_entry(kdpc, func);
+		LIN2WIN4(func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
+		trace_nt_dpc_exit(kdpc, func);
 		assert_irql(_irql_ == DISPATCH_LEVEL);
 	}
 	lower_irql(irql);
@@ -707,15 +798,27 @@ wstdcall void WIN_FUNC(KeSetImportanceDpc,2)
 	kdpc->importance = importance;
 }
 
+static inline int ntos_work_pool_item(struct ntos_work_item *item)
+{
+	return item >= &ntos_work_pool[0] &&
+		item < &ntos_work_pool[NTOS_WORK_POOL_SIZE];
+}
+
 static void ntos_work_worker(struct work_struct *dummy)
 {
-	struct ntos_work_item *ntos_work_item;
+	struct ntos_work_item *ntos_work_item, *done;
 	struct nt_list *cur;
 
+	done = NULL;
 	while (1) {
 		spin_lock_bh(&ntos_work_lock);
+		/* give back previous item while we hold the lock */
+		if (done && ntos_work_pool_item(done))
+			InsertHeadList(&ntos_work_free_list, &done->list);
 		cur = RemoveHeadList(&ntos_work_list);
 		spin_unlock_bh(&ntos_work_lock);
+		if (done && !ntos_work_pool_item(done))
+			kfree(done);
 		if (!cur)
 			break;
 		ntos_work_item = container_of(cur, struct ntos_work_item, list);
@@ -724,7 +827,7 @@ static void ntos_work_worker(struct work_struct *dummy)
 			  ntos_work_item->arg2);
 		LIN2WIN2(ntos_work_item->func, ntos_work_item->arg1,
 			 ntos_work_item->arg2);
-		kfree(ntos_work_item);
+		done = ntos_work_item;
 	}
 	WORKEXIT(return);
 }
@@ -732,23 +835,117 @@ static void ntos_work_worker(struct work_struct *dummy)
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2)
 {
 	struct ntos_work_item *ntos_work_item;
+	struct nt_list *cur;
 
 	WORKENTER("adding work: %p, %p, %p", func, arg1, arg2);
-	ntos_work_item = kmalloc(sizeof(*ntos_work_item), irql_gfp());
-	if (!ntos_work_item) {
-		ERROR("couldn't allocate memory");
-		return -ENOMEM;
+	spin_lock_bh(&ntos_work_lock);
+	cur = RemoveHeadList(&ntos_work_free_list);
+	if (cur)
+		ntos_work_item = container_of(cur, struct ntos_work_item,
+					      list);
+	else {
+		spin_unlock_bh(&ntos_work_lock);
+		ntos_work_item = kmalloc(sizeof(*ntos_work_item), irql_gfp());
+		if (!ntos_work_item) {
+			ERROR("couldn't allocate memory");
+			return -ENOMEM;
+		}
+		spin_lock_bh(&ntos_work_lock);
 	}
 	ntos_work_item->func = func;
 	ntos_work_item->arg1 = arg1;
 	ntos_work_item->arg2 = arg2;
-	spin_lock_bh(&ntos_work_lock);
 	InsertTailList(&ntos_work_list, &ntos_work_item->list);
 	spin_unlock_bh(&ntos_work_lock);
 	queue_work(ntos_wq, &ntos_work);
 	WORKEXIT(return 0);
 }
 
+struct irp *alloc_irp(CCHAR stack_count, ULONG inline_size)
+{
+	struct wrap_irp *wrap_irp;
+	unsigned long bucket;
+	size_t size;
+
+	inline_size = ALIGN(inline_size, sizeof(void *));
+	size = IoSizeOfIrp(stack_count) + inline_size;
+	for (bucket = 0; bucket < IRP_CACHE_BUCKETS; bucket++)
+		if (size <= IoSizeOfIrp(IRP_CACHE_STACKS(bucket)))
+			break;
+	if (bucket < IRP_CACHE_BUCKETS)
+		wrap_irp = kmem_cache_alloc(irp_cache[bucket], irql_gfp());
+	else
+		wrap_irp = kmalloc(sizeof(*wrap_irp) + size, irql_gfp());
+	if (!wrap_irp)
+		return NULL;
+	wrap_irp->bucket = bucket;
+	wrap_irp->inline_size = inline_size;
+	wrap_irp->user_buf_len = 0;
+	wrap_irp->alloc_time = ktime_to_ns(ktime_get());
+	atomic_inc_var(irp_cache_stats.allocated[bucket]);
+	if (inline_size)
+		atomic_inc_var(irp_cache_stats.inlined);
+	IOTRACE("irp %p: stacks: %d, inline: %u, bucket: %lu", wrap_irp->irp,
+		stack_count, inline_size, bucket);
+	return wrap_irp->irp;
+}
+
+void free_irp(struct irp *irp)
+{
+	struct wrap_irp *wrap_irp;
+	unsigned long lifetime;
+
+	wrap_irp = container_of((void *)irp, struct wrap_irp, irp);
+	lifetime = div_u64(ktime_to_ns(ktime_get()) - wrap_irp->alloc_time,
+			   NSEC_PER_USEC);
+	pre_atomic_add(irp_cache_stats.total_lifetime, lifetime);
+	/* racy, but only statistics */
+	if (lifetime > irp_cache_stats.max_lifetime)
+		irp_cache_stats.max_lifetime = lifetime;
+	IOTRACE("irp %p: lifetime: %lu usec, status: %08X", irp, lifetime,
+		irp->io_status.status);
+	atomic_inc_var(irp_cache_stats.freed[wrap_irp->bucket]);
+	if (wrap_irp->bucket < IRP_CACHE_BUCKETS)
+		kmem_cache_free(irp_cache[wrap_irp->bucket], wrap_irp);
+	else
+		kfree(wrap_irp);
+}
+
+/* memory after stack locations allocated with alloc_irp; irp must
+ * have been initialized with IoInitializeIrp */
+void *irp_inline_data(struct irp *irp)
+{
+	struct wrap_irp *wrap_irp;
+
+	wrap_irp = container_of((void *)irp, struct wrap_irp, irp);
+	if (!wrap_irp->inline_size)
+		return NULL;
+	return (char *)irp + IoSizeOfIrp(irp->stack_count);
+}
+
+/* output buffer of an IRP built for METHOD_BUFFERED ioctl;
+ * IofCompleteRequest copies at most len bytes to it */
+void set_irp_user_buf(struct irp *irp, void *buf, ULONG len)
+{
+	struct wrap_irp *wrap_irp;
+
+	irp->user_buf = buf;
+	if (!(irp->alloc_flags & IRP_WRAP_ALLOCATED))
+		return;
+	wrap_irp = container_of((void *)irp, struct wrap_irp, irp);
+	wrap_irp->user_buf_len = buf ? len : 0;
+}
+
+/* irp must have IRP_WRAP_ALLOCATED; IRPs that driver initialized
+ * itself don't have wrap_irp */
+ULONG irp_user_buf_len(struct irp *irp)
+{
+	struct wrap_irp *wrap_irp;
+
+	wrap_irp = container_of((void *)irp, struct wrap_irp, irp);
+	return wrap_irp->user_buf_len;
+}
+
 wstdcall void WIN_FUNC(KeInitializeSpinLock,1)
 	(NT_SPIN_LOCK *lock)
 {
@@ -804,6 +1001,92 @@ wstdcall void WIN_FUNC(KeLowerIrql,1)
 	lower_irql(irql);
 }
 
+#ifdef NT_SPIN_LOCK_STATS
+struct nt_spin_lock_stat nt_spin_lock_stats[NT_SPIN_LOCK_STATS_SIZE];
+/* protects updates and reset of nt_spin_lock_stats; it is taken only
+ * after contention, so uncontended locks don't pay for it */
+static spinlock_t nt_spin_lock_stats_lock;
+
+/* called after a contended lock is acquired; site is the caller of
+ * the function that took the lock, which for KeAcquireSpinLock etc. is
+ * in Windows driver */
+void nt_spin_lock_contended(NT_SPIN_LOCK *lock, void *site,
+			    unsigned long spins)
+{
+	struct nt_spin_lock_stat *stat;
+	unsigned long flags;
+	unsigned int i, n;
+
+	n = hash_ptr(lock, NT_SPIN_LOCK_STATS_BITS);
+	spin_lock_irqsave(&nt_spin_lock_stats_lock, flags);
+	for (i = 0; i < NT_SPIN_LOCK_STATS_SIZE; i++) {
+		stat = &nt_spin_lock_stats[(n + i) % NT_SPIN_LOCK_STATS_SIZE];
+		if (stat->lock == NULL)
+			stat->lock = lock;
+		if (stat->lock != lock)
+			continue;
+		stat->site = site;
+		stat->contended++;
+		stat->spins += spins;
+		if (spins > stat->max_spins)
+			stat->max_spins = spins;
+		break;
+	}
+	/* if table is full, lock is not accounted */
+	spin_unlock_irqrestore(&nt_spin_lock_stats_lock, flags);
+}
+
+void nt_spin_lock_stats_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&nt_spin_lock_stats_lock, flags);
+	memset(nt_spin_lock_stats, 0, sizeof(nt_spin_lock_stats));
+	spin_unlock_irqrestore(&nt_spin_lock_stats_lock, flags);
+}
+#endif
+
+#ifdef WIN2LIN_PROFILE
+const char *win2lin_profile_names[] = {
+#define win2lin(name, argc) #name,
+#include "win2lin_stubs.h"
+#undef win2lin
+};
+const unsigned int win2lin_profile_size = ARRAY_SIZE(win2lin_profile_names);
+struct win2lin_profile_stat __percpu *win2lin_profile_stats;
+int win2lin_profile_enabled;
+
+/* returns the time the call started, or 0 if profiling is disabled,
+ * in which case the call is not accounted */
+u64 win2lin_profile_enter(unsigned int index)
+{
+	if (!win2lin_profile_enabled)
+		return 0;
+	return ktime_to_ns(ktime_get());
+}
+
+/* time is accounted to the CPU the call returns on; it includes time
+ * the function slept, e.g., in KeWaitForSingleObject */
+void win2lin_profile_exit(unsigned int index, u64 start)
+{
+	if (!start)
+		return;
+	this_cpu_inc(win2lin_profile_stats[index].calls);
+	this_cpu_add(win2lin_profile_stats[index].ns,
+		     ktime_to_ns(ktime_get()) - start);
+}
+
+void win2lin_profile_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(win2lin_profile_stats, cpu), 0,
+		       win2lin_profile_size *
+		       sizeof(struct win2lin_profile_stat));
+}
+#endif
+
 wstdcall KIRQL WIN_FUNC(KeAcquireSpinLockRaiseToDpc,1)
 	(NT_SPIN_LOCK *lock)
 {
@@ -821,7 +1104,17 @@ wstdcall void *WIN_FUNC(ExAllocatePoolWithTag,3)
 	if (size < PAGE_SIZE)
 		addr = kmalloc(size, irql_gfp());
 	else {
-		if (irql_gfp() & GFP_ATOMIC) {
+		addr = NULL;
+		/* drivers use nonpaged pool for DMA buffers (e.g., USB
+		 * transfers); physically contiguous memory can be
+		 * mapped for DMA directly, without bounce buffers */
+		if (!(pool_type & 1) &&
+		    size <= (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER))
+			addr = kmalloc(size, irql_gfp() | __GFP_NOWARN |
+				       __GFP_NORETRY);
+		if (addr)
+			TRACE1("%p, %zu", addr, size);
+		else if (irql_gfp() & GFP_ATOMIC) {
 			addr = nvmalloc(size, GFP_ATOMIC | __GFP_HIGHMEM,
 					 PAGE_KERNEL);
 			TRACE1("%p, %zu", addr, size);
@@ -1140,7 +1433,9 @@ wstdcall NTSTATUS WIN_FUNC(KeWaitForMultipleObjects,8)
 	 * this, even if waiting in non-alertable state, thread may be
 	 * alerted in some circumstances */
 	while (wait_count) {
+		trace_nt_wait_sleep(count, wait_count, wait_hz);
 		res = wait_condition(wait_done, wait_hz, TASK_INTERRUPTIBLE);
+		trace_nt_wait_wake(res, wait_done);
 		spin_lock_bh(&dispatcher_lock);
 		EVENTTRACE("%p woke up: %d, %d", current, res, wait_done);
 		/* the event may have been set by the time
@@ -1847,6 +2142,25 @@ struct mdl *allocate_init_mdl(void *virt, ULONG length)
 	return mdl;
 }
 
+/* size of MDL that can be initialized with init_inline_mdl */
+ULONG inline_mdl_size(void *virt, ULONG length)
+{
+	return sizeof(struct wrap_mdl) + MmSizeOfMdl(virt, length);
+}
+
+/* MDL in memory owned by caller, e.g., in IRP; it is not added to
+ * wrap_mdl_list, so free_mdl doesn't free it */
+struct mdl *init_inline_mdl(void *mem, void *virt, ULONG length)
+{
+	struct wrap_mdl *wrap_mdl = mem;
+	struct mdl *mdl = wrap_mdl->mdl;
+
+	wrap_mdl->list.next = wrap_mdl->list.prev = NULL;
+	memset(mdl, 0, MmSizeOfMdl(virt, length));
+	MmInitializeMdl(mdl, virt, length);
+	return mdl;
+}
+
 void free_mdl(struct mdl *mdl)
 {
 	/* A driver may allocate Mdl with NdisAllocateBuffer and free
@@ -1861,6 +2175,10 @@ void free_mdl(struct mdl *mdl)
 	else {
 		struct wrap_mdl *wrap_mdl = (struct wrap_mdl *)
 			((char *)mdl - offsetof(struct wrap_mdl, mdl));
+		if (!wrap_mdl->list.next) {
+			TRACE3("inline mdl: %p", mdl);
+			return;
+		}
 		spin_lock_bh(&dispatcher_lock);
 		RemoveEntryList(&wrap_mdl->list);
 		spin_unlock_bh(&dispatcher_lock);
@@ -2524,17 +2842,25 @@ struct worker_init_struct {
 
 int ntoskernel_init(void)
 {
+	int i;
+
 	spin_lock_init(&dispatcher_lock);
 	spin_lock_init(&ntoskernel_lock);
 	spin_lock_init(&ntos_work_lock);
 	spin_lock_init(&kdpc_list_lock);
 	spin_lock_init(&irp_cancel_lock);
+#ifdef NT_SPIN_LOCK_STATS
+	spin_lock_init(&nt_spin_lock_stats_lock);
+#endif
 	InitializeListHead(&wrap_mdl_list);
 	InitializeListHead(&kdpc_list);
 	InitializeListHead(&callback_objects);
 	InitializeListHead(&bus_driver_list);
 	InitializeListHead(&object_list);
 	InitializeListHead(&ntos_work_list);
+	InitializeListHead(&ntos_work_free_list);
+	for (i = 0; i < NTOS_WORK_POOL_SIZE; i++)
+		InsertTailList(&ntos_work_free_list, &ntos_work_pool[i].list);
 
 	nt_spin_lock_init(&nt_list_lock);
 
@@ -2573,14 +2899,15 @@ int ntoskernel_init(void)
 			mutex_init(&(info->lock));
 			info->task = NULL;
 			info->count = 0;
-#ifdef CONFIG_SMP
+#if defined(CONFIG_SMP) && !defined(WRAP_IRQL_MIGRATE)
 			cpumask_setall(tsk_cpus_allowed(info));
 #endif
 		}
 	} while (0);
 #endif
 
-	ntos_wq = create_singlethread_workqueue("ntos_wq");
+	/* DPCs run in ntos_wq, so it is high priority */
+	ntos_wq = wrap_create_ordered_wq("ntos_wq", WQ_HIGHPRI);
 	if (!ntos_wq) {
 		WARNING("couldn't create ntos_wq thread");
 		return -ENOMEM;
@@ -2605,6 +2932,30 @@ int ntoskernel_init(void)
 		ntoskernel_exit();
 		return -ENOMEM;
 	}
+	for (i = 0; i < IRP_CACHE_BUCKETS; i++) {
+		irp_cache[i] =
+			wrap_kmem_cache_create(irp_cache_names[i],
+					       sizeof(struct wrap_irp) +
+					       IoSizeOfIrp(IRP_CACHE_STACKS(i)),
+					       0, 0);
+		TRACE2("%p", irp_cache[i]);
+		if (!irp_cache[i]) {
+			ERROR("couldn't allocate IRP cache");
+			ntoskernel_exit();
+			return -ENOMEM;
+		}
+	}
+#ifdef WIN2LIN_PROFILE
+	win2lin_profile_stats =
+		__alloc_percpu(win2lin_profile_size *
+			       sizeof(struct win2lin_profile_stat),
+			       __alignof__(struct win2lin_profile_stat));
+	if (!win2lin_profile_stats) {
+		ERROR("couldn't allocate profile counters");
+		ntoskernel_exit();
+		return -ENOMEM;
+	}
+#endif
 
 #if defined(CONFIG_X86_64)
 	memset(&kuser_shared_data, 0, sizeof(kuser_shared_data));
@@ -2640,6 +2991,7 @@ void ntoskernel_exit_device(struct wrap_device *wd)
 void ntoskernel_exit(void)
 {
 	struct nt_list *cur;
+	int i;
 
 	ENTER2("");
 
@@ -2682,6 +3034,11 @@ void ntoskernel_exit(void)
 		kmem_cache_destroy(mdl_cache);
 		mdl_cache = NULL;
 	}
+	for (i = 0; i < IRP_CACHE_BUCKETS; i++) {
+		if (irp_cache[i])
+			kmem_cache_destroy(irp_cache[i]);
+		irp_cache[i] = NULL;
+	}
 
 	TRACE2("freeing callbacks");
 	spin_lock_bh(&ntoskernel_lock);
@@ -2709,6 +3066,11 @@ void ntoskernel_exit(void)
 
 #if defined(CONFIG_X86_64)
 	del_timer_sync(&shared_data_timer);
+#endif
+#ifdef WIN2LIN_PROFILE
+	win2lin_profile_enabled = 0;
+	free_percpu(win2lin_profile_stats);
+	win2lin_profile_stats = NULL;
 #endif
 	if (ntos_wq)
 		destroy_workqueue(ntos_wq);
@@ -47,6 +47,7 @@
 #include <linux/kthread.h>
 #include <linux/workqueue.h>
 #include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
 #include <linux/sched/signal.h>
@@ -121,6 +122,10 @@ static cpumask_t cpumasks[NR_CPUS];
 #define __packed __attribute__((packed))
 #endif
 
+#ifndef __percpu
+#define __percpu
+#endif
+
 /* pci functions in 2.6 kernels have problems allocating dma buffers,
  * but seem to work fine with dma functions
  */
@@ -200,38 +205,75 @@ struct wrap_work_struct {
 	struct list_head list;
 	void (*func)(struct wrap_work_struct *data);
 	void *data;
-	/* whether/on which thread scheduled */
-	struct workqueue_thread *thread;
+	/* workqueue last queued on */
+	struct wrap_workqueue_struct *workq;
+	/* whether queued and not yet started */
+	u8 pending;
+};
+
+/* work queued when timer expires */
+struct wrap_delayed_work {
+	struct wrap_work_struct work;
+	struct timer_list timer;
+	struct wrap_workqueue_struct *workq;
 };
 
 #define work_struct wrap_work_struct
 #define workqueue_struct wrap_workqueue_struct
+#define delayed_work wrap_delayed_work
 
 #undef INIT_WORK
 #define INIT_WORK(work, pfunc)					\
 	do {							\
+		INIT_LIST_HEAD(&(work)->list);			\
 		(work)->func = (pfunc);				\
 		(work)->data = (work);				\
-		(work)->thread = NULL;				\
+		(work)->workq = NULL;				\
+		(work)->pending = 0;				\
 	} while (0)
 
 #undef create_singlethread_workqueue
-#define create_singlethread_workqueue(wq) wrap_create_wq(wq, 1, 0)
+#define create_singlethread_workqueue(wq) wrap_create_wq(wq, 0)
 #undef create_workqueue
-#define create_workqueue(wq) wrap_create_wq(wq, 0, 0)
+#define create_workqueue(wq) wrap_create_wq(wq, 0)
 #undef destroy_workqueue
 #define destroy_workqueue(wq) wrap_destroy_wq(wq)
 #undef queue_work
 #define queue_work(wq, work) wrap_queue_work(wq, work)
 #undef flush_workqueue
 #define flush_workqueue(wq) wrap_flush_wq(wq)
-
-struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
-					u8 freeze);
+#undef work_pending
+#define work_pending(work) ((work)->pending)
+#undef cancel_work_sync
+#define cancel_work_sync(work) wrap_cancel_work_sync(work)
+#undef flush_work
+#define flush_work(work) wrap_flush_work(work)
+#undef INIT_DELAYED_WORK
+#define INIT_DELAYED_WORK(dwork, pfunc) wrap_init_delayed_work(dwork, pfunc)
+#undef queue_delayed_work
+#define queue_delayed_work(wq, dwork, delay)		\
+	wrap_queue_delayed_work(wq, dwork, delay)
+#undef cancel_delayed_work
+#define cancel_delayed_work(dwork) wrap_cancel_delayed_work(dwork)
+#undef cancel_delayed_work_sync
+#define cancel_delayed_work_sync(dwork) wrap_cancel_delayed_work_sync(dwork)
+#undef delayed_work_pending
+#define delayed_work_pending(dwork)					\
+	(timer_pending(&(dwork)->timer) || work_pending(&(dwork)->work))
+
+struct workqueue_struct *wrap_create_wq(const char *name, u8 freeze);
 void wrap_destroy_wq(struct workqueue_struct *workq);
 int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work);
-void wrap_cancel_work(struct work_struct *work);
+int wrap_cancel_work(struct work_struct *work);
+int wrap_cancel_work_sync(struct work_struct *work);
+void wrap_flush_work(struct work_struct *work);
 void wrap_flush_wq(struct workqueue_struct *workq);
+void wrap_init_delayed_work(struct delayed_work *dwork,
+			    void (*func)(struct work_struct *work));
+int wrap_queue_delayed_work(struct workqueue_struct *workq,
+			    struct delayed_work *dwork, unsigned long delay);
+int wrap_cancel_delayed_work(struct delayed_work *dwork);
+int wrap_cancel_delayed_work_sync(struct delayed_work *dwork);
 
 #else // WRAP_WQ
 
@@ -250,6 +292,15 @@ static inline void (INIT_WORK)(struct work_struct *work, work_func_t func)
 
 #endif // WRAP_WQ
 
+/* workqueue that runs one work at a time, in the order queued */
+#if !defined(WRAP_WQ) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+#define wrap_create_ordered_wq(name, flags)			\
+	alloc_ordered_workqueue("%s", WQ_MEM_RECLAIM | (flags), name)
+#else
+#define wrap_create_ordered_wq(name, flags)			\
+	create_singlethread_workqueue(name)
+#endif
+
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,18)
 #define ISR_PT_REGS_PARAM_DECL
 #else
@@ -385,6 +436,21 @@ static inline void netif_trans_update(struct net_device *dev)
 }
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#include <linux/u64_stats_sync.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#define u64_stats_init(syncp) do { } while (0)
+#endif
+#else
+struct u64_stats_sync {
+};
+#define u64_stats_init(syncp) do { } while (0)
+#define u64_stats_update_begin(syncp) do { } while (0)
+#define u64_stats_update_end(syncp) do { } while (0)
+#define u64_stats_fetch_begin(syncp) 0
+#define u64_stats_fetch_retry(syncp, start) 0
+#endif
+
 /* TICK is 100ns */
 #define TICKSPERSEC		10000000
 #define TICKSPERMSEC		10000
@@ -465,11 +531,30 @@ struct wrap_timer {
 	struct timer_list timer;
 	struct nt_timer *nt_timer;
 	long repeat;
+	/* device owning this timer (NULL for global timers) and
+	 * nominal expiry of a coalesced periodic timer */
+	struct ndis_device *wnd;
+	unsigned long expires;
 #ifdef TIMER_DEBUG
 	unsigned long wrap_timer_magic;
 #endif
 };
 
+/* IRPs are allocated from IRP_CACHE_BUCKETS caches, or with kmalloc
+ * if too big; index IRP_CACHE_BUCKETS in stats is for the latter */
+#define IRP_CACHE_BUCKETS 3
+struct irp_cache_stats {
+	unsigned long allocated[IRP_CACHE_BUCKETS + 1];
+	unsigned long freed[IRP_CACHE_BUCKETS + 1];
+	unsigned long reused;
+	/* IRPs with MDL / system buffer allocated with them */
+	unsigned long inlined;
+	/* from allocation to free, in usec */
+	unsigned long total_lifetime;
+	unsigned long max_lifetime;
+};
+extern struct irp_cache_stats irp_cache_stats;
+
 struct ntos_work_item {
 	struct nt_list list;
 	void *arg1;
@@ -537,7 +622,30 @@ struct wrap_device {
 			struct usb_device *udev;
 			struct usb_interface *intf;
 			int num_alloc_urbs;
+			/* all URBs of the device */
 			struct nt_list wrap_urb_list;
+			/* URBs not in use */
+			nt_slist_header free_urbs;
+			NT_SPIN_LOCK free_urbs_lock;
+			/* completed URBs are processed in complete_wq */
+			struct workqueue_struct *complete_wq;
+			struct work_struct complete_work;
+			struct nt_list complete_list;
+			spinlock_t complete_list_lock;
+			unsigned long completed;
+			u64 total_complete_latency;
+			u64 max_complete_latency;
+			/* unused bounce buffers for each endpoint
+			 * number and direction */
+			struct nt_list bounce_bufs[32];
+			int num_bounce_bufs;
+			spinlock_t bounce_lock;
+			/* isochronous transfers */
+			unsigned long iso_completed;
+			unsigned long iso_packets;
+			unsigned long iso_errors;
+			unsigned long iso_missed;
+			unsigned int iso_last_frame;
 		} usb;
 	};
 };
@@ -559,7 +667,6 @@ struct wrap_device {
 
 extern struct workqueue_struct *ntos_wq;
 extern struct workqueue_struct *ndis_wq;
-extern struct workqueue_struct *wrapndis_wq;
 
 #define atomic_unary_op(var, size, oper)				\
 do {									\
@@ -638,10 +745,21 @@ do {									\
 
 #ifdef WRAP_PREEMPT
 
+/* Since 5.11, migrate_disable pins a task to current processor
+ * without changing its affinity mask, and the task can still sleep;
+ * that is much cheaper than rewriting cpus_allowed with
+ * set_cpus_allowed_ptr (which takes runqueue locks) at every raise
+ * and lower of IRQL. local_lock is not used, as with PREEMPT_RT it is
+ * a spinlock that doesn't allow sleeping, which the mutex here
+ * tolerates. */
+#if defined(CONFIG_SMP) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+#define WRAP_IRQL_MIGRATE 1
+#endif
+
 struct irql_info {
 	int count;
 	struct mutex lock;
-#ifdef CONFIG_SMP
+#if defined(CONFIG_SMP) && !defined(WRAP_IRQL_MIGRATE)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
 	cpumask_t cpus_mask;
 #else
@@ -653,6 +771,50 @@ struct irql_info {
 
 DECLARE_PER_CPU(struct irql_info, irql_info);
 
+#ifdef WRAP_IRQL_MIGRATE
+
+static inline KIRQL raise_irql(KIRQL newirql)
+{
+	struct irql_info *info;
+
+	assert(newirql == DISPATCH_LEVEL);
+	/* once migration is disabled, this task stays on this cpu
+	 * until matching migrate_enable */
+	migrate_disable();
+	info = this_cpu_ptr(&irql_info);
+	if (info->task == current) {
+		assert(info->count > 0);
+		assert(mutex_is_locked(&info->lock));
+		info->count++;
+		migrate_enable();
+		return DISPATCH_LEVEL;
+	}
+	mutex_lock(&info->lock);
+	assert(info->count == 0);
+	assert(info->task == NULL);
+	info->count = 1;
+	info->task = current;
+	return PASSIVE_LEVEL;
+}
+
+static inline void lower_irql(KIRQL oldirql)
+{
+	struct irql_info *info;
+
+	assert(oldirql <= DISPATCH_LEVEL);
+	info = this_cpu_ptr(&irql_info);
+	assert(info->task == current);
+	assert(mutex_is_locked(&info->lock));
+	assert(info->count > 0);
+	if (--info->count == 0) {
+		info->task = NULL;
+		mutex_unlock(&info->lock);
+		migrate_enable();
+	}
+}
+
+#else /* WRAP_IRQL_MIGRATE */
+
 static inline KIRQL raise_irql(KIRQL newirql)
 {
 	struct irql_info *info;
@@ -704,6 +866,8 @@ static inline void lower_irql(KIRQL oldirql)
 	put_cpu_var(irql_info);
 }
 
+#endif /* WRAP_IRQL_MIGRATE */
+
 static inline KIRQL current_irql(void)
 {
 	int count;
@@ -761,7 +925,6 @@ static inline void lower_irql(KIRQL oldirql)
  * crashes */
 
 #define NT_SPIN_LOCK_UNLOCKED 0
-#define NT_SPIN_LOCK_LOCKED 1
 
 static inline void nt_spin_lock_init(NT_SPIN_LOCK *lock)
 {
@@ -770,33 +933,127 @@ static inline void nt_spin_lock_init(NT_SPIN_LOCK *lock)
 
 #ifdef CONFIG_SMP
 
+/* Spinlocks are ticket locks: lower half of the lock is the ticket
+ * being served and upper half is the next ticket to be handed out;
+ * lock is free when both are same, so 0 is still the unlocked
+ * state. Unlike a plain xchg lock, waiters get the lock in order and
+ * only read the lock while spinning, so the cache line isn't bounced
+ * between processors waiting for it. */
+
+#ifdef CONFIG_X86_64
+typedef u32 nt_ticket_t;
+#define NT_TICKET_SHIFT 32
+#else
+typedef u16 nt_ticket_t;
+#define NT_TICKET_SHIFT 16
+#endif
+
+#define NT_TICKET_INC ((ULONG_PTR)1 << NT_TICKET_SHIFT)
+/* if more than these many are waiting, lock is most likely garbage */
+#define NT_TICKET_MAX_WAITERS (4 * NR_CPUS)
+
+#define nt_spin_lock_head(lock) (*(volatile nt_ticket_t *)(lock))
+
+#ifdef NT_SPIN_LOCK_STATS
+/* contention counters, indexed by hash of lock address */
+#define NT_SPIN_LOCK_STATS_BITS 8
+#define NT_SPIN_LOCK_STATS_SIZE (1 << NT_SPIN_LOCK_STATS_BITS)
+
+struct nt_spin_lock_stat {
+	NT_SPIN_LOCK *lock;
+	void *site;
+	unsigned long contended;
+	unsigned long spins;
+	unsigned long max_spins;
+};
+
+extern struct nt_spin_lock_stat nt_spin_lock_stats[NT_SPIN_LOCK_STATS_SIZE];
+
+void nt_spin_lock_contended(NT_SPIN_LOCK *lock, void *site,
+			    unsigned long spins);
+void nt_spin_lock_stats_reset(void);
+#endif
+
+#ifdef WIN2LIN_PROFILE
+/* calls of and time spent in each function called through win2lin
+ * stubs, indexed by the position of the stub in win2lin_stubs.h */
+struct win2lin_profile_stat {
+	u64 calls;
+	u64 ns;
+};
+
+extern const char *win2lin_profile_names[];
+extern const unsigned int win2lin_profile_size;
+extern struct win2lin_profile_stat __percpu *win2lin_profile_stats;
+extern int win2lin_profile_enabled;
+
+void win2lin_profile_reset(void);
+/* called from win2lin stubs */
+u64 win2lin_profile_enter(unsigned int index);
+void win2lin_profile_exit(unsigned int index, u64 start);
+#endif
+
 static inline void nt_spin_lock(NT_SPIN_LOCK *lock)
 {
-	while (1) {
-		unsigned long lockval = xchg(lock, NT_SPIN_LOCK_LOCKED);
+	ULONG_PTR lockval;
+	nt_ticket_t ticket, head;
+#ifdef NT_SPIN_LOCK_STATS
+	unsigned long spins = 0;
+#endif
 
-		if (likely(lockval == NT_SPIN_LOCK_UNLOCKED))
-			break;
-		if (unlikely(lockval > NT_SPIN_LOCK_LOCKED)) {
-			ERROR("bad spinlock: 0x%lx at %p", lockval, lock);
-			return;
-		}
-		/* "rep; nop" doesn't change cx register, it's a "pause" */
-		__asm__ __volatile__("rep; nop");
+	/* a garbage lock is reported before taking a ticket, so it
+	 * isn't made worse */
+	lockval = *(volatile ULONG_PTR *)lock;
+	if (unlikely((nt_ticket_t)((nt_ticket_t)(lockval >> NT_TICKET_SHIFT) -
+				   (nt_ticket_t)lockval) >
+		     NT_TICKET_MAX_WAITERS)) {
+		ERROR("bad spinlock: 0x%lx at %p", (unsigned long)lockval,
+		      lock);
+		return;
 	}
+	lockval = pre_atomic_add(*lock, NT_TICKET_INC);
+	ticket = lockval >> NT_TICKET_SHIFT;
+	head = lockval;
+	if (likely(head == ticket))
+		return;
+	do {
+		/* back off in proportion to number of waiters ahead */
+		unsigned int i = (nt_ticket_t)(ticket - head);
+
+		while (i--)
+			cpu_relax();
+#ifdef NT_SPIN_LOCK_STATS
+		spins++;
+#endif
+		head = nt_spin_lock_head(lock);
+	} while (head != ticket);
+	barrier();
+#ifdef NT_SPIN_LOCK_STATS
+	nt_spin_lock_contended(lock, __builtin_return_address(0), spins);
+#endif
 }
 
 static inline void nt_spin_unlock(NT_SPIN_LOCK *lock)
 {
-	unsigned long lockval = xchg(lock, NT_SPIN_LOCK_UNLOCKED);
+	ULONG_PTR lockval = *(volatile ULONG_PTR *)lock;
+	nt_ticket_t head = lockval;
 
-	if (likely(lockval == NT_SPIN_LOCK_LOCKED))
+	if (unlikely(head == (nt_ticket_t)(lockval >> NT_TICKET_SHIFT))) {
+		WARNING("unlocking unlocked spinlock: 0x%lx at %p",
+			(unsigned long)lockval, lock);
 		return;
-	WARNING("unlocking unlocked spinlock: 0x%lx at %p", lockval, lock);
+	}
+	/* only the owner changes head, and x86 doesn't reorder stores
+	 * with earlier loads and stores, so a plain store releases
+	 * the lock */
+	barrier();
+	nt_spin_lock_head(lock) = head + 1;
 }
 
 #else // CONFIG_SMP
 
+#undef NT_SPIN_LOCK_STATS
+
 #define nt_spin_lock(lock) do { } while (0)
 
 #define nt_spin_unlock(lock) do { } while (0)
@@ -842,34 +1099,110 @@ static inline ULONG SPAN_PAGES(void *ptr, SIZE_T length)
 		>> PAGE_SHIFT;
 }
 
+/* As on Windows, a pop may read 'next' of an entry that another
+ * processor has just popped and freed; the value read then doesn't
+ * matter, as the header has changed and cmpxchg fails, but the read
+ * itself may fault, which Windows handles and Linux doesn't, so it is
+ * done without faulting; returns 0 if read */
+static inline int nt_slist_read_next(struct nt_slist *entry,
+				     struct nt_slist **next)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	return copy_from_kernel_nofault(next, &entry->next, sizeof(*next));
+#else
+	return probe_kernel_read(next, &entry->next, sizeof(*next));
+#endif
+}
+
 #ifdef CONFIG_X86_64
 
-/* TODO: can these be implemented without using spinlock? */
+/* 'align' holds depth in lower 16 bits and a sequence number, which
+ * is incremented with every change, in the rest, so cmpxchg16b of
+ * whole header fails if an entry is popped and pushed back in
+ * between (ABA). */
+
+#define NT_SLIST_DEPTH_MASK 0xffffULL
+#define NT_SLIST_SEQUENCE_INC 0x10000ULL
+
+static inline int nt_cmpxchg16b(nt_slist_header *ptr, nt_slist_header old,
+				nt_slist_header new)
+{
+	char ret;
+
+	__asm__ __volatile__(
+		LOCK_PREFIX "cmpxchg16b %1\n\t"
+		"sete %0\n"
+		: "=qm" (ret), "+m" (*ptr), "+a" (old.align), "+d" (old.region)
+		: "b" (new.align), "c" (new.region)
+		: "memory");
+	return ret;
+}
+
+/* cmpxchg16b is not available on some early x86_64 processors, and
+ * it requires 16-byte aligned header (which Windows requires too, but
+ * we don't trust drivers); in such cases, use spinlock */
+#define nt_slist_lock_free(head)					\
+	(boot_cpu_has(X86_FEATURE_CX16) && !((unsigned long)(head) & 15))
 
 static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 					      struct nt_slist *entry,
 					      NT_SPIN_LOCK *lock)
 {
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
-	entry->next = head->next;
-	head->next = entry;
-	head->depth++;
-	nt_spin_unlock_irql(lock, irql);
-	TRACE4("%p, %p, %p", head, entry, entry->next);
-	return entry->next;
+	nt_slist_header old, new;
+
+	if (likely(nt_slist_lock_free(head))) {
+		do {
+			old.align = head->align;
+			old.region = head->region;
+			entry->next = old.next;
+			new.next = entry;
+			new.align = ((old.align + NT_SLIST_SEQUENCE_INC) &
+				     ~NT_SLIST_DEPTH_MASK) |
+				((old.align + 1) & NT_SLIST_DEPTH_MASK);
+		} while (!nt_cmpxchg16b(head, old, new));
+		TRACE4("%p, %p, %p", head, entry, old.next);
+		return old.next;
+	} else {
+		KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
+		entry->next = head->next;
+		head->next = entry;
+		head->depth++;
+		nt_spin_unlock_irql(lock, irql);
+		TRACE4("%p, %p, %p", head, entry, entry->next);
+		return entry->next;
+	}
 }
 
 static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 					     NT_SPIN_LOCK *lock)
 {
 	struct nt_slist *entry;
-	KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
-	entry = head->next;
-	if (entry) {
-		head->next = entry->next;
-		head->depth--;
+	nt_slist_header old, new;
+
+	if (likely(nt_slist_lock_free(head))) {
+		while (1) {
+			old.align = head->align;
+			old.region = head->region;
+			entry = old.next;
+			if (!entry)
+				break;
+			if (nt_slist_read_next(entry, &new.next))
+				continue;
+			new.align = ((old.align + NT_SLIST_SEQUENCE_INC) &
+				     ~NT_SLIST_DEPTH_MASK) |
+				((old.align - 1) & NT_SLIST_DEPTH_MASK);
+			if (nt_cmpxchg16b(head, old, new))
+				break;
+		}
+	} else {
+		KIRQL irql = nt_spin_lock_irql(lock, DISPATCH_LEVEL);
+		entry = head->next;
+		if (entry) {
+			head->next = entry->next;
+			head->depth--;
+		}
+		nt_spin_unlock_irql(lock, irql);
 	}
-	nt_spin_unlock_irql(lock, irql);
 	TRACE4("%p, %p", head, entry);
 	return entry;
 }
@@ -892,7 +1225,9 @@ static inline u64 nt_cmpxchg8b(volatile u64 *ptr, u64 old, u64 new)
 }
 
 /* slist routines below update slist atomically - no need for
- * spinlocks */
+ * spinlocks; sequence is incremented with every change so that
+ * cmpxchg8b fails if an entry is popped and pushed back in between
+ * (ABA) */
 
 static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 					      struct nt_slist *entry,
@@ -904,6 +1239,7 @@ static inline struct nt_slist *PushEntrySList(nt_slist_header *head,
 		entry->next = old.next;
 		new.next = entry;
 		new.depth = old.depth + 1;
+		new.sequence = old.sequence + 1;
 	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
 	TRACE4("%p, %p, %p", head, entry, old.next);
 	return old.next;
@@ -914,14 +1250,19 @@ static inline struct nt_slist *PopEntrySList(nt_slist_header *head,
 {
 	struct nt_slist *entry;
 	nt_slist_header old, new;
-	do {
+	while (1) {
 		old.align = head->align;
 		entry = old.next;
 		if (!entry)
 			break;
-		new.next = entry->next;
+		if (nt_slist_read_next(entry, &new.next))
+			continue;
 		new.depth = old.depth - 1;
-	} while (nt_cmpxchg8b(&head->align, old.align, new.align) != old.align);
+		new.sequence = old.sequence + 1;
+		if (nt_cmpxchg8b(&head->align, old.align, new.align) ==
+		    old.align)
+			break;
+	}
 	TRACE4("%p, %p", head, entry);
 	return entry;
 }
@@ -938,15 +1279,18 @@ int ntoskernel_init(void);
 void ntoskernel_exit(void);
 int ntoskernel_init_device(struct wrap_device *wd);
 void ntoskernel_exit_device(struct wrap_device *wd);
+int wrap_selftest(void);
 void *allocate_object(ULONG size, enum common_object_type type,
 		      struct unicode_string *name);
 
 #ifdef ENABLE_USB
 int usb_init(void);
 void usb_exit(void);
+int usb_selftest(void);
 #else
 static inline int usb_init(void) { return 0; }
 static inline void usb_exit(void) {}
+static inline int usb_selftest(void) { return 0; }
 #endif
 int usb_init_device(struct wrap_device *wd);
 void usb_exit_device(struct wrap_device *wd);
@@ -960,6 +1304,14 @@ int stricmp(const char *s1, const char *s2);
 void dump_bytes(const char *name, const u8 *from, int len);
 struct mdl *allocate_init_mdl(void *virt, ULONG length);
 void free_mdl(struct mdl *mdl);
+ULONG inline_mdl_size(void *virt, ULONG length);
+struct mdl *init_inline_mdl(void *mem, void *virt, ULONG length);
+struct irp *alloc_irp(CCHAR stack_count, ULONG inline_size);
+void free_irp(struct irp *irp);
+void *irp_inline_data(struct irp *irp);
+void set_irp_user_buf(struct irp *irp, void *buf, ULONG len);
+ULONG irp_user_buf_len(struct irp *irp);
+struct irp *allocate_init_irp(CCHAR stack_count, ULONG inline_size);
 struct driver_object *find_bus_driver(const char *name);
 void free_custom_extensions(struct driver_extension *drv_obj_ext);
 struct nt_thread *get_current_nt_thread(void);
@@ -20,6 +20,10 @@
 #include "loader.h"
 #include "ntoskernel_io_exports.h"
 
+/* METHOD_BUFFERED system buffers up to this size are allocated with
+ * IRP, so IRPs with a few stack locations still fit IRP caches */
+#define IRP_INLINE_BUF_MAX 256
+
 wstdcall void WIN_FUNC(IoAcquireCancelSpinLock,1)
 	(KIRQL *irql) __acquires(irql)
 {
@@ -78,23 +82,37 @@ wstdcall void WIN_FUNC(IoReuseIrp,2)
 		alloc_flags = irp->alloc_flags;
 		IoInitializeIrp(irp, irp->size, irp->stack_count);
 		irp->alloc_flags = alloc_flags;
+		set_irp_user_buf(irp, NULL, 0);
 		irp->io_status.status = status;
+		atomic_inc_var(irp_cache_stats.reused);
 	}
 	IOEXIT(return);
 }
 
-wstdcall struct irp *WIN_FUNC(IoAllocateIrp,2)
-	(char stack_count, BOOLEAN charge_quota)
+/* IRP with inline_size bytes after stack locations, available with
+ * irp_inline_data, for MDL and system buffer of IRPs built here */
+struct irp *allocate_init_irp(CCHAR stack_count, ULONG inline_size)
 {
 	struct irp *irp;
 	int irp_size;
 
-	IOENTER("count: %d", stack_count);
 	stack_count++;
 	irp_size = IoSizeOfIrp(stack_count);
-	irp = kmalloc(irp_size, irql_gfp());
-	if (irp)
+	irp = alloc_irp(stack_count, inline_size);
+	if (irp) {
 		IoInitializeIrp(irp, irp_size, stack_count);
+		irp->alloc_flags |= IRP_WRAP_ALLOCATED;
+	}
+	return irp;
+}
+
+wstdcall struct irp *WIN_FUNC(IoAllocateIrp,2)
+	(char stack_count, BOOLEAN charge_quota)
+{
+	struct irp *irp;
+
+	IOENTER("count: %d", stack_count);
+	irp = allocate_init_irp(stack_count, 0);
 	IOTRACE("irp %p", irp);
 	IOEXIT(return irp);
 }
@@ -178,7 +196,7 @@ wstdcall void WIN_FUNC(IoFreeIrp,1)
 	if (irp->flags & IRP_SYNCHRONOUS_API)
 		IoDequeueThreadIrp(irp);
 	IoCancelIrp(irp);
-	kfree(irp);
+	free_irp(irp);
 
 	IOEXIT(return);
 }
@@ -194,7 +212,11 @@ wstdcall struct irp *WIN_FUNC(IoBuildAsynchronousFsdRequest,6)
 	IOENTER("%p", dev_obj);
 	if (!dev_obj)
 		IOEXIT(return NULL);
-	irp = IoAllocateIrp(dev_obj->stack_count, FALSE);
+	if (dev_obj->flags & DO_DIRECT_IO)
+		irp = allocate_init_irp(dev_obj->stack_count,
+					inline_mdl_size(buffer, length));
+	else
+		irp = allocate_init_irp(dev_obj->stack_count, 0);
 	if (irp == NULL) {
 		WARNING("couldn't allocate irp");
 		IOEXIT(return NULL);
@@ -211,11 +233,8 @@ wstdcall struct irp *WIN_FUNC(IoBuildAsynchronousFsdRequest,6)
 	irp_sl->completion_routine = NULL;
 
 	if (dev_obj->flags & DO_DIRECT_IO) {
-		irp->mdl = IoAllocateMdl(buffer, length, FALSE, FALSE, irp);
-		if (irp->mdl == NULL) {
-			IoFreeIrp(irp);
-			return NULL;
-		}
+		irp->mdl = init_inline_mdl(irp_inline_data(irp), buffer,
+					   length);
 		MmProbeAndLockPages(irp->mdl, KernelMode,
 				    major_fn == IRP_MJ_WRITE ?
 				    IoReadAccess : IoWriteAccess);
@@ -262,16 +281,42 @@ wstdcall struct irp *WIN_FUNC(IoBuildDeviceIoControlRequest,9)
 {
 	struct irp *irp;
 	struct io_stack_location *irp_sl;
-	ULONG buf_len;
+	ULONG buf_len, inline_size;
+	char *inline_data;
 
 	IOENTER("%p, 0x%08x, %d", dev_obj, ioctl, internal_ioctl);
 	if (!dev_obj)
 		IOEXIT(return NULL);
-	irp = IoAllocateIrp(dev_obj->stack_count, FALSE);
+	/* system buffer and MDL are allocated with IRP, so they are
+	 * freed with it */
+	switch (IO_METHOD_FROM_CTL_CODE(ioctl)) {
+	case METHOD_BUFFERED:
+		inline_size = max(input_buf_len, output_buf_len);
+		/* bigger buffers are allocated separately, so IRPs
+		 * still come from caches */
+		if (inline_size > IRP_INLINE_BUF_MAX)
+			inline_size = 0;
+		break;
+	case METHOD_IN_DIRECT:
+	case METHOD_OUT_DIRECT:
+		if (input_buf)
+			inline_size = ALIGN(input_buf_len, sizeof(void *));
+		else
+			inline_size = 0;
+		if (output_buf)
+			inline_size += inline_mdl_size(output_buf,
+						       output_buf_len);
+		break;
+	default:
+		inline_size = 0;
+		break;
+	}
+	irp = allocate_init_irp(dev_obj->stack_count, inline_size);
 	if (irp == NULL) {
 		WARNING("couldn't allocate irp");
 		return NULL;
 	}
+	inline_data = irp_inline_data(irp);
 	irp_sl = IoGetNextIrpStackLocation(irp);
 	irp_sl->params.dev_ioctl.code = ioctl;
 	irp_sl->params.dev_ioctl.input_buf_len = input_buf_len;
@@ -284,50 +329,49 @@ wstdcall struct irp *WIN_FUNC(IoBuildDeviceIoControlRequest,9)
 	case METHOD_BUFFERED:
 		buf_len = max(input_buf_len, output_buf_len);
 		if (buf_len) {
-			irp->associated_irp.system_buffer =
-				ExAllocatePoolWithTag(NonPagedPool, buf_len, 0);
-			if (!irp->associated_irp.system_buffer) {
-				IoFreeIrp(irp);
-				IOEXIT(return NULL);
+			if (inline_data) {
+				irp->associated_irp.system_buffer =
+					inline_data;
+				irp->flags = IRP_BUFFERED_IO;
+			} else {
+				irp->associated_irp.system_buffer =
+					ExAllocatePoolWithTag(NonPagedPool,
+							      buf_len, 0);
+				if (!irp->associated_irp.system_buffer) {
+					IoFreeIrp(irp);
+					IOEXIT(return NULL);
+				}
+				irp->flags = IRP_BUFFERED_IO |
+					IRP_DEALLOCATE_BUFFER;
 			}
-			irp->associated_irp.system_buffer = input_buf;
 			if (input_buf)
 				memcpy(irp->associated_irp.system_buffer,
 				       input_buf, input_buf_len);
-			irp->flags = IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+			/* IofCompleteRequest copies output to user_buf */
 			if (output_buf)
-				irp->flags = IRP_INPUT_OPERATION;
-			irp->user_buf = output_buf;
+				irp->flags |= IRP_INPUT_OPERATION;
+			set_irp_user_buf(irp, output_buf, output_buf_len);
 		} else
 			irp->user_buf = NULL;
 		break;
 	case METHOD_IN_DIRECT:
 	case METHOD_OUT_DIRECT:
 		if (input_buf) {
-			irp->associated_irp.system_buffer =
-				ExAllocatePoolWithTag(NonPagedPool,
-						      input_buf_len, 0);
-			if (!irp->associated_irp.system_buffer) {
-				IoFreeIrp(irp);
-				IOEXIT(return NULL);
-			}
+			irp->associated_irp.system_buffer = inline_data;
 			memcpy(irp->associated_irp.system_buffer,
 			       input_buf, input_buf_len);
-			irp->flags = IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+			irp->flags = IRP_BUFFERED_IO;
+			inline_data += ALIGN(input_buf_len, sizeof(void *));
 		}
-		/* TODO: we are supposed to setup MDL, but USB layer
-		 * doesn't use MDLs. Moreover, USB layer mirrors
-		 * non-DMAable buffers, so no need to allocate
-		 * DMAable buffer here */
+		/* USB layer mirrors non-DMAable buffers, so no need
+		 * to allocate DMAable buffer here */
 		if (output_buf) {
-			irp->associated_irp.system_buffer =
-				ExAllocatePoolWithTag(NonPagedPool,
-						      output_buf_len, 0);
-			if (!irp->associated_irp.system_buffer) {
-				IoFreeIrp(irp);
-				IOEXIT(return NULL);
-			}
-			irp->flags = IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+			irp->mdl = init_inline_mdl(inline_data, output_buf,
+						   output_buf_len);
+			MmProbeAndLockPages(irp->mdl, KernelMode,
+					    IO_METHOD_FROM_CTL_CODE(ioctl) ==
+					    METHOD_IN_DIRECT ?
+					    IoReadAccess : IoWriteAccess);
 		}
 		break;
 	case METHOD_NEITHER:
@@ -438,6 +482,20 @@ wfastcall void WIN_FUNC(IofCompleteRequest,2)
 		}
 	}
 
+	/* output must be in place before the waiter is woken up; lower
+	 * driver may report more than the caller's buffer can take,
+	 * which is known for IRPs built here */
+	if ((irp->flags & (IRP_BUFFERED_IO | IRP_INPUT_OPERATION)) ==
+	    (IRP_BUFFERED_IO | IRP_INPUT_OPERATION) && irp->user_buf &&
+	    irp->associated_irp.system_buffer &&
+	    NT_SUCCESS(irp->io_status.status)) {
+		ULONG_PTR len = irp->io_status.info;
+
+		if (irp->alloc_flags & IRP_WRAP_ALLOCATED)
+			len = min_t(ULONG_PTR, len, irp_user_buf_len(irp));
+		memcpy(irp->user_buf, irp->associated_irp.system_buffer, len);
+	}
+
 	if (irp->user_status) {
 		irp->user_status->status = irp->io_status.status;
 		irp->user_status->info = irp->io_status.info;
@@ -448,6 +506,8 @@ wfastcall void WIN_FUNC(IofCompleteRequest,2)
 		KeSetEvent(irp->user_event, prio_boost, FALSE);
 	}
 
+	/* system buffer and MDL of IRPs built with IoBuild*
+	 * functions are part of IRP; free_mdl ignores such MDL */
 	if (irp->associated_irp.system_buffer &&
 	    (irp->flags & IRP_DEALLOCATE_BUFFER))
 		ExFreePool(irp->associated_irp.system_buffer);
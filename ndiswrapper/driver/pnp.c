@@ -193,13 +193,14 @@ static NTSTATUS IoSendIrpTopDev(struct device_object *dev_obj, ULONG major_fn,
 {
 	NTSTATUS status;
 	struct nt_event event;
+	struct io_status_block io_status;
 	struct irp *irp;
 	struct io_stack_location *irp_sl;
 	struct device_object *top_dev = IoGetAttachedDeviceReference(dev_obj);
 
 	KeInitializeEvent(&event, NotificationEvent, FALSE);
 	irp = IoBuildSynchronousFsdRequest(IRP_MJ_PNP, top_dev, NULL, 0, NULL,
-					   &event, NULL);
+					   &event, &io_status);
 	irp->io_status.status = STATUS_NOT_IMPLEMENTED;
 	irp->io_status.info = 0;
 	irp_sl = IoGetNextIrpStackLocation(irp);
@@ -211,7 +212,8 @@ static NTSTATUS IoSendIrpTopDev(struct device_object *dev_obj, ULONG major_fn,
 	if (status == STATUS_PENDING) {
 		KeWaitForSingleObject(&event, Executive, KernelMode,
 				      FALSE, NULL);
-		status = irp->io_status.status;
+		/* irp is freed by IoCompleteRequest */
+		status = io_status.status;
 	}
 	ObDereferenceObject(top_dev);
 	return status;
@@ -15,6 +15,7 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/module.h>
+#include <linux/sort.h>
 #include <asm/uaccess.h>
 
 #include "ndis.h"
@@ -178,8 +179,10 @@ static int proc_stats_read(struct seq_file *sf, void *v)
 {
 	struct ndis_device *wnd = (struct ndis_device *)sf->private;
 	struct ndis_wireless_stats stats;
+	struct ndis_counters counters;
 	NDIS_STATUS res;
 	ndis_rssi rssi;
+	int i;
 
 	res = mp_query(wnd, OID_802_11_RSSI, &rssi, sizeof(rssi));
 	if (!res)
@@ -200,6 +203,64 @@ static int proc_stats_read(struct seq_file *sf, void *v)
 		add_text("rx_multicast_frames=%llu\n", stats.rx_multi_frag);
 		add_text("fcs_errors=%llu\n", stats.fcs_err);
 	}
+	get_ndis_counters(wnd, &counters);
+	add_text("tx_ring_full=%llu\n", counters.tx_ring_full);
+	add_text("tx_resources=%llu\n", counters.tx_resources);
+	add_text("tx_pending=%llu\n", counters.tx_pending);
+	add_text("timer_fires=%lu\n", wnd->timer_fires);
+	add_text("timer_wakeups=%lu\n", wnd->timer_wakeups);
+	add_text("wq_queued=%lu\n", wnd->wq_stats.queued);
+	add_text("wq_depth=%d\n", wnd->wq_stats.depth);
+	add_text("wq_max_depth=%d\n", wnd->wq_stats.max_depth);
+	add_text("wq_avg_latency=%llu usec\n", wnd->wq_stats.run ?
+		 div_u64(wnd->wq_stats.total_latency, wnd->wq_stats.run) /
+		 NSEC_PER_USEC : 0);
+	add_text("wq_max_latency=%llu usec\n",
+		 div_u64(wnd->wq_stats.max_latency, NSEC_PER_USEC));
+	add_text("oid_requests_queued=%lu\n", wnd->oid_req_queued);
+	add_text("oid_requests_deduped=%lu\n", wnd->oid_req_deduped);
+	for (i = 0; i < OID_CACHE_SIZE; i++) {
+		struct oid_cache_entry *entry = &wnd->oid_cache[i];
+
+		if (!entry->oid)
+			continue;
+		add_text("oid_cache=%08X ttl=%u msec hits=%lu misses=%lu\n",
+			 entry->oid, jiffies_to_msecs(entry->ttl),
+			 entry->hits, entry->misses);
+	}
+	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
+		add_text("bss_cache_entries=%u\n", wnd->bss_cache.count);
+		add_text("bss_cache_generation=%u\n", wnd->bss_cache.gen);
+		add_text("bss_cache_hits=%lu\n", wnd->bss_cache.hits);
+		add_text("bss_cache_misses=%lu\n", wnd->bss_cache.misses);
+		add_text("bssid_list_hint=%u\n", wnd->bssid_list_hint);
+		add_text("iw_stats_collected=%lu\n", wnd->iw_stats_collected);
+		add_text("iw_stats_rssi_indications=%lu\n",
+			 wnd->iw_stats_rssi_indications);
+		add_text("iw_stats_backoff=%u msec\n",
+			 jiffies_to_msecs(wnd->iw_stats_backoff));
+	}
+	if (wrap_is_usb_bus(wnd->wd->dev_bus)) {
+		struct wrap_device *wd = wnd->wd;
+
+		add_text("urbs_completed=%lu\n", wd->usb.completed);
+		add_text("urb_avg_complete_latency=%llu usec\n",
+			 wd->usb.completed ?
+			 div_u64(wd->usb.total_complete_latency,
+				 wd->usb.completed) / NSEC_PER_USEC : 0);
+		add_text("urb_max_complete_latency=%llu usec\n",
+			 div_u64(wd->usb.max_complete_latency,
+				 NSEC_PER_USEC));
+		if (wd->usb.iso_completed) {
+			add_text("iso_urbs=%lu\n", wd->usb.iso_completed);
+			add_text("iso_packets=%lu\n", wd->usb.iso_packets);
+			add_text("iso_errors=%lu\n", wd->usb.iso_errors);
+			add_text("iso_missed_frames=%lu\n",
+				 wd->usb.iso_missed);
+			add_text("iso_last_frame=%u\n",
+				 wd->usb.iso_last_frame);
+		}
+	}
 
 	return 0;
 }
@@ -361,6 +422,7 @@ static int proc_settings_read(struct seq_file *sf, void *v)
 
 	add_text("hangcheck_interval=%d\n", (hangcheck_interval == 0) ?
 		 (wnd->hangcheck_interval / HZ) : -1);
+	add_text("timer_slack=%u\n", jiffies_to_msecs(wnd->timer_slack));
 
 	list_for_each_entry(setting, &wnd->wd->settings, list) {
 		add_text("%s=%s\n", setting->name, setting->value);
@@ -404,6 +466,13 @@ static ssize_t proc_settings_write(struct file *file, const char __user *buf,
 			wnd->hangcheck_interval = i * HZ;
 			hangcheck_add(wnd);
 		}
+	} else if (!strcmp(setting, "timer_slack")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		/* takes effect when periodic timers are re-armed */
+		wnd->timer_slack = timer_slack_jiffies(i);
 	} else if (!strcmp(setting, "suspend")) {
 		if (!p)
 			return -EINVAL;
@@ -428,6 +497,20 @@ static ssize_t proc_settings_write(struct file *file, const char __user *buf,
 			i = wrap_pnp_resume_usb_device(wnd->wd->usb.intf);
 		if (i)
 			return -EINVAL;
+	} else if (!strcmp(setting, "oid_cache_ttl")) {
+		ndis_oid oid;
+		char *q;
+
+		/* oid_cache_ttl=<oid>:<msec> */
+		if (!p)
+			return -EINVAL;
+		p++;
+		oid = simple_strtoul(p, &q, 0);
+		if (*q != ':' || !oid)
+			return -EINVAL;
+		i = simple_strtoul(q + 1, NULL, 10);
+		if (oid_cache_set_ttl(wnd, oid, i))
+			return -ENOSPC;
 	} else if (!strcmp(setting, "stats_enabled")) {
 		if (!p)
 			return -EINVAL;
@@ -584,6 +667,143 @@ static ssize_t proc_debug_write(struct file *file, const char __user *buf,
 
 PROC_DECLARE_RW(debug)
 
+static int proc_irps_read(struct seq_file *sf, void *v)
+{
+	unsigned long freed;
+	int i;
+
+	for (i = 0; i <= IRP_CACHE_BUCKETS; i++) {
+		if (i < IRP_CACHE_BUCKETS)
+			add_text("stacks<=%d ", 2 << i);
+		else
+			add_text("stacks>%d ", 2 << (i - 1));
+		add_text("allocated=%lu freed=%lu\n",
+			 irp_cache_stats.allocated[i],
+			 irp_cache_stats.freed[i]);
+	}
+	add_text("reused=%lu\n", irp_cache_stats.reused);
+	add_text("inlined=%lu\n", irp_cache_stats.inlined);
+	freed = 0;
+	for (i = 0; i <= IRP_CACHE_BUCKETS; i++)
+		freed += irp_cache_stats.freed[i];
+	add_text("avg_lifetime=%lu usec\n",
+		 freed ? irp_cache_stats.total_lifetime / freed : 0);
+	add_text("max_lifetime=%lu usec\n", irp_cache_stats.max_lifetime);
+	return 0;
+}
+
+PROC_DECLARE_RO(irps)
+
+#ifdef NT_SPIN_LOCK_STATS
+static int proc_spinlocks_read(struct seq_file *sf, void *v)
+{
+	struct nt_spin_lock_stat *stat;
+	int i;
+
+	for (i = 0; i < NT_SPIN_LOCK_STATS_SIZE; i++) {
+		stat = &nt_spin_lock_stats[i];
+		if (!stat->lock)
+			continue;
+		add_text("lock=%p site=%pS contended=%lu spins=%lu "
+			 "max_spins=%lu\n", stat->lock, stat->site,
+			 stat->contended, stat->spins, stat->max_spins);
+	}
+	return 0;
+}
+
+/* writing anything to this file resets the counters */
+static ssize_t proc_spinlocks_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	nt_spin_lock_stats_reset();
+	return count;
+}
+
+PROC_DECLARE_RW(spinlocks)
+#endif
+
+#ifdef WIN2LIN_PROFILE
+struct win2lin_profile_entry {
+	unsigned int index;
+	u64 calls;
+	u64 ns;
+};
+
+static int win2lin_profile_cmp(const void *a, const void *b)
+{
+	const struct win2lin_profile_entry *x = a, *y = b;
+
+	if (x->ns == y->ns)
+		return 0;
+	return x->ns < y->ns ? 1 : -1;
+}
+
+/* functions called by Windows drivers, most time spent first */
+static int proc_profile_read(struct seq_file *sf, void *v)
+{
+	struct win2lin_profile_entry *entries;
+	struct win2lin_profile_stat *stat;
+	unsigned int i, n;
+	int cpu;
+
+	entries = vmalloc(win2lin_profile_size * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+	for (i = 0, n = 0; i < win2lin_profile_size; i++) {
+		entries[n].index = i;
+		entries[n].calls = 0;
+		entries[n].ns = 0;
+		for_each_possible_cpu(cpu) {
+			stat = per_cpu_ptr(&win2lin_profile_stats[i], cpu);
+			entries[n].calls += stat->calls;
+			entries[n].ns += stat->ns;
+		}
+		if (entries[n].calls)
+			n++;
+	}
+	sort(entries, n, sizeof(*entries), win2lin_profile_cmp, NULL);
+	add_text("enabled=%d\n", win2lin_profile_enabled);
+	add_text("%-40s %12s %14s %10s\n", "function", "calls", "total_usec",
+		 "avg_nsec");
+	for (i = 0; i < n; i++)
+		add_text("%-40s %12llu %14llu %10llu\n",
+			 win2lin_profile_names[entries[i].index],
+			 entries[i].calls, div_u64(entries[i].ns, 1000),
+			 div64_u64(entries[i].ns, entries[i].calls));
+	vfree(entries);
+	return 0;
+}
+
+/* "1" enables profiling, "0" disables it and "reset" clears counters */
+static ssize_t proc_profile_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	char setting[MAX_PROC_STR_LEN], *p;
+
+	if (count > MAX_PROC_STR_LEN)
+		return -EINVAL;
+
+	memset(setting, 0, sizeof(setting));
+	if (copy_from_user(setting, buf, count))
+		return -EFAULT;
+
+	if ((p = strchr(setting, '\n')))
+		*p = 0;
+
+	if (!strcmp(setting, "1"))
+		win2lin_profile_enabled = 1;
+	else if (!strcmp(setting, "0"))
+		win2lin_profile_enabled = 0;
+	else if (!strcmp(setting, "reset"))
+		win2lin_profile_reset();
+	else
+		return -EINVAL;
+	return count;
+}
+
+PROC_DECLARE_RW(profile)
+#endif
+
 int wrap_procfs_init(void)
 {
 	int ret;
@@ -610,6 +830,16 @@ int wrap_procfs_init(void)
 	proc_set_user(wrap_procfs_entry, proc_kuid, proc_kgid);
 
 	ret = proc_make_entry_rw(debug, wrap_procfs_entry, NULL);
+	if (ret == 0)
+		ret = proc_make_entry_ro(irps, wrap_procfs_entry, NULL);
+#ifdef NT_SPIN_LOCK_STATS
+	if (ret == 0)
+		ret = proc_make_entry_rw(spinlocks, wrap_procfs_entry, NULL);
+#endif
+#ifdef WIN2LIN_PROFILE
+	if (ret == 0)
+		ret = proc_make_entry_rw(profile, wrap_procfs_entry, NULL);
+#endif
 
 	return ret;
 }
@@ -619,5 +849,12 @@ void wrap_procfs_remove(void)
 	if (wrap_procfs_entry == NULL)
 		return;
 	remove_proc_entry("debug", wrap_procfs_entry);
+	remove_proc_entry("irps", wrap_procfs_entry);
+#ifdef NT_SPIN_LOCK_STATS
+	remove_proc_entry("spinlocks", wrap_procfs_entry);
+#endif
+#ifdef WIN2LIN_PROFILE
+	remove_proc_entry("profile", wrap_procfs_entry);
+#endif
 	proc_remove(wrap_procfs_entry);
 }
@@ -0,0 +1,461 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* tests and benchmarks run at module load with "selftest=1"; results
+ * are printed to kernel log. They are meant to be run on an idle
+ * system, before any Windows driver is loaded. */
+
+#include "ntoskernel.h"
+#include "ndis.h"
+
+#define SELFTEST_IRQL_LOOPS 100000
+
+static s64 selftest_elapsed(ktime_t start, int loops)
+{
+	return div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)), loops);
+}
+
+static void selftest_irql(void)
+{
+	ktime_t start;
+	KIRQL irql;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < SELFTEST_IRQL_LOOPS; i++) {
+		irql = raise_irql(DISPATCH_LEVEL);
+		lower_irql(irql);
+	}
+	INFO("raise/lower IRQL: %lld ns (%s)",
+	     selftest_elapsed(start, SELFTEST_IRQL_LOOPS),
+#if defined(WRAP_IRQL_MIGRATE)
+	     "migrate_disable"
+#elif defined(WRAP_PREEMPT) && defined(CONFIG_SMP)
+	     "set_cpus_allowed"
+#elif defined(WRAP_PREEMPT)
+	     "mutex"
+#else
+	     "preempt_disable"
+#endif
+		);
+
+#ifdef WRAP_IRQL_MIGRATE
+	/* for comparison, pin to current cpu the way raise_irql did
+	 * before 5.11 */
+	do {
+		struct irql_info *info;
+		cpumask_var_t saved;
+		int cpu;
+
+		if (!alloc_cpumask_var(&saved, GFP_KERNEL))
+			break;
+		cpumask_copy(saved, tsk_cpus_allowed(current));
+		start = ktime_get();
+		for (i = 0; i < SELFTEST_IRQL_LOOPS; i++) {
+			cpu = get_cpu();
+			put_cpu();
+			set_cpus_allowed_ptr(current, cpumask_of(cpu));
+			info = &per_cpu(irql_info, cpu);
+			mutex_lock(&info->lock);
+			mutex_unlock(&info->lock);
+			set_cpus_allowed_ptr(current, saved);
+		}
+		INFO("raise/lower IRQL: %lld ns (set_cpus_allowed)",
+		     selftest_elapsed(start, SELFTEST_IRQL_LOOPS));
+		free_cpumask_var(saved);
+	} while (0);
+#endif
+}
+
+/* Threads pop entries from one SList and push them back. Each entry
+ * has a flag that is set while it is in the list; popping an entry
+ * that is not in the list, or pushing one that is, means an update was
+ * lost (e.g., to ABA). At the end, depth and sequence number in the
+ * header must agree with the number of entries and of changes. */
+
+#define SELFTEST_SLIST_ENTRIES 16
+#define SELFTEST_SLIST_BATCH 4
+#define SELFTEST_SLIST_LOOPS 200000
+
+struct selftest_slist_entry {
+	struct nt_slist slist;
+	atomic_t in_list;
+};
+
+static struct {
+	nt_slist_header head;
+	NT_SPIN_LOCK lock;
+	struct selftest_slist_entry *entries;
+	atomic_t changes;
+	atomic_t errors;
+	atomic_t running;
+	struct completion done;
+} selftest_slist;
+
+static int selftest_slist_thread(void *data)
+{
+	struct nt_slist *batch[SELFTEST_SLIST_BATCH];
+	struct selftest_slist_entry *entry;
+	int i, j, n, changes = 0;
+
+	for (i = 0; i < SELFTEST_SLIST_LOOPS; i++) {
+		/* pop a few entries so that others see them missing */
+		n = (i % SELFTEST_SLIST_BATCH) + 1;
+		for (j = 0; j < n; j++) {
+			batch[j] = PopEntrySList(&selftest_slist.head,
+						 &selftest_slist.lock);
+			if (!batch[j])
+				break;
+			changes++;
+			entry = container_of(batch[j],
+					     struct selftest_slist_entry, slist);
+			if (atomic_xchg(&entry->in_list, 0) != 1)
+				atomic_inc(&selftest_slist.errors);
+		}
+		while (j-- > 0) {
+			entry = container_of(batch[j],
+					     struct selftest_slist_entry, slist);
+			if (atomic_xchg(&entry->in_list, 1) != 0)
+				atomic_inc(&selftest_slist.errors);
+			PushEntrySList(&selftest_slist.head, batch[j],
+				       &selftest_slist.lock);
+			changes++;
+		}
+		if (need_resched())
+			schedule();
+	}
+	atomic_add(changes, &selftest_slist.changes);
+	if (atomic_dec_and_test(&selftest_slist.running))
+		complete(&selftest_slist.done);
+	return 0;
+}
+
+static int selftest_slist_run(void)
+{
+	struct task_struct *task;
+	struct nt_slist *slist;
+	ktime_t start;
+	int i, n, threads, lock_free, ret;
+	u64 sequence, changes;
+
+	/* more threads than processors, so some get preempted in the
+	 * middle of updates */
+	threads = max(4, 2 * (int)num_online_cpus());
+	n = threads * SELFTEST_SLIST_ENTRIES;
+	selftest_slist.entries = kcalloc(n, sizeof(*selftest_slist.entries),
+					 GFP_KERNEL);
+	if (!selftest_slist.entries)
+		return -ENOMEM;
+	memset(&selftest_slist.head, 0, sizeof(selftest_slist.head));
+	nt_spin_lock_init(&selftest_slist.lock);
+	for (i = 0; i < n; i++) {
+		atomic_set(&selftest_slist.entries[i].in_list, 1);
+		PushEntrySList(&selftest_slist.head,
+			       &selftest_slist.entries[i].slist,
+			       &selftest_slist.lock);
+	}
+	atomic_set(&selftest_slist.changes, n);
+	atomic_set(&selftest_slist.errors, 0);
+	atomic_set(&selftest_slist.running, threads);
+	init_completion(&selftest_slist.done);
+
+	start = ktime_get();
+	for (i = 0; i < threads; i++) {
+		task = kthread_run(selftest_slist_thread, NULL,
+				   "ndis_selftest/%d", i);
+		if (IS_ERR(task)) {
+			ERROR("couldn't start thread: %ld", PTR_ERR(task));
+			/* count the threads that didn't start as done */
+			if (atomic_sub_and_test(threads - i,
+						&selftest_slist.running))
+				complete(&selftest_slist.done);
+			break;
+		}
+	}
+	wait_for_completion(&selftest_slist.done);
+	INFO("SList push/pop: %lld ns with %d threads",
+	     selftest_elapsed(start, atomic_read(&selftest_slist.changes)),
+	     threads);
+
+	ret = 0;
+	if (atomic_read(&selftest_slist.errors)) {
+		ERROR("SList: %d entries lost or duplicated",
+		      atomic_read(&selftest_slist.errors));
+		ret = -EINVAL;
+	}
+	i = 0;
+	for (slist = selftest_slist.head.next; slist && i <= n;
+	     slist = slist->next)
+		i++;
+	if (i != n || selftest_slist.head.depth != n) {
+		ERROR("SList: %d entries in list, depth %u; expected %d",
+		      i, selftest_slist.head.depth, n);
+		ret = -EINVAL;
+	}
+
+	changes = atomic_read(&selftest_slist.changes);
+#ifdef CONFIG_X86_64
+	lock_free = nt_slist_lock_free(&selftest_slist.head);
+	sequence = selftest_slist.head.align >> 16;
+	changes &= (1ULL << 48) - 1;
+#else
+	lock_free = 1;
+	sequence = selftest_slist.head.sequence;
+	changes &= 0xffff;
+#endif
+	/* spinlock fallback doesn't update sequence */
+	if (lock_free && sequence != changes) {
+		ERROR("SList: sequence %llu; expected %llu",
+		      sequence, changes);
+		ret = -EINVAL;
+	}
+	kfree(selftest_slist.entries);
+	return ret;
+}
+
+/* all workqueues of ndiswrapper are ordered, so only that kind is
+ * timed; build with and without WRAP_WQ to compare */
+
+#define SELFTEST_WQ_WORKS 64
+#define SELFTEST_WQ_LOOPS 2000
+
+static atomic_t selftest_wq_count;
+
+static void selftest_wq_worker(struct work_struct *work)
+{
+	atomic_inc(&selftest_wq_count);
+}
+
+static int selftest_wq(void)
+{
+	struct workqueue_struct *wq;
+	struct work_struct *works;
+	ktime_t start;
+	int i, j, ret;
+
+	works = kcalloc(SELFTEST_WQ_WORKS, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+	wq = wrap_create_ordered_wq("ndis_selftest", 0);
+	if (!wq) {
+		kfree(works);
+		return -ENOMEM;
+	}
+	for (i = 0; i < SELFTEST_WQ_WORKS; i++)
+		INIT_WORK(&works[i], selftest_wq_worker);
+	atomic_set(&selftest_wq_count, 0);
+
+	/* latency: thread is woken up for every work */
+	start = ktime_get();
+	for (i = 0; i < SELFTEST_WQ_LOOPS; i++) {
+		queue_work(wq, &works[0]);
+		flush_workqueue(wq);
+	}
+	INFO("workqueue: %lld ns per work, one at a time (%s)",
+	     selftest_elapsed(start, SELFTEST_WQ_LOOPS),
+#ifdef WRAP_WQ
+	     "WRAP_WQ"
+#else
+	     "kernel"
+#endif
+		);
+
+	/* throughput: thread runs batches of work */
+	start = ktime_get();
+	for (i = 0; i < SELFTEST_WQ_LOOPS; i++) {
+		for (j = 0; j < SELFTEST_WQ_WORKS; j++)
+			queue_work(wq, &works[j]);
+		flush_workqueue(wq);
+	}
+	INFO("workqueue: %lld ns per work, %d at a time",
+	     selftest_elapsed(start, SELFTEST_WQ_LOOPS * SELFTEST_WQ_WORKS),
+	     SELFTEST_WQ_WORKS);
+	ret = 0;
+	if (atomic_read(&selftest_wq_count) !=
+	    SELFTEST_WQ_LOOPS * (SELFTEST_WQ_WORKS + 1)) {
+		ERROR("workqueue: %d works executed; expected %d",
+		      atomic_read(&selftest_wq_count),
+		      SELFTEST_WQ_LOOPS * (SELFTEST_WQ_WORKS + 1));
+		ret = -EINVAL;
+	}
+	destroy_workqueue(wq);
+	kfree(works);
+	return ret;
+}
+
+/* USB drivers allocate an IRP for each transfer and keep a few of
+ * them outstanding; time that with IRP caches and with kmalloc,
+ * which IoAllocateIrp used before */
+
+#define SELFTEST_IRP_RING 32
+#define SELFTEST_IRP_LOOPS 100000
+#define SELFTEST_IRP_STACKS 2
+
+static void selftest_irp(void)
+{
+	void *ring[SELFTEST_IRP_RING];
+	ktime_t start;
+	int i;
+
+	memset(ring, 0, sizeof(ring));
+	start = ktime_get();
+	for (i = 0; i < SELFTEST_IRP_LOOPS; i++) {
+		if (ring[i % SELFTEST_IRP_RING])
+			free_irp(ring[i % SELFTEST_IRP_RING]);
+		ring[i % SELFTEST_IRP_RING] =
+			alloc_irp(SELFTEST_IRP_STACKS, 0);
+	}
+	for (i = 0; i < SELFTEST_IRP_RING; i++) {
+		if (ring[i])
+			free_irp(ring[i]);
+		ring[i] = NULL;
+	}
+	INFO("IRP alloc/free: %lld ns (cache)",
+	     selftest_elapsed(start, SELFTEST_IRP_LOOPS));
+
+	start = ktime_get();
+	for (i = 0; i < SELFTEST_IRP_LOOPS; i++) {
+		kfree(ring[i % SELFTEST_IRP_RING]);
+		ring[i % SELFTEST_IRP_RING] =
+			kmalloc(IoSizeOfIrp(SELFTEST_IRP_STACKS), GFP_KERNEL);
+	}
+	for (i = 0; i < SELFTEST_IRP_RING; i++)
+		kfree(ring[i]);
+	INFO("IRP alloc/free: %lld ns (kmalloc)",
+	     selftest_elapsed(start, SELFTEST_IRP_LOOPS));
+}
+
+/* Readers take NDIS read/write lock on every processor while a writer
+ * takes it every now and then; read lock throughput shows how readers
+ * scale, and writer's wait how long readers hold it off. The writer
+ * changes two counters that readers check are equal. */
+
+#define SELFTEST_RWLOCK_WRITES 1000
+
+static struct {
+	struct ndis_rw_lock *lock;
+	unsigned long a, b;
+	volatile int stop;
+	atomic_t reads;
+	atomic_t errors;
+	atomic_t running;
+	struct completion done;
+} selftest_rwlock;
+
+static int selftest_rwlock_thread(void *data)
+{
+	struct lock_state lock_state;
+	int reads = 0;
+
+	while (!selftest_rwlock.stop) {
+		NdisAcquireReadWriteLock(selftest_rwlock.lock, FALSE,
+					 &lock_state);
+		if (selftest_rwlock.a != selftest_rwlock.b)
+			atomic_inc(&selftest_rwlock.errors);
+		NdisReleaseReadWriteLock(selftest_rwlock.lock, &lock_state);
+		reads++;
+		if (need_resched())
+			schedule();
+	}
+	atomic_add(reads, &selftest_rwlock.reads);
+	if (atomic_dec_and_test(&selftest_rwlock.running))
+		complete(&selftest_rwlock.done);
+	return 0;
+}
+
+static int selftest_rwlock_run(void)
+{
+	struct task_struct *task;
+	struct lock_state lock_state;
+	ktime_t start, t;
+	s64 wait, max_wait, total_wait;
+	int i, readers, ret;
+
+	selftest_rwlock.lock = kzalloc(sizeof(*selftest_rwlock.lock),
+				       GFP_KERNEL);
+	if (!selftest_rwlock.lock)
+		return -ENOMEM;
+	NdisInitializeReadWriteLock(selftest_rwlock.lock);
+	selftest_rwlock.a = selftest_rwlock.b = 0;
+	selftest_rwlock.stop = 0;
+	readers = num_online_cpus();
+	atomic_set(&selftest_rwlock.reads, 0);
+	atomic_set(&selftest_rwlock.errors, 0);
+	atomic_set(&selftest_rwlock.running, readers);
+	init_completion(&selftest_rwlock.done);
+
+	start = ktime_get();
+	for (i = 0; i < readers; i++) {
+		task = kthread_run(selftest_rwlock_thread, NULL,
+				   "ndis_selftest/%d", i);
+		if (IS_ERR(task)) {
+			ERROR("couldn't start thread: %ld", PTR_ERR(task));
+			if (atomic_sub_and_test(readers - i,
+						&selftest_rwlock.running))
+				complete(&selftest_rwlock.done);
+			readers = i;
+			break;
+		}
+	}
+	max_wait = total_wait = 0;
+	for (i = 0; i < SELFTEST_RWLOCK_WRITES; i++) {
+		t = ktime_get();
+		NdisAcquireReadWriteLock(selftest_rwlock.lock, TRUE,
+					 &lock_state);
+		wait = ktime_to_ns(ktime_sub(ktime_get(), t));
+		selftest_rwlock.a++;
+		selftest_rwlock.b++;
+		NdisReleaseReadWriteLock(selftest_rwlock.lock, &lock_state);
+		total_wait += wait;
+		if (wait > max_wait)
+			max_wait = wait;
+		usleep_range(50, 100);
+	}
+	selftest_rwlock.stop = 1;
+	wait_for_completion(&selftest_rwlock.done);
+	if (readers && atomic_read(&selftest_rwlock.reads))
+		INFO("NDIS rw lock: %lld ns per read lock with %d readers",
+		     div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)) *
+			     readers, atomic_read(&selftest_rwlock.reads)),
+		     readers);
+	INFO("NDIS rw lock: writer waited %lld ns on average, %lld ns at "
+	     "most", div_s64(total_wait, SELFTEST_RWLOCK_WRITES), max_wait);
+
+	ret = 0;
+	if (atomic_read(&selftest_rwlock.errors)) {
+		ERROR("NDIS rw lock: readers saw %d inconsistent updates",
+		      atomic_read(&selftest_rwlock.errors));
+		ret = -EINVAL;
+	}
+	kfree(selftest_rwlock.lock);
+	return ret;
+}
+
+int wrap_selftest(void)
+{
+	int ret;
+
+	ENTER1("");
+	selftest_irql();
+	selftest_irp();
+	ret = selftest_slist_run();
+	if (!ret)
+		ret = selftest_rwlock_run();
+	if (!ret)
+		ret = selftest_wq();
+	if (!ret)
+		ret = usb_selftest();
+	EXIT1(return ret);
+}
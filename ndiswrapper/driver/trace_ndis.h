@@ -0,0 +1,303 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* tracepoints for calls into and out of Windows drivers; they are
+ * available to ftrace and perf under "ndiswrapper" (e.g., perf record
+ * -e 'ndiswrapper:*') and, unlike TRACE1..6, cost next to nothing when
+ * not enabled. Tracepoints are created in wrapper.c. */
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+
+#ifndef _TRACE_NDIS_H_
+#define _TRACE_NDIS_H_
+
+#define trace_ndis_send_begin(wnd, n) do { } while (0)
+#define trace_ndis_send_end(wnd, n) do { } while (0)
+#define trace_ndis_send_complete(wnd, packet, status) do { } while (0)
+#define trace_ndis_rx_indicate(wnd, n) do { } while (0)
+#define trace_ndis_isr_entry(wnd) do { } while (0)
+#define trace_ndis_isr_exit(wnd, recognized, queued) do { } while (0)
+#define trace_ndis_request_begin(wnd, type, oid) do { } while (0)
+#define trace_ndis_request_end(wnd, oid, status) do { } while (0)
+#define trace_nt_dpc_entry(kdpc, func) do { } while (0)
+#define trace_nt_dpc_exit(kdpc, func) do { } while (0)
+#define trace_nt_timer_fire(nt_timer, kdpc, repeat) do { } while (0)
+#define trace_nt_wait_sleep(count, wait_count, wait_hz) do { } while (0)
+#define trace_nt_wait_wake(res, wait_done) do { } while (0)
+#define trace_wrap_urb_submit(urb) do { } while (0)
+#define trace_wrap_urb_complete(urb) do { } while (0)
+
+#endif // _TRACE_NDIS_H_
+
+#else
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ndiswrapper
+
+#if !defined(_TRACE_NDIS_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NDIS_H_
+
+#include <linux/tracepoint.h>
+#include <linux/netdevice.h>
+#include <linux/usb.h>
+#include "ndis.h"
+
+/* events of a device are identified by its interface name */
+DECLARE_EVENT_CLASS(ndis_packets,
+	TP_PROTO(struct ndis_device *wnd, unsigned int n),
+	TP_ARGS(wnd, n),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+		__field(unsigned int, n)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+		__entry->n = n;
+	),
+	TP_printk("%s: packets=%u", __entry->name, __entry->n)
+);
+
+/* MiniportSend(Packets) is called with n packets */
+DEFINE_EVENT(ndis_packets, ndis_send_begin,
+	TP_PROTO(struct ndis_device *wnd, unsigned int n),
+	TP_ARGS(wnd, n)
+);
+
+/* MiniportSend(Packets) returned; n packets were accepted */
+DEFINE_EVENT(ndis_packets, ndis_send_end,
+	TP_PROTO(struct ndis_device *wnd, unsigned int n),
+	TP_ARGS(wnd, n)
+);
+
+/* miniport indicated n received packets */
+DEFINE_EVENT(ndis_packets, ndis_rx_indicate,
+	TP_PROTO(struct ndis_device *wnd, unsigned int n),
+	TP_ARGS(wnd, n)
+);
+
+TRACE_EVENT(ndis_send_complete,
+	TP_PROTO(struct ndis_device *wnd, void *packet, u32 status),
+	TP_ARGS(wnd, packet, status),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+		__field(void *, packet)
+		__field(u32, status)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+		__entry->packet = packet;
+		__entry->status = status;
+	),
+	TP_printk("%s: packet=%p status=%08x", __entry->name,
+		  __entry->packet, __entry->status)
+);
+
+TRACE_EVENT(ndis_isr_entry,
+	TP_PROTO(struct ndis_device *wnd),
+	TP_ARGS(wnd),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+	),
+	TP_printk("%s", __entry->name)
+);
+
+TRACE_EVENT(ndis_isr_exit,
+	TP_PROTO(struct ndis_device *wnd, int recognized, int queued),
+	TP_ARGS(wnd, recognized, queued),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+		__field(int, recognized)
+		__field(int, queued)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+		__entry->recognized = recognized;
+		__entry->queued = queued;
+	),
+	TP_printk("%s: recognized=%d dpc_queued=%d", __entry->name,
+		  __entry->recognized, __entry->queued)
+);
+
+/* request is given to MiniportQueryInformation (type 0) or
+ * MiniportSetInformation (type 1) */
+TRACE_EVENT(ndis_request_begin,
+	TP_PROTO(struct ndis_device *wnd, int type, u32 oid),
+	TP_ARGS(wnd, type, oid),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+		__field(int, type)
+		__field(u32, oid)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+		__entry->type = type;
+		__entry->oid = oid;
+	),
+	TP_printk("%s: %s oid=%08x", __entry->name,
+		  __entry->type ? "set" : "query", __entry->oid)
+);
+
+/* request is done, either when miniport returns or, if pending, when
+ * miniport completes it */
+TRACE_EVENT(ndis_request_end,
+	TP_PROTO(struct ndis_device *wnd, u32 oid, u32 status),
+	TP_ARGS(wnd, oid, status),
+	TP_STRUCT__entry(
+		__array(char, name, IFNAMSIZ)
+		__field(u32, oid)
+		__field(u32, status)
+	),
+	TP_fast_assign(
+		memcpy(__entry->name, wnd->net_dev->name, IFNAMSIZ);
+		__entry->oid = oid;
+		__entry->status = status;
+	),
+	TP_printk("%s: oid=%08x status=%08x", __entry->name, __entry->oid,
+		  __entry->status)
+);
+
+/* DPCs are not specific to a device; the function tells whose it
+ * is. kdpc may be freed by its function, so it is not dereferenced */
+DECLARE_EVENT_CLASS(nt_dpc,
+	TP_PROTO(void *kdpc, void *func),
+	TP_ARGS(kdpc, func),
+	TP_STRUCT__entry(
+		__field(void *, kdpc)
+		__field(void *, func)
+	),
+	TP_fast_assign(
+		__entry->kdpc = kdpc;
+		__entry->func = func;
+	),
+	TP_printk("kdpc=%p func=%p", __entry->kdpc, __entry->func)
+);
+
+DEFINE_EVENT(nt_dpc, nt_dpc_entry,
+	TP_PROTO(void *kdpc, void *func),
+	TP_ARGS(kdpc, func)
+);
+
+DEFINE_EVENT(nt_dpc, nt_dpc_exit,
+	TP_PROTO(void *kdpc, void *func),
+	TP_ARGS(kdpc, func)
+);
+
+TRACE_EVENT(nt_timer_fire,
+	TP_PROTO(void *nt_timer, void *kdpc, unsigned long repeat),
+	TP_ARGS(nt_timer, kdpc, repeat),
+	TP_STRUCT__entry(
+		__field(void *, nt_timer)
+		__field(void *, kdpc)
+		__field(unsigned long, repeat)
+	),
+	TP_fast_assign(
+		__entry->nt_timer = nt_timer;
+		__entry->kdpc = kdpc;
+		__entry->repeat = repeat;
+	),
+	TP_printk("timer=%p kdpc=%p repeat=%lu", __entry->nt_timer,
+		  __entry->kdpc, __entry->repeat)
+);
+
+/* KeWaitForMultipleObjects puts the thread to sleep for wait_count
+ * of count objects; wait_hz is 0 without timeout */
+TRACE_EVENT(nt_wait_sleep,
+	TP_PROTO(unsigned int count, unsigned int wait_count, long wait_hz),
+	TP_ARGS(count, wait_count, wait_hz),
+	TP_STRUCT__entry(
+		__field(unsigned int, count)
+		__field(unsigned int, wait_count)
+		__field(long, wait_hz)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->wait_count = wait_count;
+		__entry->wait_hz = wait_hz;
+	),
+	TP_printk("objects=%u waiting=%u timeout=%ld", __entry->count,
+		  __entry->wait_count, __entry->wait_hz)
+);
+
+/* res is as returned by wait_condition: < 0 if interrupted, 0 if
+ * timed out and remaining jiffies (or 1) if woken */
+TRACE_EVENT(nt_wait_wake,
+	TP_PROTO(long res, int wait_done),
+	TP_ARGS(res, wait_done),
+	TP_STRUCT__entry(
+		__field(long, res)
+		__field(int, wait_done)
+	),
+	TP_fast_assign(
+		__entry->res = res;
+		__entry->wait_done = wait_done;
+	),
+	TP_printk("res=%ld signaled=%d", __entry->res, __entry->wait_done)
+);
+
+TRACE_EVENT(wrap_urb_submit,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb),
+	TP_STRUCT__entry(
+		__field(void *, urb)
+		__field(unsigned int, pipe)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__entry->urb = urb;
+		__entry->pipe = urb->pipe;
+		__entry->length = urb->transfer_buffer_length;
+	),
+	TP_printk("urb=%p ep=%u%s type=%u length=%u", __entry->urb,
+		  usb_pipeendpoint(__entry->pipe),
+		  usb_pipein(__entry->pipe) ? "in" : "out",
+		  usb_pipetype(__entry->pipe), __entry->length)
+);
+
+TRACE_EVENT(wrap_urb_complete,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb),
+	TP_STRUCT__entry(
+		__field(void *, urb)
+		__field(unsigned int, pipe)
+		__field(int, status)
+		__field(u32, actual_length)
+	),
+	TP_fast_assign(
+		__entry->urb = urb;
+		__entry->pipe = urb->pipe;
+		__entry->status = urb->status;
+		__entry->actual_length = urb->actual_length;
+	),
+	TP_printk("urb=%p ep=%u%s status=%d actual_length=%u", __entry->urb,
+		  usb_pipeendpoint(__entry->pipe),
+		  usb_pipein(__entry->pipe) ? "in" : "out",
+		  __entry->status, __entry->actual_length)
+);
+
+#endif // _TRACE_NDIS_H_
+
+/* this file is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace_ndis
+#include <trace/define_trace.h>
+
+#endif
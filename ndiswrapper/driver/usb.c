@@ -16,6 +16,8 @@
 
 #include "ndis.h"
 #include "usb.h"
+#include "wrapper.h"
+#include "trace_ndis.h"
 #include "usb_exports.h"
 
 #ifdef USB_DEBUG
@@ -71,8 +73,45 @@ static unsigned int urb_id = 0;
 #endif
 
 /* wrap_urb->flags */
-/* transfer_buffer for urb is allocated; free it in wrap_free_urb */
+/* transfer_buffer for urb is a bounce buffer; release it in wrap_free_urb */
 #define WRAP_URB_COPY_BUFFER 0x01
+/* urb->sg is set to wrap_urb->sg; clear it in wrap_free_urb */
+#define WRAP_URB_SG 0x02
+
+/* host controllers without constraints on scatter-gather element
+ * sizes (xHCI) can transfer directly from/to vmalloc'ed buffers and
+ * chained MDLs */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+#define WRAP_USB_SG
+#endif
+
+/* when an interface is selected, this many URBs are preallocated for
+ * each of its bulk endpoints and for each of its other endpoints,
+ * until a device has WRAP_PREALLOC_URBS_MAX URBs; more URBs are
+ * allocated if a driver needs them. URBs are freed only when the
+ * device is deconfigured or removed. */
+#define WRAP_PREALLOC_BULK_URBS 8
+#define WRAP_PREALLOC_URBS 2
+#define WRAP_PREALLOC_URBS_MAX 64
+
+/* DMA-coherent buffers used for transfer buffers that can't be mapped
+ * for DMA are kept for reuse, on a list for each endpoint/direction;
+ * a device keeps at most WRAP_BOUNCE_BUFS_MAX unused buffers */
+#define WRAP_BOUNCE_EP(pipe)						\
+	(usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? 0x10 : 0))
+#define WRAP_BOUNCE_MIN_SIZE 512
+#define WRAP_BOUNCE_BUFS_MAX 32
+
+/* as in Windows, an isochronous transfer has at most 1024 packets */
+#define WRAP_ISO_PACKETS_MAX 1024
+
+struct wrap_bounce_buf {
+	struct nt_list list;
+	void *buf;
+	dma_addr_t dma;
+	unsigned int size;
+	u8 ep;
+};
 
 static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 {
@@ -92,11 +131,92 @@ static inline int wrap_cancel_urb(struct wrap_urb *wrap_urb)
 
 #define URB_STATUS(wrap_urb) (wrap_urb->urb->status)
 
-static struct nt_list wrap_urb_complete_list;
-static spinlock_t wrap_urb_complete_list_lock;
+static struct wrap_bounce_buf *wrap_get_bounce_buf(struct wrap_device *wd,
+						   unsigned int pipe,
+						   unsigned int len,
+						   gfp_t alloc_flags)
+{
+	struct wrap_bounce_buf *bounce;
+	unsigned long flags;
+	u8 ep;
+
+	ep = WRAP_BOUNCE_EP(pipe);
+	spin_lock_irqsave(&wd->usb.bounce_lock, flags);
+	nt_list_for_each_entry(bounce, &wd->usb.bounce_bufs[ep], list) {
+		if (bounce->size >= len) {
+			RemoveEntryList(&bounce->list);
+			wd->usb.num_bounce_bufs--;
+			spin_unlock_irqrestore(&wd->usb.bounce_lock, flags);
+			return bounce;
+		}
+	}
+	spin_unlock_irqrestore(&wd->usb.bounce_lock, flags);
+
+	bounce = kmalloc(sizeof(*bounce), alloc_flags);
+	if (!bounce)
+		return NULL;
+	bounce->size = roundup_pow_of_two(max_t(unsigned int, len,
+						WRAP_BOUNCE_MIN_SIZE));
+	bounce->ep = ep;
+	bounce->buf = usb_alloc_coherent(wd->usb.udev, bounce->size,
+					 alloc_flags, &bounce->dma);
+	if (!bounce->buf) {
+		kfree(bounce);
+		return NULL;
+	}
+	USBTRACE("%p, %d, %d", bounce->buf, bounce->size, ep);
+	return bounce;
+}
+
+static void wrap_free_bounce_buf(struct wrap_device *wd,
+				 struct wrap_bounce_buf *bounce)
+{
+	USBTRACE("%p, %d, %d", bounce->buf, bounce->size, bounce->ep);
+	usb_free_coherent(wd->usb.udev, bounce->size, bounce->buf,
+			  bounce->dma);
+	kfree(bounce);
+}
+
+static void wrap_put_bounce_buf(struct wrap_device *wd,
+				struct wrap_bounce_buf *bounce)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&wd->usb.bounce_lock, flags);
+	if (wd->usb.num_bounce_bufs < WRAP_BOUNCE_BUFS_MAX) {
+		/* most recently used buffer is reused first */
+		InsertHeadList(&wd->usb.bounce_bufs[bounce->ep],
+			       &bounce->list);
+		wd->usb.num_bounce_bufs++;
+		bounce = NULL;
+	}
+	spin_unlock_irqrestore(&wd->usb.bounce_lock, flags);
+	if (bounce)
+		wrap_free_bounce_buf(wd, bounce);
+}
+
+static void wrap_free_bounce_bufs(struct wrap_device *wd)
+{
+	struct wrap_bounce_buf *bounce;
+	struct nt_list *ent;
+	unsigned long flags;
+	int i;
 
-static struct work_struct wrap_urb_complete_work;
-static void wrap_urb_complete_worker(struct work_struct *dummy);
+	for (i = 0; i < ARRAY_SIZE(wd->usb.bounce_bufs); i++) {
+		while (1) {
+			spin_lock_irqsave(&wd->usb.bounce_lock, flags);
+			ent = RemoveHeadList(&wd->usb.bounce_bufs[i]);
+			if (ent)
+				wd->usb.num_bounce_bufs--;
+			spin_unlock_irqrestore(&wd->usb.bounce_lock, flags);
+			if (!ent)
+				break;
+			bounce = container_of(ent, struct wrap_bounce_buf,
+					      list);
+			wrap_free_bounce_buf(wd, bounce);
+		}
+	}
+}
 
 static void kill_all_urbs(struct wrap_device *wd, int complete)
 {
@@ -121,9 +241,61 @@ static void kill_all_urbs(struct wrap_device *wd, int complete)
 		}
 		USBTRACE("%p, %p", wrap_urb, wrap_urb->urb);
 		usb_free_urb(wrap_urb->urb);
+		kfree(wrap_urb->sg);
 		kfree(wrap_urb);
 	}
 	wd->usb.num_alloc_urbs = 0;
+	memset(&wd->usb.free_urbs, 0, sizeof(wd->usb.free_urbs));
+	wrap_free_bounce_bufs(wd);
+}
+
+static struct wrap_urb *wrap_new_urb(struct wrap_device *wd, gfp_t flags,
+				     unsigned int iso_packets)
+{
+	struct wrap_urb *wrap_urb;
+	KIRQL irql;
+
+	wrap_urb = kzalloc(sizeof(*wrap_urb), flags);
+	if (!wrap_urb) {
+		WARNING("couldn't allocate memory");
+		return NULL;
+	}
+	wrap_urb->urb = usb_alloc_urb(iso_packets, flags);
+	if (!wrap_urb->urb) {
+		WARNING("couldn't allocate urb");
+		kfree(wrap_urb);
+		return NULL;
+	}
+	wrap_urb->iso_packets = iso_packets;
+	wrap_urb->state = URB_ALLOCATED;
+	IoAcquireCancelSpinLock(&irql);
+	InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
+	wd->usb.num_alloc_urbs++;
+	IoReleaseCancelSpinLock(irql);
+	return wrap_urb;
+}
+
+static void wrap_put_free_urb(struct wrap_device *wd,
+			      struct wrap_urb *wrap_urb)
+{
+	wrap_urb->state = URB_FREE;
+	wrap_urb->flags = 0;
+	wrap_urb->irp = NULL;
+	PushEntrySList(&wd->usb.free_urbs, &wrap_urb->free_list,
+		       &wd->usb.free_urbs_lock);
+}
+
+static void wrap_prealloc_urbs(struct wrap_device *wd, int n)
+{
+	struct wrap_urb *wrap_urb;
+
+	USBTRACE("%d, %d", wd->usb.num_alloc_urbs, n);
+	while (n-- > 0 && wd->usb.num_alloc_urbs < WRAP_PREALLOC_URBS_MAX) {
+		wrap_urb = wrap_new_urb(wd, irql_gfp(), 0);
+		if (!wrap_urb)
+			break;
+		wrap_put_free_urb(wd, wrap_urb);
+	}
 }
 
 /* for a given Linux urb status code, return corresponding NT urb status */
@@ -187,27 +359,26 @@ static void wrap_free_urb(struct urb *urb)
 	struct wrap_device *wd = IRP_WRAP_DEVICE(irp);
 
 	USBTRACE("freeing urb: %p", urb);
+	/* wrap_cancel_irp may be running for this irp; it holds
+	 * cancel spinlock until it is done with wrap_urb */
+	IoAcquireCancelSpinLock(&irp->cancel_irql);
 	irp->cancel_routine = NULL;
 	IRP_WRAP_URB(irp) = NULL;
+	IoReleaseCancelSpinLock(irp->cancel_irql);
 	if (wrap_urb->flags & WRAP_URB_COPY_BUFFER) {
-		USBTRACE("freeing DMA buffer for URB: %p %p",
+		USBTRACE("releasing DMA buffer for URB: %p %p",
 			 urb, urb->transfer_buffer);
-		usb_free_coherent(wd->usb.udev, urb->transfer_buffer_length,
-				  urb->transfer_buffer, urb->transfer_dma);
+		wrap_put_bounce_buf(wd, wrap_urb->bounce);
+		wrap_urb->bounce = NULL;
 	}
-	kfree(urb->setup_packet);
-	if (wd->usb.num_alloc_urbs > MAX_ALLOCATED_URBS) {
-		IoAcquireCancelSpinLock(&irp->cancel_irql);
-		RemoveEntryList(&wrap_urb->list);
-		wd->usb.num_alloc_urbs--;
-		IoReleaseCancelSpinLock(irp->cancel_irql);
-		usb_free_urb(urb);
-		kfree(wrap_urb);
-	} else {
-		wrap_urb->state = URB_FREE;
-		wrap_urb->flags = 0;
-		wrap_urb->irp = NULL;
+#ifdef WRAP_USB_SG
+	if (wrap_urb->flags & WRAP_URB_SG) {
+		urb->sg = NULL;
+		urb->num_sgs = 0;
 	}
+#endif
+	kfree(urb->setup_packet);
+	wrap_put_free_urb(wd, wrap_urb);
 	return;
 }
 
@@ -230,6 +401,14 @@ wstdcall void wrap_cancel_irp(struct device_object *dev_obj, struct irp *irp)
 
 	/* NB: this function is called holding Cancel spinlock */
 	USBENTER("irp: %p", irp);
+	/* urb may have been freed, and even taken for another irp,
+	 * before IoCancelIrp got cancel spinlock */
+	if (!wrap_urb || wrap_urb->irp != irp) {
+		USBTRACE("irp %p already completed", irp);
+		irp->cancel = FALSE;
+		IoReleaseCancelSpinLock(irp->cancel_irql);
+		return;
+	}
 	urb = wrap_urb->urb;
 	USBTRACE("canceling urb %p", urb);
 	if (wrap_cancel_urb(IRP_WRAP_URB(irp))) {
@@ -243,12 +422,14 @@ wstdcall void wrap_cancel_irp(struct device_object *dev_obj, struct irp *irp)
 WIN_FUNC_DECL(wrap_cancel_irp,2)
 
 static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
-				  void *buf, unsigned int buf_len)
+				  void *buf, unsigned int buf_len,
+				  unsigned int iso_packets)
 {
 	struct urb *urb;
 	gfp_t alloc_flags;
 	struct wrap_urb *wrap_urb;
 	struct wrap_device *wd;
+	struct nt_slist *ent;
 
 	USBENTER("irp: %p", irp);
 	wd = IRP_WRAP_DEVICE(irp);
@@ -258,36 +439,32 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 		return NULL;
 
 	alloc_flags = irql_gfp();
-	IoAcquireCancelSpinLock(&irp->cancel_irql);
-	urb = NULL;
-	nt_list_for_each_entry(wrap_urb, &wd->usb.wrap_urb_list, list) {
-		if (cmpxchg(&wrap_urb->state, URB_FREE,
-			    URB_ALLOCATED) == URB_FREE) {
-			urb = wrap_urb->urb;
-			/* Clean URB but keep the refcount */
-			memset((char *)urb + sizeof(urb->kref), 0,
-			       sizeof(*urb) - sizeof(urb->kref));
-			break;
-		}
-	}
-	if (!urb) {
-		IoReleaseCancelSpinLock(irp->cancel_irql);
-		wrap_urb = kzalloc(sizeof(*wrap_urb), alloc_flags);
-		if (!wrap_urb) {
-			WARNING("couldn't allocate memory");
-			return NULL;
+	ent = PopEntrySList(&wd->usb.free_urbs, &wd->usb.free_urbs_lock);
+	if (ent) {
+		wrap_urb = container_of(ent, struct wrap_urb, free_list);
+		wrap_urb->state = URB_ALLOCATED;
+		if (wrap_urb->iso_packets < iso_packets) {
+			/* isochronous URB needs room for frame
+			 * descriptors */
+			urb = usb_alloc_urb(iso_packets, alloc_flags);
+			if (!urb) {
+				WARNING("couldn't allocate urb");
+				wrap_put_free_urb(wd, wrap_urb);
+				return NULL;
+			}
+			usb_free_urb(wrap_urb->urb);
+			wrap_urb->urb = urb;
+			wrap_urb->iso_packets = iso_packets;
 		}
-		urb = usb_alloc_urb(0, alloc_flags);
-		if (!urb) {
-			WARNING("couldn't allocate urb");
-			kfree(wrap_urb);
+		urb = wrap_urb->urb;
+		/* Clean URB but keep the refcount */
+		memset((char *)urb + sizeof(urb->kref), 0,
+		       sizeof(*urb) - sizeof(urb->kref));
+	} else {
+		wrap_urb = wrap_new_urb(wd, alloc_flags, iso_packets);
+		if (!wrap_urb)
 			return NULL;
-		}
-		IoAcquireCancelSpinLock(&irp->cancel_irql);
-		wrap_urb->urb = urb;
-		wrap_urb->state = URB_ALLOCATED;
-		InsertTailList(&wd->usb.wrap_urb_list, &wrap_urb->list);
-		wd->usb.num_alloc_urbs++;
+		urb = wrap_urb->urb;
 	}
 
 #ifdef URB_ASYNC_UNLINK
@@ -296,6 +473,9 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 	urb->transfer_flags |= USB_ASYNC_UNLINK;
 #endif
 	urb->context = wrap_urb;
+	/* wrap_urb popped from free list may still be looked at by
+	 * wrap_cancel_irp for the irp it was used for before */
+	IoAcquireCancelSpinLock(&irp->cancel_irql);
 	wrap_urb->irp = irp;
 	IRP_WRAP_URB(irp) = wrap_urb;
 	/* called as Windows function */
@@ -309,22 +489,23 @@ static struct urb *wrap_alloc_urb(struct irp *irp, unsigned int pipe,
 			       || PageHighMem(virt_to_page(buf))
 #endif
 		    )) {
-		urb->transfer_buffer =
-			usb_alloc_coherent(wd->usb.udev, buf_len, alloc_flags,
-					 &urb->transfer_dma);
-		if (!urb->transfer_buffer) {
+		wrap_urb->bounce = wrap_get_bounce_buf(wd, pipe, buf_len,
+						       alloc_flags);
+		if (!wrap_urb->bounce) {
 			WARNING("couldn't allocate dma buf");
 			IoAcquireCancelSpinLock(&irp->cancel_irql);
 			irp->cancel_routine = NULL;
-			wrap_urb->state = URB_FREE;
-			wrap_urb->irp = NULL;
 			IRP_WRAP_URB(irp) = NULL;
 			IoReleaseCancelSpinLock(irp->cancel_irql);
+			wrap_put_free_urb(wd, wrap_urb);
 			return NULL;
 		}
+		urb->transfer_buffer = wrap_urb->bounce->buf;
+		urb->transfer_dma = wrap_urb->bounce->dma;
 		if (urb->transfer_dma)
 			urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 		wrap_urb->flags |= WRAP_URB_COPY_BUFFER;
+		wrap_urb->buf = buf;
 		if (usb_pipeout(pipe))
 			memcpy(urb->transfer_buffer, buf, buf_len);
 		USBTRACE("DMA buf for urb %p: %p", urb, urb->transfer_buffer);
@@ -356,6 +537,7 @@ static USBD_STATUS wrap_submit_urb(struct irp *irp)
 	IoMarkIrpPending(irp);
 	DUMP_URB_BUFFER(urb, USB_DIR_OUT);
 	USBTRACE("%p", urb);
+	trace_wrap_urb_submit(urb);
 	wrap_urb->state = URB_SUBMITTED;
 	ret = usb_submit_urb(urb, irql_gfp());
 	if (ret) {
@@ -369,13 +551,138 @@ static USBD_STATUS wrap_submit_urb(struct irp *irp)
 		USBEXIT(return USBD_STATUS_PENDING);
 }
 
+/* copy per-packet results of isochronous URB to its nt_urb */
+static void wrap_isoch_complete(struct wrap_device *wd,
+				struct wrap_urb *wrap_urb)
+{
+	struct usbd_isochronous_transfer *iso;
+	struct urb *urb;
+	unsigned int i, length;
+
+	urb = wrap_urb->urb;
+	iso = &IRP_URB(wrap_urb->irp)->isochronous;
+	length = 0;
+	for (i = 0; i < urb->number_of_packets; i++) {
+		struct usb_iso_packet_descriptor *frame;
+
+		frame = &urb->iso_frame_desc[i];
+		iso->iso_packet[i].status = wrap_urb_status(frame->status);
+		if (usb_pipein(urb->pipe))
+			iso->iso_packet[i].length = frame->actual_length;
+		length += frame->actual_length;
+		/* -EXDEV: packet was not transferred in its frame */
+		if (frame->status == -EXDEV)
+			wd->usb.iso_missed++;
+	}
+	iso->error_count = urb->error_count;
+	iso->start_frame = urb->start_frame;
+	iso->transfer_buffer_length = length;
+	/* packets are at their offsets in the buffer, with gaps if
+	 * they are short, so copy whole buffer */
+	if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) && usb_pipein(urb->pipe))
+		memcpy(wrap_urb->buf, urb->transfer_buffer,
+		       urb->transfer_buffer_length);
+	wd->usb.iso_completed++;
+	wd->usb.iso_packets += urb->number_of_packets;
+	wd->usb.iso_errors += urb->error_count;
+	wd->usb.iso_last_frame = urb->start_frame;
+	USBTRACE("%p: frame %d, %d packets, %d errors", urb, urb->start_frame,
+		 urb->number_of_packets, urb->error_count);
+}
+
+/* copy results of completed URB to its IRP and complete the IRP;
+ * called only from the device's worker, so stats need no locking */
+static void wrap_urb_complete_irp(struct wrap_device *wd,
+				  struct wrap_urb *wrap_urb)
+{
+	struct irp *irp;
+	struct urb *urb;
+	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
+	struct usbd_vendor_or_class_request *vc_req;
+	union nt_urb *nt_urb;
+	u64 latency;
+
+	urb = wrap_urb->urb;
+#ifdef USB_DEBUG
+	if (wrap_urb->state != URB_COMPLETED &&
+	    wrap_urb->state != URB_INT_UNLINKED)
+		WARNING("urb %p in wrong state: %d",
+			urb, wrap_urb->state);
+#endif
+	latency = ktime_to_ns(ktime_get()) - wrap_urb->complete_time;
+	wd->usb.completed++;
+	wd->usb.total_complete_latency += latency;
+	if (latency > wd->usb.max_complete_latency)
+		wd->usb.max_complete_latency = latency;
+	irp = wrap_urb->irp;
+	DUMP_IRP(irp);
+	nt_urb = IRP_URB(irp);
+	USBTRACE("urb: %p, nt_urb: %p, status: %d",
+		 urb, nt_urb, urb->status);
+	switch (urb->status) {
+	case 0:
+		/* successfully transferred */
+		irp->io_status.info = urb->actual_length;
+		if (nt_urb->header.function ==
+		    URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
+			bulk_int_tx = &nt_urb->bulk_int_transfer;
+			bulk_int_tx->transfer_buffer_length =
+				urb->actual_length;
+			DUMP_URB_BUFFER(urb, USB_DIR_IN);
+			if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
+			    usb_pipein(urb->pipe))
+				memcpy(wrap_urb->buf, urb->transfer_buffer,
+				       urb->actual_length);
+		} else if (nt_urb->header.function ==
+			   URB_FUNCTION_ISOCH_TRANSFER) {
+			wrap_isoch_complete(wd, wrap_urb);
+		} else { // vendor or class request
+			vc_req = &nt_urb->vendor_class_request;
+			vc_req->transfer_buffer_length =
+				urb->actual_length;
+			DUMP_URB_BUFFER(urb, USB_DIR_IN);
+			if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
+			    usb_pipein(urb->pipe))
+				memcpy(vc_req->transfer_buffer,
+				       urb->transfer_buffer,
+				       urb->actual_length);
+		}
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_SUCCESS;
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+		/* urb canceled */
+		irp->io_status.info = 0;
+		TRACE2("urb %p canceled", urb);
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
+		irp->io_status.status = STATUS_CANCELLED;
+		break;
+	default:
+		TRACE2("irp: %p, urb: %p, status: %d/%d",
+			 irp, urb, urb->status, wrap_urb->state);
+		irp->io_status.info = 0;
+		if (nt_urb->header.function == URB_FUNCTION_ISOCH_TRANSFER)
+			nt_urb->isochronous.error_count =
+				nt_urb->isochronous.number_of_packets;
+		NT_URB_STATUS(nt_urb) = wrap_urb_status(urb->status);
+		irp->io_status.status =
+			nt_urb_irp_status(NT_URB_STATUS(nt_urb));
+		break;
+	}
+	wrap_free_urb(urb);
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
 static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 {
 	struct irp *irp;
 	struct wrap_urb *wrap_urb;
+	struct wrap_device *wd;
 
 	wrap_urb = urb->context;
 	USBTRACE("%p (%p) completed", wrap_urb, urb);
+	trace_wrap_urb_complete(urb);
 	irp = wrap_urb->irp;
 	DUMP_WRAP_URB(wrap_urb, USB_DIR_IN);
 	irp->cancel_routine = NULL;
@@ -387,96 +694,139 @@ static void wrap_urb_complete(struct urb *urb ISR_PT_REGS_PARAM_DECL)
 	}
 #endif
 	wrap_urb->state = URB_COMPLETED;
-	spin_lock(&wrap_urb_complete_list_lock);
-	InsertTailList(&wrap_urb_complete_list, &wrap_urb->complete_list);
-	spin_unlock(&wrap_urb_complete_list_lock);
-	queue_work(ntos_wq, &wrap_urb_complete_work);
+	wrap_urb->complete_time = ktime_to_ns(ktime_get());
+	wd = IRP_WRAP_DEVICE(irp);
+	spin_lock(&wd->usb.complete_list_lock);
+	InsertTailList(&wd->usb.complete_list, &wrap_urb->complete_list);
+	spin_unlock(&wd->usb.complete_list_lock);
+	queue_work(wd->usb.complete_wq, &wd->usb.complete_work);
 }
 
-/* one worker for all devices */
-static void wrap_urb_complete_worker(struct work_struct *dummy)
+/* each device has its own worker */
+static void wrap_urb_complete_worker(struct work_struct *work)
 {
-	struct irp *irp;
-	struct urb *urb;
-	struct usbd_bulk_or_intr_transfer *bulk_int_tx;
-	struct usbd_vendor_or_class_request *vc_req;
-	union nt_urb *nt_urb;
+	struct wrap_device *wd;
 	struct wrap_urb *wrap_urb;
 	struct nt_list *ent;
 	unsigned long flags;
 
 	USBENTER("");
+	wd = container_of(work, struct wrap_device, usb.complete_work);
 	while (1) {
-		spin_lock_irqsave(&wrap_urb_complete_list_lock, flags);
-		ent = RemoveHeadList(&wrap_urb_complete_list);
-		spin_unlock_irqrestore(&wrap_urb_complete_list_lock, flags);
+		spin_lock_irqsave(&wd->usb.complete_list_lock, flags);
+		ent = RemoveHeadList(&wd->usb.complete_list);
+		spin_unlock_irqrestore(&wd->usb.complete_list_lock, flags);
 		if (!ent)
 			break;
 		wrap_urb = container_of(ent, struct wrap_urb, complete_list);
-		urb = wrap_urb->urb;
-#ifdef USB_DEBUG
-		if (wrap_urb->state != URB_COMPLETED &&
-		    wrap_urb->state != URB_INT_UNLINKED)
-			WARNING("urb %p in wrong state: %d",
-				urb, wrap_urb->state);
-#endif
-		irp = wrap_urb->irp;
-		DUMP_IRP(irp);
-		nt_urb = IRP_URB(irp);
-		USBTRACE("urb: %p, nt_urb: %p, status: %d",
-			 urb, nt_urb, urb->status);
-		switch (urb->status) {
-		case 0:
-			/* successfully transferred */
-			irp->io_status.info = urb->actual_length;
-			if (nt_urb->header.function ==
-			    URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
-				bulk_int_tx = &nt_urb->bulk_int_transfer;
-				bulk_int_tx->transfer_buffer_length =
-					urb->actual_length;
-				DUMP_URB_BUFFER(urb, USB_DIR_IN);
-				if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
-				    usb_pipein(urb->pipe))
-					memcpy(bulk_int_tx->transfer_buffer,
-					       urb->transfer_buffer,
-					       urb->actual_length);
-			} else { // vendor or class request
-				vc_req = &nt_urb->vendor_class_request;
-				vc_req->transfer_buffer_length =
-					urb->actual_length;
-				DUMP_URB_BUFFER(urb, USB_DIR_IN);
-				if ((wrap_urb->flags & WRAP_URB_COPY_BUFFER) &&
-				    usb_pipein(urb->pipe))
-					memcpy(vc_req->transfer_buffer,
-					       urb->transfer_buffer,
-					       urb->actual_length);
-			}
-			NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
-			irp->io_status.status = STATUS_SUCCESS;
-			break;
-		case -ENOENT:
-		case -ECONNRESET:
-			/* urb canceled */
-			irp->io_status.info = 0;
-			TRACE2("urb %p canceled", urb);
-			NT_URB_STATUS(nt_urb) = USBD_STATUS_SUCCESS;
-			irp->io_status.status = STATUS_CANCELLED;
-			break;
-		default:
-			TRACE2("irp: %p, urb: %p, status: %d/%d",
-				 irp, urb, urb->status, wrap_urb->state);
-			irp->io_status.info = 0;
-			NT_URB_STATUS(nt_urb) = wrap_urb_status(urb->status);
-			irp->io_status.status =
-				nt_urb_irp_status(NT_URB_STATUS(nt_urb));
-			break;
-		}
-		wrap_free_urb(urb);
-		IoCompleteRequest(irp, IO_NO_INCREMENT);
+		wrap_urb_complete_irp(wd, wrap_urb);
 	}
 	USBEXIT(return);
 }
 
+#ifdef WRAP_USB_SG
+/* add pages of buf to sg, starting at index n; returns new index */
+static int wrap_sg_add_buf(struct scatterlist *sg, int n, void *buf,
+			   unsigned int len)
+{
+	struct page *page;
+	unsigned int off, chunk;
+
+	while (len > 0) {
+		if (is_vmalloc_addr(buf))
+			page = vmalloc_to_page(buf);
+		else if (virt_addr_valid(buf))
+			page = virt_to_page(buf);
+		else
+			return -EINVAL;
+		off = offset_in_page(buf);
+		chunk = min_t(unsigned int, len, PAGE_SIZE - off);
+		sg_set_page(&sg[n++], page, chunk, off);
+		buf += chunk;
+		len -= chunk;
+	}
+	return n;
+}
+
+/* number of sg entries needed for buf, or MDL chain if buf is NULL */
+static int wrap_sg_count(void *buf, struct mdl *mdl, unsigned int len)
+{
+	struct mdl *cur;
+	int n;
+
+	if (buf)
+		return SPAN_PAGES(buf, len);
+	n = 0;
+	for (cur = mdl; cur; cur = cur->next)
+		n += SPAN_PAGES(MmGetSystemAddressForMdl(cur),
+				MmGetMdlByteCount(cur));
+	return n;
+}
+
+/* fill sg, initialized for wrap_sg_count entries, with len bytes of
+ * buf, or MDL chain if buf is NULL; returns number of entries used */
+static int wrap_sg_fill(struct scatterlist *sg, void *buf, struct mdl *mdl,
+			unsigned int len)
+{
+	struct mdl *cur;
+	unsigned int count;
+	int n;
+
+	if (buf)
+		n = wrap_sg_add_buf(sg, 0, buf, len);
+	else {
+		n = 0;
+		for (cur = mdl; cur && len > 0 && n >= 0; cur = cur->next) {
+			buf = MmGetSystemAddressForMdl(cur);
+			count = min_t(unsigned int, len,
+				      MmGetMdlByteCount(cur));
+			if (buf)
+				n = wrap_sg_add_buf(sg, n, buf, count);
+			else
+				n = -EINVAL;
+			len -= count;
+		}
+	}
+	if (n <= 0)
+		return -EINVAL;
+	sg_mark_end(&sg[n - 1]);
+	return n;
+}
+
+/* transfer len bytes from/to buf, or MDL chain if buf is NULL,
+ * using urb->sg; sg table of wrap_urb is reused, and grown only if a
+ * transfer needs more entries than any before */
+static int wrap_urb_map_sg(struct urb *urb, void *buf, struct mdl *mdl,
+			   unsigned int len)
+{
+	struct wrap_urb *wrap_urb = urb->context;
+	struct scatterlist *sg;
+	int n;
+
+	n = wrap_sg_count(buf, mdl, len);
+	if (n > urb->dev->bus->sg_tablesize)
+		return -E2BIG;
+	if (n > wrap_urb->sg_nents) {
+		sg = kmalloc(n * sizeof(*sg), irql_gfp());
+		if (!sg)
+			return -ENOMEM;
+		kfree(wrap_urb->sg);
+		wrap_urb->sg = sg;
+		wrap_urb->sg_nents = n;
+	}
+	sg = wrap_urb->sg;
+	sg_init_table(sg, n);
+	n = wrap_sg_fill(sg, buf, mdl, len);
+	if (n < 0)
+		return n;
+	urb->sg = sg;
+	urb->num_sgs = n;
+	wrap_urb->flags |= WRAP_URB_SG;
+	USBTRACE("%p: %d sg entries", urb, n);
+	return 0;
+}
+#endif
+
 static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 {
 	struct usb_endpoint_descriptor *pipe_handle;
@@ -487,6 +837,9 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 	struct wrap_device *wd = IRP_WRAP_DEVICE(irp);
 	struct usb_device *udev = wd->usb.udev;
 	union nt_urb *nt_urb = IRP_URB(irp);
+	struct mdl *mdl;
+	void *buf;
+	int use_sg;
 
 	bulk_int_tx = &nt_urb->bulk_int_transfer;
 	pipe_handle = bulk_int_tx->pipe_handle;
@@ -511,9 +864,32 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 					      pipe_handle->bEndpointAddress);
 	}
 
+	/* if transfer_buffer is not given, MDL describes the buffer */
+	buf = bulk_int_tx->transfer_buffer;
+	mdl = bulk_int_tx->mdl;
+	if (!buf && mdl && !mdl->next)
+		buf = MmGetSystemAddressForMdl(mdl);
+	use_sg = 0;
+#ifdef WRAP_USB_SG
+	if (usb_pipebulk(pipe) && udev->bus->no_sg_constraint &&
+	    bulk_int_tx->transfer_buffer_length) {
+		if (!buf && mdl)
+			use_sg = 1;
+		else if (usb_sg && buf && is_vmalloc_addr(buf))
+			use_sg = 1;
+	}
+#endif
+	if (!buf && mdl && !use_sg) {
+		WARNING("chained MDLs are not supported by host controller");
+		return USBD_STATUS_NOT_SUPPORTED;
+	}
+
 	DUMP_IRP(irp);
-	urb = wrap_alloc_urb(irp, pipe, bulk_int_tx->transfer_buffer,
-			     bulk_int_tx->transfer_buffer_length);
+	if (use_sg)
+		urb = wrap_alloc_urb(irp, pipe, NULL, 0, 0);
+	else
+		urb = wrap_alloc_urb(irp, pipe, buf,
+				     bulk_int_tx->transfer_buffer_length, 0);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
 		return USBD_STATUS_NO_MEMORY;
@@ -538,6 +914,103 @@ static USBD_STATUS wrap_bulk_or_intr_trans(struct irp *irp)
 			 "intvl: %d", urb, urb->pipe,
 			 pipe_handle->bEndpointAddress, pipe_handle->bInterval);
 	}
+#ifdef WRAP_USB_SG
+	if (use_sg && wrap_urb_map_sg(urb, buf, mdl,
+				      bulk_int_tx->transfer_buffer_length)) {
+		WARNING("couldn't map buffer for urb %p", urb);
+		wrap_free_urb(urb);
+		return USBD_STATUS_NO_MEMORY;
+	}
+#endif
+	status = wrap_submit_urb(irp);
+	USBTRACE("status: %08X", status);
+	USBEXIT(return status);
+}
+
+/* set up frame descriptors of urb for packets of iso; packet lengths
+ * are given by offsets */
+static int wrap_urb_iso_frames(struct urb *urb,
+			       struct usbd_isochronous_transfer *iso)
+{
+	unsigned int i, n, offset, end;
+
+	n = iso->number_of_packets;
+	for (i = 0; i < n; i++) {
+		offset = iso->iso_packet[i].offset;
+		if (i + 1 < n)
+			end = iso->iso_packet[i + 1].offset;
+		else
+			end = iso->transfer_buffer_length;
+		if (end < offset || end > iso->transfer_buffer_length) {
+			WARNING("invalid packet %u: %u, %u", i, offset, end);
+			return -EINVAL;
+		}
+		urb->iso_frame_desc[i].offset = offset;
+		urb->iso_frame_desc[i].length = end - offset;
+	}
+	urb->number_of_packets = n;
+	return 0;
+}
+
+static USBD_STATUS wrap_isoch_trans(struct irp *irp)
+{
+	struct usb_endpoint_descriptor *pipe_handle;
+	struct usbd_isochronous_transfer *iso;
+	struct urb *urb;
+	unsigned int pipe, n;
+	struct wrap_device *wd = IRP_WRAP_DEVICE(irp);
+	struct usb_device *udev = wd->usb.udev;
+	union nt_urb *nt_urb = IRP_URB(irp);
+	USBD_STATUS status;
+	void *buf;
+
+	iso = &nt_urb->isochronous;
+	pipe_handle = iso->pipe_handle;
+	n = iso->number_of_packets;
+	USBTRACE("flags: 0x%x, length: %u, buffer: %p, handle: %p, "
+		 "packets: %u, frame: %u", iso->transfer_flags,
+		 iso->transfer_buffer_length, iso->transfer_buffer,
+		 pipe_handle, n, iso->start_frame);
+	if (!USBD_IS_ISOCH_PIPE(pipe_handle) || n == 0 ||
+	    n > WRAP_ISO_PACKETS_MAX)
+		return USBD_STATUS_INVALID_PARAMETER;
+	if (iso->transfer_flags & USBD_TRANSFER_DIRECTION_IN)
+		pipe = usb_rcvisocpipe(udev, pipe_handle->bEndpointAddress);
+	else
+		pipe = usb_sndisocpipe(udev, pipe_handle->bEndpointAddress);
+	buf = iso->transfer_buffer;
+	if (!buf && iso->mdl) {
+		if (iso->mdl->next) {
+			WARNING("chained MDLs are not supported");
+			return USBD_STATUS_NOT_SUPPORTED;
+		}
+		buf = MmGetSystemAddressForMdl(iso->mdl);
+	}
+
+	DUMP_IRP(irp);
+	urb = wrap_alloc_urb(irp, pipe, buf, iso->transfer_buffer_length, n);
+	if (!urb) {
+		ERROR("couldn't allocate urb");
+		return USBD_STATUS_NO_MEMORY;
+	}
+	urb->dev = udev;
+	urb->pipe = pipe;
+	urb->complete = wrap_urb_complete;
+	urb->transfer_flags |= URB_ISO_ASAP;
+	/* Linux schedules isochronous URBs after the ones queued
+	 * already; requested start_frame can't be honored */
+	if (!(iso->transfer_flags & USBD_START_ISO_TRANSFER_ASAP))
+		USBTRACE("start frame %u ignored", iso->start_frame);
+	/* bInterval of isochronous endpoints is exponent for
+	 * (micro)frames for both full and high speed */
+	urb->interval = 1 << (clamp_t(int, pipe_handle->bInterval, 1, 16) - 1);
+	if (wrap_urb_iso_frames(urb, iso)) {
+		wrap_free_urb(urb);
+		return USBD_STATUS_INVALID_PARAMETER;
+	}
+	USBTRACE("submitting isochronous urb %p on pipe 0x%x (ep 0x%x), "
+		 "intvl: %d", urb, urb->pipe, pipe_handle->bEndpointAddress,
+		 urb->interval);
 	status = wrap_submit_urb(irp);
 	USBTRACE("status: %08X", status);
 	USBEXIT(return status);
@@ -606,7 +1079,7 @@ static USBD_STATUS wrap_vendor_or_class_req(struct irp *irp)
 		USBTRACE("pipe: %x, dir out", pipe);
 	}
 	urb = wrap_alloc_urb(irp, pipe, vc_req->transfer_buffer,
-			     vc_req->transfer_buffer_length);
+			     vc_req->transfer_buffer_length, 0);
 	if (!urb) {
 		ERROR("couldn't allocate urb");
 		return USBD_STATUS_NO_MEMORY;
@@ -796,10 +1269,11 @@ static void set_intf_pipe_info(struct wrap_device *wd,
 			       struct usb_interface *usb_intf,
 			       struct usbd_interface_information *intf)
 {
-	int i;
+	int i, n;
 	struct usb_endpoint_descriptor *ep;
 	struct usbd_pipe_information *pipe;
 
+	n = 0;
 	for (i = 0; i < CUR_ALT_SETTING(usb_intf)->desc.bNumEndpoints; i++) {
 		ep = &(CUR_ALT_SETTING(usb_intf)->endpoint[i]).desc;
 		if (i >= intf->bNumEndpoints) {
@@ -857,11 +1331,16 @@ static void set_intf_pipe_info(struct wrap_device *wd,
 			}
 		}
 		pipe->handle = ep;
+		if (pipe->type == UsbdPipeTypeBulk)
+			n += WRAP_PREALLOC_BULK_URBS;
+		else
+			n += WRAP_PREALLOC_URBS;
 		USBTRACE("%d: ep 0x%x, type %d, pkt_sz %d, intv %d (%d),"
 			 "type: %d, handle %p", i, ep->bEndpointAddress,
 			 ep->bmAttributes, pipe->wMaxPacketSize, ep->bInterval,
 			 pipe->bInterval, pipe->type, pipe->handle);
 	}
+	wrap_prealloc_urbs(wd, n);
 }
 
 static USBD_STATUS wrap_select_configuration(struct wrap_device *wd,
@@ -1032,6 +1511,11 @@ static USBD_STATUS wrap_process_nt_urb(struct irp *irp)
 		status = wrap_bulk_or_intr_trans(irp);
 		break;
 
+	case URB_FUNCTION_ISOCH_TRANSFER:
+		USBTRACE("submitting isochronous irp: %p", irp);
+		status = wrap_isoch_trans(irp);
+		break;
+
 	case URB_FUNCTION_VENDOR_DEVICE:
 	case URB_FUNCTION_VENDOR_INTERFACE:
 	case URB_FUNCTION_VENDOR_ENDPOINT:
@@ -1409,12 +1893,46 @@ wstdcall NTSTATUS USBD_InterfaceQueryBusTime(void *context, ULONG *frame)
 	USBEXIT(return STATUS_SUCCESS);
 }
 
+/* the URB comes without an IRP; one is allocated to carry it through
+ * wrap_isoch_trans and is freed by IoCompleteRequest when the URB
+ * completes. The driver learns of completion from URB's status. */
 wstdcall NTSTATUS USBD_InterfaceSubmitIsoOutUrb(void *context,
 					       union nt_urb *nt_urb)
 {
-	/* TODO: implement this */
-	TODO();
-	USBEXIT(return STATUS_NOT_IMPLEMENTED);
+	struct wrap_device *wd = context;
+	struct io_stack_location *irp_sl;
+	struct irp *irp;
+	USBD_STATUS status;
+
+	USBENTER("%p, %p", wd, nt_urb);
+	if (nt_urb->header.function != URB_FUNCTION_ISOCH_TRANSFER ||
+	    (nt_urb->isochronous.transfer_flags &
+	     USBD_TRANSFER_DIRECTION_IN)) {
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_INVALID_PARAMETER;
+		USBEXIT(return STATUS_INVALID_PARAMETER);
+	}
+	if (wd->usb.intf == NULL || test_bit(HW_DISABLED, &wd->hw_status)) {
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_DEVICE_GONE;
+		USBEXIT(return STATUS_DEVICE_REMOVED);
+	}
+	irp = allocate_init_irp(1, 0);
+	if (!irp) {
+		NT_URB_STATUS(nt_urb) = USBD_STATUS_NO_MEMORY;
+		USBEXIT(return STATUS_INSUFFICIENT_RESOURCES);
+	}
+	IoSetNextIrpStackLocation(irp);
+	irp_sl = IoGetCurrentIrpStackLocation(irp);
+	irp_sl->major_fn = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+	irp_sl->params.dev_ioctl.code = IOCTL_INTERNAL_USB_SUBMIT_URB;
+	irp_sl->params.others.arg1 = nt_urb;
+	IRP_WRAP_DEVICE(irp) = wd;
+	status = wrap_isoch_trans(irp);
+	USBTRACE("irp: %p, status: %08X", irp, status);
+	if (status == USBD_STATUS_PENDING)
+		USBEXIT(return STATUS_PENDING);
+	NT_URB_STATUS(nt_urb) = status;
+	free_irp(irp);
+	USBEXIT(return nt_urb_irp_status(status));
 }
 
 wstdcall NTSTATUS
@@ -1471,11 +1989,173 @@ usb_query_interface(struct wrap_device *wd, struct io_stack_location *irp_sl)
 	return STATUS_SUCCESS;
 }
 
+/* checks for mapping of transfers to URBs, run with "selftest=1"
+ * (see selftest.c); they don't need a device */
+
+#define SELFTEST_ISO_PACKETS 4
+
+static int usb_selftest_iso(void)
+{
+	static const ULONG offsets[SELFTEST_ISO_PACKETS] = {0, 100, 100, 300};
+	static const unsigned int lengths[SELFTEST_ISO_PACKETS] =
+		{100, 0, 200, 212};
+	struct usbd_isochronous_transfer *iso;
+	struct urb *urb;
+	int i, ret = -EINVAL;
+
+	iso = kzalloc(sizeof(*iso) + (SELFTEST_ISO_PACKETS - 1) *
+		      sizeof(iso->iso_packet[0]), GFP_KERNEL);
+	urb = usb_alloc_urb(SELFTEST_ISO_PACKETS, GFP_KERNEL);
+	if (!iso || !urb) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	iso->number_of_packets = SELFTEST_ISO_PACKETS;
+	iso->transfer_buffer_length = 512;
+	for (i = 0; i < SELFTEST_ISO_PACKETS; i++)
+		iso->iso_packet[i].offset = offsets[i];
+	if (wrap_urb_iso_frames(urb, iso) ||
+	    urb->number_of_packets != SELFTEST_ISO_PACKETS) {
+		ERROR("isochronous frames not set up");
+		goto out;
+	}
+	for (i = 0; i < SELFTEST_ISO_PACKETS; i++) {
+		if (urb->iso_frame_desc[i].offset != offsets[i] ||
+		    urb->iso_frame_desc[i].length != lengths[i]) {
+			ERROR("isochronous frame %d: %u, %u", i,
+			      urb->iso_frame_desc[i].offset,
+			      urb->iso_frame_desc[i].length);
+			goto out;
+		}
+	}
+	/* offsets going back and packets past buffer are rejected */
+	iso->iso_packet[2].offset = 50;
+	if (!wrap_urb_iso_frames(urb, iso)) {
+		ERROR("isochronous offsets out of order accepted");
+		goto out;
+	}
+	iso->iso_packet[2].offset = 200;
+	iso->iso_packet[3].offset = 600;
+	if (!wrap_urb_iso_frames(urb, iso)) {
+		ERROR("isochronous packet past buffer accepted");
+		goto out;
+	}
+	ret = 0;
+out:
+	usb_free_urb(urb);
+	kfree(iso);
+	return ret;
+}
+
+#ifdef WRAP_USB_SG
+#define SELFTEST_SG_MAX 8
+
+/* checks that sg entries cover len bytes at buf in order */
+static int usb_selftest_sg_check(struct scatterlist *sg, int n, void *buf,
+				 unsigned int len)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (is_vmalloc_addr(buf))
+			page = vmalloc_to_page(buf);
+		else
+			page = virt_to_page(buf);
+		if (sg_page(&sg[i]) != page ||
+		    sg[i].offset != offset_in_page(buf) ||
+		    sg[i].length > len) {
+			ERROR("sg entry %d: %u, %u", i, sg[i].offset,
+			      sg[i].length);
+			return -EINVAL;
+		}
+		buf += sg[i].length;
+		len -= sg[i].length;
+	}
+	return len ? -EINVAL : 0;
+}
+
+static int usb_selftest_sg(void)
+{
+	struct scatterlist sg[SELFTEST_SG_MAX];
+	struct mdl *mdl[2] = {NULL, NULL};
+	void *vbuf, *kbuf[2] = {NULL, NULL};
+	unsigned int len;
+	int n, ret = -EINVAL;
+
+	/* vmalloc'ed buffer, not page aligned */
+	vbuf = vmalloc(3 * PAGE_SIZE);
+	if (!vbuf)
+		return -ENOMEM;
+	len = 2 * PAGE_SIZE;
+	n = wrap_sg_count(vbuf + 100, NULL, len);
+	if (n != 3) {
+		ERROR("sg count %d for vmalloc buffer", n);
+		goto out;
+	}
+	sg_init_table(sg, n);
+	n = wrap_sg_fill(sg, vbuf + 100, NULL, len);
+	if (n != 3 || usb_selftest_sg_check(sg, n, vbuf + 100, len) ||
+	    !sg_is_last(&sg[n - 1]))
+		goto out;
+
+	/* chained MDLs; transfer ends in second MDL */
+	kbuf[0] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	kbuf[1] = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if (!kbuf[0] || !kbuf[1]) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	mdl[0] = allocate_init_mdl(kbuf[0] + 10, 1000);
+	mdl[1] = allocate_init_mdl(kbuf[1], PAGE_SIZE + 10);
+	if (!mdl[0] || !mdl[1]) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	mdl[0]->next = mdl[1];
+	len = SPAN_PAGES(kbuf[0] + 10, 1000);
+	n = wrap_sg_count(NULL, mdl[0], 0);
+	if (n != len + SPAN_PAGES(kbuf[1], PAGE_SIZE + 10)) {
+		ERROR("sg count %d for MDL chain", n);
+		goto out;
+	}
+	sg_init_table(sg, n);
+	n = wrap_sg_fill(sg, NULL, mdl[0], 1000 + 5);
+	if (n != len + 1 ||
+	    usb_selftest_sg_check(sg, len, kbuf[0] + 10, 1000) ||
+	    usb_selftest_sg_check(&sg[len], 1, kbuf[1], 5) ||
+	    !sg_is_last(&sg[len])) {
+		ERROR("sg entries %d for MDL chain", n);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (mdl[0])
+		mdl[0]->next = NULL;
+	free_mdl(mdl[0]);
+	free_mdl(mdl[1]);
+	kfree(kbuf[0]);
+	kfree(kbuf[1]);
+	vfree(vbuf);
+	return ret;
+}
+#endif
+
+int usb_selftest(void)
+{
+	int ret;
+
+	ret = usb_selftest_iso();
+#ifdef WRAP_USB_SG
+	if (!ret)
+		ret = usb_selftest_sg();
+#endif
+	INFO("URB mapping: %s", ret ? "failed" : "ok");
+	return ret;
+}
+
 int usb_init(void)
 {
-	InitializeListHead(&wrap_urb_complete_list);
-	spin_lock_init(&wrap_urb_complete_list_lock);
-	INIT_WORK(&wrap_urb_complete_work, wrap_urb_complete_worker);
 #ifdef USB_DEBUG
 	urb_id = 0;
 #endif
@@ -1489,13 +2169,36 @@ void usb_exit(void)
 
 int usb_init_device(struct wrap_device *wd)
 {
+	int i;
+
 	InitializeListHead(&wd->usb.wrap_urb_list);
 	wd->usb.num_alloc_urbs = 0;
+	memset(&wd->usb.free_urbs, 0, sizeof(wd->usb.free_urbs));
+	nt_spin_lock_init(&wd->usb.free_urbs_lock);
+	InitializeListHead(&wd->usb.complete_list);
+	spin_lock_init(&wd->usb.complete_list_lock);
+	for (i = 0; i < ARRAY_SIZE(wd->usb.bounce_bufs); i++)
+		InitializeListHead(&wd->usb.bounce_bufs[i]);
+	wd->usb.num_bounce_bufs = 0;
+	spin_lock_init(&wd->usb.bounce_lock);
+	INIT_WORK(&wd->usb.complete_work, wrap_urb_complete_worker);
+	wd->usb.completed = 0;
+	wd->usb.total_complete_latency = 0;
+	wd->usb.max_complete_latency = 0;
+	wd->usb.complete_wq = wrap_create_ordered_wq("wrap_usb", WQ_HIGHPRI);
+	if (!wd->usb.complete_wq) {
+		ERROR("couldn't create workqueue");
+		return -ENOMEM;
+	}
 	USBEXIT(return 0);
 }
 
 void usb_exit_device(struct wrap_device *wd)
 {
+	/* complete URBs already given back before killing the rest */
+	flush_workqueue(wd->usb.complete_wq);
 	kill_all_urbs(wd, 0);
+	destroy_workqueue(wd->usb.complete_wq);
+	wd->usb.complete_wq = NULL;
 	USBEXIT(return);
 }
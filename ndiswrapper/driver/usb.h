@@ -103,6 +103,10 @@ enum pipe_type {UsbdPipeTypeControl = USB_ENDPOINT_XFER_CONTROL,
 	(((pipe_handle)->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)	\
 	 == USB_ENDPOINT_XFER_INT)
 
+#define USBD_IS_ISOCH_PIPE(pipe_handle)					\
+	(((pipe_handle)->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK)	\
+	 == USB_ENDPOINT_XFER_ISOC)
+
 #define USBD_PORT_ENABLED			0x00000001
 #define USBD_PORT_CONNECTED			0x00000002
 
@@ -96,6 +96,10 @@
 
 #define IRP_DEFFER_IO_COMPLETION	0x00000800
 
+/* in irp->alloc_flags: IRP was allocated with alloc_irp and
+ * initialized by ndiswrapper, so struct wrap_irp precedes it */
+#define IRP_WRAP_ALLOCATED		0x80
+
 #define THREAD_WAIT_OBJECTS		3
 #define MAX_WAIT_OBJECTS		64
 
@@ -1003,11 +1007,22 @@ enum urb_state {
 
 struct wrap_urb {
 	struct nt_list list;
+	struct nt_slist free_list;
 	enum urb_state state;
 	struct nt_list complete_list;
 	unsigned int flags;
 	struct urb *urb;
 	struct irp *irp;
+	/* when URB was given back, in ns */
+	u64 complete_time;
+	/* if WRAP_URB_COPY_BUFFER is set */
+	struct wrap_bounce_buf *bounce;
+	void *buf;
+	/* number of iso_frame_desc in urb */
+	unsigned int iso_packets;
+	/* sg table for urb, kept for reuse; room for sg_nents entries */
+	struct scatterlist *sg;
+	unsigned int sg_nents;
 #ifdef USB_DEBUG
 	unsigned int id;
 #endif
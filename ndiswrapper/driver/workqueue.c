@@ -15,265 +15,288 @@
 
 #include "ntoskernel.h"
 
-struct workqueue_thread {
+/* Each workqueue has one thread that runs its work in the order
+ * queued, one at a time. All workqueues of ndiswrapper are created
+ * ordered (see wrap_create_ordered_wq) and their work expects to be
+ * serialized, so per-CPU threads, stealing between them or CPU hints
+ * would have nothing to run in parallel; create_workqueue also gets
+ * one thread. A work must be queued on only one workqueue. */
+
+struct wrap_workqueue_struct {
 	spinlock_t lock;
 	struct task_struct *task;
-	struct completion *completion;
-	char name[16];
-	int pid;
-	/* whether any work_structs pending? <0 implies quit */
-	s8 pending;
 	/* list of work_structs pending */
 	struct list_head work_list;
+	/* work_struct being executed, if any */
+	struct work_struct *current_work;
+	wait_queue_head_t flush_wait;
+	unsigned long executed;
 };
 
-struct workq_thread_data {
-	struct workqueue_struct *workq;
-	int index;
-};
-
-struct wrap_workqueue_struct {
-	u8 singlethread;
-	u8 qon;
-	int num_cpus;
-	struct workqueue_thread threads[0];
-};
-
-static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu);
-
 static int workq_thread(void *data)
 {
-	struct workq_thread_data *thread_data = data;
-	struct workqueue_thread *thread;
-	struct workqueue_struct *workq;
+	struct workqueue_struct *workq = data;
 	struct work_struct *work;
+	unsigned long flags;
 
-	workq = thread_data->workq;
-	thread = &workq->threads[thread_data->index];
-	WORKTRACE("%p, %d, %p", workq, thread_data->index, thread);
-	strncpy(thread->name, current->comm, sizeof(thread->name));
-
-	daemonize(thread->name);
 	set_user_nice(current, -5);
-
-	if (thread->task != current) {
-		WARNING("invalid task: %p, %p", thread->task, current);
-		thread->task = current;
-	}
-	thread->pid = current->pid;
-	complete(xchg(&thread->completion, NULL));
-	WORKTRACE("%s (%d) started", thread->name, thread->pid);
+	WORKTRACE("%s (%d) started", current->comm, current->pid);
 	while (1) {
-		if (wait_condition(thread->pending, 0, TASK_INTERRUPTIBLE) < 0) {
-			/* TODO: deal with signal */
-			WARNING("signal not blocked?");
-			flush_signals(current);
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irqsave(&workq->lock, flags);
+		if (list_empty(&workq->work_list)) {
+			spin_unlock_irqrestore(&workq->lock, flags);
+			if (kthread_should_stop())
+				break;
+			schedule();
 			continue;
 		}
-		while (1) {
-			struct list_head *entry;
-			unsigned long flags;
-
-			spin_lock_irqsave(&thread->lock, flags);
-			if (list_empty(&thread->work_list)) {
-				struct completion *completion;
-				if (thread->pending < 0) {
-					spin_unlock_irqrestore(&thread->lock,
-							       flags);
-					goto out;
-				}
-				thread->pending = 0;
-				completion = thread->completion;
-				thread->completion = NULL;
-				spin_unlock_irqrestore(&thread->lock, flags);
-				if (completion)
-					complete(completion);
-				break;
-			}
-			entry = thread->work_list.next;
-			work = list_entry(entry, struct work_struct, list);
-			if (xchg(&work->thread, NULL))
-				list_del(entry);
-			else
-				work = NULL;
-			spin_unlock_irqrestore(&thread->lock, flags);
-			DBG_BLOCK(4) {
-				WORKTRACE("%p, %p", work, thread);
-			}
-			if (work)
-				work->func(work->data);
+		work = list_first_entry(&workq->work_list, struct work_struct,
+					list);
+		list_del_init(&work->list);
+		work->pending = 0;
+		workq->current_work = work;
+		spin_unlock_irqrestore(&workq->lock, flags);
+		__set_current_state(TASK_RUNNING);
+		DBG_BLOCK(4) {
+			WORKTRACE("%p, %p", work, workq);
 		}
+		work->func(work->data);
+		spin_lock_irqsave(&workq->lock, flags);
+		workq->current_work = NULL;
+		workq->executed++;
+		spin_unlock_irqrestore(&workq->lock, flags);
+		wake_up(&workq->flush_wait);
 	}
-
-out:
-	WORKTRACE("%s exiting", thread->name);
-	thread->pid = 0;
+	__set_current_state(TASK_RUNNING);
+	WORKTRACE("%s exiting", current->comm);
 	return 0;
 }
 
-static int wrap_queue_work_on(struct workqueue_struct *workq,
-			      struct work_struct *work, int cpu)
+/* called with workq->lock held */
+static int queue_work_locked(struct workqueue_struct *workq,
+			     struct work_struct *work)
+{
+	if (work->pending)
+		return 0;
+	work->pending = 1;
+	work->workq = workq;
+	list_add_tail(&work->list, &workq->work_list);
+	wake_up_process(workq->task);
+	return 1;
+}
+
+int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work)
 {
-	struct workqueue_thread *thread = &workq->threads[cpu];
 	unsigned long flags;
 	int ret;
 
-	assert(thread->pid > 0);
 	DBG_BLOCK(4) {
-		WORKTRACE("%p, %d", workq, cpu);
+		WORKTRACE("%p, %p", workq, work);
 	}
-	spin_lock_irqsave(&thread->lock, flags);
-	if (work->thread)
+	spin_lock_irqsave(&workq->lock, flags);
+	ret = queue_work_locked(workq, work);
+	spin_unlock_irqrestore(&workq->lock, flags);
+	return ret;
+}
+
+int wrap_cancel_work(struct work_struct *work)
+{
+	struct workqueue_struct *workq = work->workq;
+	unsigned long flags;
+	int ret;
+
+	WORKTRACE("%p, %p", work, workq);
+	/* never queued */
+	if (!workq)
+		return 0;
+	spin_lock_irqsave(&workq->lock, flags);
+	ret = work->pending;
+	if (ret) {
+		list_del_init(&work->list);
+		work->pending = 0;
+	}
+	spin_unlock_irqrestore(&workq->lock, flags);
+	if (ret)
+		wake_up(&workq->flush_wait);
+	return ret;
+}
+
+static int wrap_work_running(struct workqueue_struct *workq,
+			     struct work_struct *work)
+{
+	unsigned long flags;
+	int running;
+
+	spin_lock_irqsave(&workq->lock, flags);
+	running = workq->current_work == work;
+	spin_unlock_irqrestore(&workq->lock, flags);
+	return running;
+}
+
+/* cancel work if pending and wait for it to finish if running; must
+ * not be called from the work itself */
+int wrap_cancel_work_sync(struct work_struct *work)
+{
+	struct workqueue_struct *workq = work->workq;
+	int ret;
+
+	ret = wrap_cancel_work(work);
+	if (workq)
+		wait_event(workq->flush_wait, !wrap_work_running(workq, work));
+	return ret;
+}
+
+static int wrap_work_done(struct workqueue_struct *workq,
+			  struct work_struct *work)
+{
+	unsigned long flags;
+	int done;
+
+	spin_lock_irqsave(&workq->lock, flags);
+	done = !work->pending && workq->current_work != work;
+	spin_unlock_irqrestore(&workq->lock, flags);
+	return done;
+}
+
+/* wait for work to finish if it is queued or running */
+void wrap_flush_work(struct work_struct *work)
+{
+	struct workqueue_struct *workq = work->workq;
+
+	WORKTRACE("%p, %p", work, workq);
+	if (workq)
+		wait_event(workq->flush_wait, wrap_work_done(workq, work));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+static void delayed_work_timer_proc(struct timer_list *tl)
+#else
+static void delayed_work_timer_proc(unsigned long data)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	struct delayed_work *dwork = from_timer(dwork, tl, timer);
+#else
+	struct delayed_work *dwork = (struct delayed_work *)data;
+#endif
+
+	wrap_queue_work(dwork->workq, &dwork->work);
+}
+
+void wrap_init_delayed_work(struct delayed_work *dwork,
+			    void (*func)(struct work_struct *work))
+{
+	INIT_WORK(&dwork->work, func);
+	dwork->workq = NULL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	timer_setup(&dwork->timer, delayed_work_timer_proc, 0);
+#else
+	init_timer(&dwork->timer);
+	dwork->timer.function = delayed_work_timer_proc;
+	dwork->timer.data = (unsigned long)dwork;
+#endif
+}
+
+/* work is queued after delay jiffies, unless it is already queued
+ * or waiting for its timer */
+int wrap_queue_delayed_work(struct workqueue_struct *workq,
+			    struct delayed_work *dwork, unsigned long delay)
+{
+	unsigned long flags;
+	int ret;
+
+	WORKTRACE("%p, %p, %lu", workq, dwork, delay);
+	spin_lock_irqsave(&workq->lock, flags);
+	if (timer_pending(&dwork->timer))
+		ret = 0;
+	else if (delay == 0)
+		ret = queue_work_locked(workq, &dwork->work);
+	else if (dwork->work.pending)
 		ret = 0;
 	else {
-		work->thread = thread;
-		list_add_tail(&work->list, &thread->work_list);
-		thread->pending = 1;
-		wake_up_process(thread->task);
+		dwork->workq = workq;
+		mod_timer(&dwork->timer, jiffies + delay);
 		ret = 1;
 	}
-	spin_unlock_irqrestore(&thread->lock, flags);
+	spin_unlock_irqrestore(&workq->lock, flags);
 	return ret;
 }
 
-int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work)
+int wrap_cancel_delayed_work(struct delayed_work *dwork)
 {
-	if (num_online_cpus() == 1 || workq->singlethread)
-		return wrap_queue_work_on(workq, work, 0);
-	else {
-		typeof(workq->qon) qon;
-		/* work is queued on threads in a round-robin fashion */
-		do {
-			qon = workq->qon % workq->num_cpus;
-			atomic_inc_var(workq->qon);
-		} while (!workq->threads[qon].pid);
-		return wrap_queue_work_on(workq, work, qon);
-	}
+	int ret;
+
+	ret = del_timer(&dwork->timer);
+	if (wrap_cancel_work(&dwork->work))
+		ret = 1;
+	return ret;
 }
 
-void wrap_cancel_work(struct work_struct *work)
+int wrap_cancel_delayed_work_sync(struct delayed_work *dwork)
 {
-	struct workqueue_thread *thread;
-	unsigned long flags;
+	int ret = 0;
 
-	WORKTRACE("%p", work);
-	if ((thread = xchg(&work->thread, NULL))) {
-		WORKTRACE("%p", thread);
-		spin_lock_irqsave(&thread->lock, flags);
-		list_del(&work->list);
-		spin_unlock_irqrestore(&thread->lock, flags);
-	}
+	/* work may queue itself again while it runs */
+	do {
+		if (del_timer_sync(&dwork->timer))
+			ret = 1;
+		if (wrap_cancel_work_sync(&dwork->work))
+			ret = 1;
+	} while (timer_pending(&dwork->timer) || dwork->work.pending);
+	return ret;
 }
 
-struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
-					u8 freeze)
+struct workqueue_struct *wrap_create_wq(const char *name, u8 freeze)
 {
-	struct completion started;
 	struct workqueue_struct *workq;
-	int i, n;
-
-	if (singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	workq = kzalloc(sizeof(*workq) + n * sizeof(workq->threads[0]),
-			GFP_KERNEL);
+
+	workq = kzalloc(sizeof(*workq), GFP_KERNEL);
 	if (!workq) {
 		WARNING("couldn't allocate memory");
 		return NULL;
 	}
 	WORKTRACE("%p", workq);
-	workq->singlethread = singlethread;
-	init_completion(&started);
-	for_each_online_cpu(i) {
-		struct workq_thread_data thread_data;
-		spin_lock_init(&workq->threads[i].lock);
-		INIT_LIST_HEAD(&workq->threads[i].work_list);
-		reinit_completion(&started);
-		workq->threads[i].completion = &started;
-		thread_data.workq = workq;
-		thread_data.index = i;
-		WORKTRACE("%p, %d, %p", workq, i, &workq->threads[i]);
-		workq->threads[i].task =
-			kthread_create(workq_thread, &thread_data,
-				       "%s/%d", name, i);
-		if (IS_ERR(workq->threads[i].task)) {
-			int j;
-			for (j = 0; j < i; j++)
-				wrap_destroy_wq_on(workq, j);
-			kfree(workq);
-			WARNING("couldn't start thread %s", name);
-			return NULL;
-		}
+	spin_lock_init(&workq->lock);
+	INIT_LIST_HEAD(&workq->work_list);
+	init_waitqueue_head(&workq->flush_wait);
+	workq->task = kthread_create(workq_thread, workq, "%s", name);
+	if (IS_ERR(workq->task)) {
+		kfree(workq);
+		WARNING("couldn't start thread %s", name);
+		return NULL;
+	}
 #ifdef PF_NOFREEZE
-		if (!freeze)
-			workq->threads[i].task->flags |= PF_NOFREEZE;
+	if (!freeze)
+		workq->task->flags |= PF_NOFREEZE;
 #endif
-		kthread_bind(workq->threads[i].task, i);
-		workq->num_cpus = max(workq->num_cpus, i);
-		wake_up_process(workq->threads[i].task);
-		wait_for_completion(&started);
-		WORKTRACE("%s, %d: %p, %d", name, i,
-			  workq, workq->threads[i].pid);
-		if (singlethread)
-			break;
-	}
-	workq->num_cpus++;
+	wake_up_process(workq->task);
+	WORKTRACE("%s: %p, %d", name, workq, workq->task->pid);
 	return workq;
 }
 
-static void wrap_flush_wq_on(struct workqueue_struct *workq, int cpu)
+static int wrap_wq_idle(struct workqueue_struct *workq)
 {
-	struct workqueue_thread *thread = &workq->threads[cpu];
-	struct completion done;
-
-	WORKTRACE("%p: %d, %s", workq, cpu, thread->name);
-	init_completion(&done);
-	thread->completion = &done;
-	thread->pending = 1;
-	wake_up_process(thread->task);
-	wait_for_completion(&done);
-	return;
+	unsigned long flags;
+	int idle;
+
+	spin_lock_irqsave(&workq->lock, flags);
+	idle = list_empty(&workq->work_list) && !workq->current_work;
+	spin_unlock_irqrestore(&workq->lock, flags);
+	return idle;
 }
 
 void wrap_flush_wq(struct workqueue_struct *workq)
 {
-	int i, n;
-
 	WORKTRACE("%p", workq);
-	if (workq->singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	for (i = 0; i < n; i++)
-		wrap_flush_wq_on(workq, i);
-}
-
-static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu)
-{
-	struct workqueue_thread *thread = &workq->threads[cpu];
-
-	WORKTRACE("%p: %d, %s", workq, cpu, thread->name);
-	if (!thread->pid)
-		return;
-	thread->pending = -1;
-	wake_up_process(thread->task);
-	while (thread->pid) {
-		WORKTRACE("%d", thread->pid);
-		schedule();
-	}
+	wait_event(workq->flush_wait, wrap_wq_idle(workq));
 }
 
 void wrap_destroy_wq(struct workqueue_struct *workq)
 {
-	int i, n;
-
 	WORKTRACE("%p", workq);
-	if (workq->singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	for (i = 0; i < n; i++)
-		wrap_destroy_wq_on(workq, i);
+	wrap_flush_wq(workq);
+	kthread_stop(workq->task);
+	WORKTRACE("%p: %lu", workq, workq->executed);
 	kfree(workq);
 }
@@ -19,10 +19,12 @@
 #include <linux/proc_fs.h>
 #include "ndis.h"
 #include "iw_ndis.h"
+#include "cfg_ndis.h"
 #include "pnp.h"
 #include "loader.h"
 #include "wrapndis.h"
 #include "wrapper.h"
+#include "trace_ndis.h"
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(5,18,0)
 	#define PCI_DMA_TODEVICE DMA_TO_DEVICE
@@ -34,8 +36,6 @@ wstdcall NTSTATUS NdisDispatchDeviceControl(struct device_object *fdo,
 wstdcall NTSTATUS NdisDispatchPnp(struct device_object *fdo, struct irp *irp);
 wstdcall NTSTATUS NdisDispatchPower(struct device_object *fdo, struct irp *irp);
 
-struct workqueue_struct *wrapndis_wq;
-
 static int set_packet_filter(struct ndis_device *wnd,
 			     ULONG packet_filter);
 static void add_iw_stats_timer(struct ndis_device *wnd);
@@ -46,6 +46,22 @@ static void set_multicast_list(struct ndis_device *wnd);
 static int ndis_net_dev_open(struct net_device *net_dev);
 static int ndis_net_dev_close(struct net_device *net_dev);
 
+/* ndis_req_mutex serializes synchronous requests; an asynchronous
+ * request may still be pending in miniport, so wait for it, too */
+static void ndis_req_lock(struct ndis_device *wnd)
+{
+	mutex_lock(&wnd->ndis_req_mutex);
+	wait_event(wnd->oid_req_wait, !wnd->oid_req_active);
+}
+
+static void ndis_req_unlock(struct ndis_device *wnd)
+{
+	mutex_unlock(&wnd->ndis_req_mutex);
+	/* asynchronous requests queued meanwhile */
+	if (!IsListEmpty(&wnd->oid_req_list))
+		queue_work(wnd->wq, &wnd->oid_req_work);
+}
+
 /* MiniportReset */
 NDIS_STATUS mp_reset(struct ndis_device *wnd)
 {
@@ -56,7 +72,7 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 
 	ENTER2("wnd: %p", wnd);
 	mutex_lock(&wnd->tx_ring_mutex);
-	mutex_lock(&wnd->ndis_req_mutex);
+	ndis_req_lock(wnd);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	prepare_wait_condition(wnd->ndis_req_task, wnd->ndis_req_done, 0);
 	WARNING("%s is being reset", wnd->net_dev->name);
@@ -77,7 +93,8 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 		}
 		TRACE2("%08X, %08X", res, reset_address);
 	}
-	mutex_unlock(&wnd->ndis_req_mutex);
+	oid_cache_invalidate(wnd);
+	ndis_req_unlock(wnd);
 	if (res == NDIS_STATUS_SUCCESS && reset_address) {
 		set_packet_filter(wnd, wnd->packet_filter);
 		set_multicast_list(wnd);
@@ -86,6 +103,150 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 	EXIT3(return res);
 }
 
+/* default cache lifetime, in msec, of OIDs queried for statistics
+ * and by iwconfig; others are not cached unless set with
+ * oid_cache_ttl setting */
+static const struct {
+	ndis_oid oid;
+	unsigned int ttl;
+} oid_cache_ttls[] = {
+	{OID_802_11_RSSI, 500},
+	{OID_802_11_STATISTICS, 1000},
+	{OID_GEN_LINK_SPEED, 1000},
+	{OID_GEN_MEDIA_CONNECT_STATUS, 1000},
+	{OID_802_11_BSSID, 1000},
+	{OID_802_11_SSID, 1000},
+	{OID_802_11_CONFIGURATION, 1000},
+	{OID_802_11_TX_POWER_LEVEL, 1000},
+	{OID_802_11_INFRASTRUCTURE_MODE, 1000},
+	{OID_802_11_POWER_MODE, 1000},
+	{OID_802_11_RTS_THRESHOLD, 1000},
+	{OID_802_11_FRAGMENTATION_THRESHOLD, 1000},
+};
+
+static void oid_cache_init(struct ndis_device *wnd)
+{
+	int i;
+
+	spin_lock_init(&wnd->oid_cache_lock);
+	memset(wnd->oid_cache, 0, sizeof(wnd->oid_cache));
+	for (i = 0; i < ARRAY_SIZE(oid_cache_ttls); i++) {
+		wnd->oid_cache[i].oid = oid_cache_ttls[i].oid;
+		wnd->oid_cache[i].ttl =
+			msecs_to_jiffies(oid_cache_ttls[i].ttl);
+	}
+	wnd->oid_cache_gen = 0;
+}
+
+void oid_cache_invalidate(struct ndis_device *wnd)
+{
+	int i;
+
+	spin_lock_bh(&wnd->oid_cache_lock);
+	wnd->oid_cache_gen++;
+	for (i = 0; i < OID_CACHE_SIZE; i++)
+		wnd->oid_cache[i].valid = FALSE;
+	spin_unlock_bh(&wnd->oid_cache_lock);
+}
+
+/* ttl of 0 disables caching of oid and frees its entry; free entries
+ * have oid 0 */
+int oid_cache_set_ttl(struct ndis_device *wnd, ndis_oid oid,
+		      unsigned int msec)
+{
+	struct oid_cache_entry *entry, *free;
+	int i;
+
+	if (!oid)
+		return -EINVAL;
+	free = NULL;
+	spin_lock_bh(&wnd->oid_cache_lock);
+	for (i = 0; i < OID_CACHE_SIZE; i++) {
+		entry = &wnd->oid_cache[i];
+		if (entry->oid == oid)
+			break;
+		if (!free && !entry->oid)
+			free = entry;
+	}
+	if (i == OID_CACHE_SIZE) {
+		if (!msec) {
+			spin_unlock_bh(&wnd->oid_cache_lock);
+			return 0;
+		}
+		if (!free) {
+			spin_unlock_bh(&wnd->oid_cache_lock);
+			return -ENOSPC;
+		}
+		entry = free;
+		entry->oid = oid;
+		entry->hits = entry->misses = 0;
+	}
+	if (msec)
+		entry->ttl = msecs_to_jiffies(msec);
+	else
+		memset(entry, 0, sizeof(*entry));
+	entry->valid = FALSE;
+	spin_unlock_bh(&wnd->oid_cache_lock);
+	return 0;
+}
+
+static struct oid_cache_entry *oid_cache_find(struct ndis_device *wnd,
+					      ndis_oid oid)
+{
+	int i;
+
+	for (i = 0; i < OID_CACHE_SIZE; i++)
+		if (wnd->oid_cache[i].oid == oid)
+			return &wnd->oid_cache[i];
+	return NULL;
+}
+
+/* returns TRUE if query is satisfied from cache; otherwise, gen is
+ * set to generation of cache to be passed to oid_cache_store */
+static BOOLEAN oid_cache_lookup(struct ndis_device *wnd, ndis_oid oid,
+				void *buf, ULONG buflen, ULONG *written,
+				unsigned int *gen)
+{
+	struct oid_cache_entry *entry;
+	BOOLEAN hit = FALSE;
+
+	spin_lock_bh(&wnd->oid_cache_lock);
+	entry = oid_cache_find(wnd, oid);
+	if (entry) {
+		if (entry->valid && time_before(jiffies, entry->expires) &&
+		    buflen >= entry->length) {
+			memcpy(buf, entry->data, entry->length);
+			*written = entry->length;
+			entry->hits++;
+			hit = TRUE;
+		} else
+			entry->misses++;
+	}
+	*gen = wnd->oid_cache_gen;
+	spin_unlock_bh(&wnd->oid_cache_lock);
+	return hit;
+}
+
+static void oid_cache_store(struct ndis_device *wnd, ndis_oid oid,
+			    void *buf, ULONG length, unsigned int gen)
+{
+	struct oid_cache_entry *entry;
+
+	if (length > OID_CACHE_DATA_SIZE)
+		return;
+	spin_lock_bh(&wnd->oid_cache_lock);
+	entry = oid_cache_find(wnd, oid);
+	/* if cache was invalidated while querying, result may be
+	 * stale already */
+	if (entry && gen == wnd->oid_cache_gen) {
+		memcpy(entry->data, buf, length);
+		entry->length = length;
+		entry->expires = jiffies + entry->ttl;
+		entry->valid = TRUE;
+	}
+	spin_unlock_bh(&wnd->oid_cache_lock);
+}
+
 /* MiniportRequest(Query/Set)Information */
 NDIS_STATUS mp_request(enum ndis_request_type request,
 		       struct ndis_device *wnd, ndis_oid oid,
@@ -94,15 +255,23 @@ NDIS_STATUS mp_request(enum ndis_request_type request,
 	NDIS_STATUS res;
 	ULONG w, n;
 	struct miniport *mp;
+	unsigned int gen = 0;
 	KIRQL irql;
 
-	mutex_lock(&wnd->ndis_req_mutex);
 	if (!written)
 		written = &w;
 	if (!needed)
 		needed = &n;
+	if (request == NdisRequestQueryInformation &&
+	    oid_cache_lookup(wnd, oid, buf, buflen, written, &gen)) {
+		TRACE2("%08X cached, %d", oid, *written);
+		*needed = 0;
+		return NDIS_STATUS_SUCCESS;
+	}
+	ndis_req_lock(wnd);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	prepare_wait_condition(wnd->ndis_req_task, wnd->ndis_req_done, 0);
+	trace_ndis_request_begin(wnd, request, oid);
 	irql = serialize_lock_irql(wnd);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
 	switch (request) {
@@ -132,7 +301,13 @@ NDIS_STATUS mp_request(enum ndis_request_type request,
 			res = wnd->ndis_req_status;
 		TRACE2("%08X, %08X", res, oid);
 	}
-	mutex_unlock(&wnd->ndis_req_mutex);
+	trace_ndis_request_end(wnd, oid, res);
+	if (request == NdisRequestQueryInformation) {
+		if (res == NDIS_STATUS_SUCCESS)
+			oid_cache_store(wnd, oid, buf, *written, gen);
+	} else
+		oid_cache_invalidate(wnd);
+	ndis_req_unlock(wnd);
 	DBG_BLOCK(2) {
 		if (res || needed)
 			TRACE2("%08X, %d, %d, %d", res, buflen, *written,
@@ -141,6 +316,211 @@ NDIS_STATUS mp_request(enum ndis_request_type request,
 	EXIT3(return res);
 }
 
+/* Queue OID request; buflen bytes from buf are copied for set
+ * requests. The request is given to miniport from device's workqueue
+ * when no other request is pending in it, and callback is called from
+ * there with result in req->status and, for queries, req->buf; the
+ * request is freed after callback returns. */
+int mp_request_async(enum ndis_request_type request,
+		     struct ndis_device *wnd, ndis_oid oid, void *buf,
+		     ULONG buflen, ndis_oid_callback callback, void *ctx)
+{
+	struct ndis_oid_request *req, *cur;
+	unsigned int gen;
+
+	req = kzalloc(sizeof(*req) + buflen, irql_gfp());
+	if (!req)
+		return -ENOMEM;
+	req->type = request;
+	req->oid = oid;
+	req->buflen = buflen;
+	req->callback = callback;
+	req->ctx = ctx;
+	InitializeListHead(&req->dups);
+	if (request == NdisRequestSetInformation)
+		memcpy(req->buf, buf, buflen);
+	else if (oid_cache_lookup(wnd, oid, req->buf, buflen, &req->written,
+				  &gen)) {
+		req->status = NDIS_STATUS_SUCCESS;
+		req->cached = TRUE;
+		spin_lock_bh(&wnd->oid_req_lock);
+		InsertTailList(&wnd->oid_req_done_list, &req->list);
+		spin_unlock_bh(&wnd->oid_req_lock);
+		queue_work(wnd->wq, &wnd->oid_req_work);
+		return 0;
+	}
+
+	spin_lock_bh(&wnd->oid_req_lock);
+	wnd->oid_req_queued++;
+	if (request == NdisRequestQueryInformation) {
+		nt_list_for_each_entry(cur, &wnd->oid_req_list, list) {
+			if (cur->type == request && cur->oid == oid &&
+			    cur->buflen == buflen) {
+				InsertTailList(&cur->dups, &req->list);
+				wnd->oid_req_deduped++;
+				spin_unlock_bh(&wnd->oid_req_lock);
+				TRACE2("%08X deduped", oid);
+				return 0;
+			}
+		}
+	}
+	InsertTailList(&wnd->oid_req_list, &req->list);
+	spin_unlock_bh(&wnd->oid_req_lock);
+	queue_work(wnd->wq, &wnd->oid_req_work);
+	return 0;
+}
+
+/* called when miniport completes a request; returns FALSE if the
+ * request is synchronous */
+BOOLEAN oid_req_complete(struct ndis_device *wnd, NDIS_STATUS status)
+{
+	struct ndis_oid_request *req;
+
+	spin_lock_bh(&wnd->oid_req_lock);
+	req = wnd->oid_req_active;
+	if (req) {
+		TRACE2("%08X, %08X", req->oid, status);
+		trace_ndis_request_end(wnd, req->oid, status);
+		req->status = status;
+		InsertTailList(&wnd->oid_req_done_list, &req->list);
+		wnd->oid_req_active = NULL;
+	}
+	spin_unlock_bh(&wnd->oid_req_lock);
+	if (!req)
+		return FALSE;
+	wake_up(&wnd->oid_req_wait);
+	queue_work(wnd->wq, &wnd->oid_req_work);
+	return TRUE;
+}
+
+static void oid_req_finish(struct ndis_device *wnd,
+			   struct ndis_oid_request *req)
+{
+	struct ndis_oid_request *dup;
+	struct nt_list *ent;
+
+	if (req->type == NdisRequestSetInformation)
+		oid_cache_invalidate(wnd);
+	else if (req->status == NDIS_STATUS_SUCCESS && !req->cached)
+		oid_cache_store(wnd, req->oid, req->buf, req->written,
+				req->cache_gen);
+	while ((ent = RemoveHeadList(&req->dups))) {
+		dup = container_of(ent, struct ndis_oid_request, list);
+		dup->status = req->status;
+		dup->written = req->written;
+		dup->needed = req->needed;
+		if (req->status == NDIS_STATUS_SUCCESS)
+			memcpy(dup->buf, req->buf, req->written);
+		if (dup->callback)
+			dup->callback(wnd, dup);
+		kfree(dup);
+	}
+	if (req->callback)
+		req->callback(wnd, req);
+	kfree(req);
+}
+
+static BOOLEAN oid_req_idle(struct ndis_device *wnd)
+{
+	BOOLEAN idle;
+
+	spin_lock_bh(&wnd->oid_req_lock);
+	idle = wnd->oid_req_active == NULL;
+	spin_unlock_bh(&wnd->oid_req_lock);
+	return idle;
+}
+
+/* completes pending requests with given status, e.g., when device is
+ * removed */
+static void oid_req_cancel_all(struct ndis_device *wnd, NDIS_STATUS status)
+{
+	struct ndis_oid_request *req;
+	struct nt_list *ent;
+
+	cancel_work_sync(&wnd->oid_req_work);
+	while (1) {
+		spin_lock_bh(&wnd->oid_req_lock);
+		ent = RemoveHeadList(&wnd->oid_req_done_list);
+		if (!ent) {
+			ent = RemoveHeadList(&wnd->oid_req_list);
+			if (ent) {
+				req = container_of(ent, struct ndis_oid_request,
+						   list);
+				req->status = status;
+			}
+		}
+		spin_unlock_bh(&wnd->oid_req_lock);
+		if (!ent)
+			break;
+		oid_req_finish(wnd, container_of(ent, struct ndis_oid_request,
+						 list));
+	}
+}
+
+static void oid_req_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+	struct ndis_oid_request *req;
+	struct nt_list *ent;
+	struct miniport *mp;
+	NDIS_STATUS res;
+	KIRQL irql;
+
+	wnd = container_of(work, struct ndis_device, oid_req_work);
+	while (1) {
+		spin_lock_bh(&wnd->oid_req_lock);
+		ent = RemoveHeadList(&wnd->oid_req_done_list);
+		spin_unlock_bh(&wnd->oid_req_lock);
+		if (!ent)
+			break;
+		oid_req_finish(wnd, container_of(ent, struct ndis_oid_request,
+						 list));
+	}
+
+	/* if a synchronous request is in progress, or device is
+	 * suspended, we are queued again when ndis_req_mutex is
+	 * released; otherwise, when active request completes */
+	if (!mutex_trylock(&wnd->ndis_req_mutex))
+		return;
+	spin_lock_bh(&wnd->oid_req_lock);
+	/* mp_halt waits for oid_req_active after clearing
+	 * HW_INITIALIZED; ndis_req_unlock in mp_set_power_state and
+	 * mp_set_int queues us while miniport is suspended or halted,
+	 * and we are queued again when it is powered up */
+	if (wnd->oid_req_active ||
+	    !test_bit(HW_INITIALIZED, &wnd->wd->hw_status) ||
+	    test_bit(HW_SUSPENDED, &wnd->wd->hw_status) ||
+	    test_bit(HW_HALTED, &wnd->wd->hw_status) ||
+	    !(ent = RemoveHeadList(&wnd->oid_req_list))) {
+		spin_unlock_bh(&wnd->oid_req_lock);
+		mutex_unlock(&wnd->ndis_req_mutex);
+		return;
+	}
+	req = container_of(ent, struct ndis_oid_request, list);
+	wnd->oid_req_active = req;
+	req->cache_gen = wnd->oid_cache_gen;
+	spin_unlock_bh(&wnd->oid_req_lock);
+
+	mp = &wnd->wd->driver->ndis_driver->mp;
+	trace_ndis_request_begin(wnd, req->type, req->oid);
+	irql = serialize_lock_irql(wnd);
+	assert_irql(_irql_ == DISPATCH_LEVEL);
+	if (req->type == NdisRequestQueryInformation)
+		res = LIN2WIN6(mp->queryinfo, wnd->nmb->mp_ctx, req->oid,
+			       req->buf, req->buflen, &req->written,
+			       &req->needed);
+	else
+		res = LIN2WIN6(mp->setinfo, wnd->nmb->mp_ctx, req->oid,
+			       req->buf, req->buflen, &req->written,
+			       &req->needed);
+	serialize_unlock_irql(wnd, irql);
+	mutex_unlock(&wnd->ndis_req_mutex);
+	TRACE2("%08X, %08X", res, req->oid);
+	/* oid_req_complete queues this work again */
+	if (res != NDIS_STATUS_PENDING)
+		oid_req_complete(wnd, res);
+}
+
 /* MiniportPnPEventNotify */
 static NDIS_STATUS mp_pnp_event(struct ndis_device *wnd,
 				enum ndis_device_pnp_event event,
@@ -223,7 +603,10 @@ static NDIS_STATUS mp_init(struct ndis_device *wnd)
 			      NdisPowerProfileAcOnLine);
 	if (status != NDIS_STATUS_SUCCESS)
 		TRACE1("setting power failed: %08X", status);
+	oid_cache_invalidate(wnd);
 	set_bit(HW_INITIALIZED, &wnd->wd->hw_status);
+	/* requests queued while device was halted */
+	queue_work(wnd->wq, &wnd->oid_req_work);
 	/* the description about NDIS_ATTRIBUTE_NO_HALT_ON_SUSPEND is
 	 * misleading/confusing */
 	status = mp_query(wnd, OID_PNP_CAPABILITIES,
@@ -260,14 +643,20 @@ static void mp_halt(struct ndis_device *wnd)
 	}
 	hangcheck_del(wnd);
 	del_iw_stats_timer(wnd);
+	/* no more asynchronous requests are given to miniport */
+	wait_event(wnd->oid_req_wait, oid_req_idle(wnd));
 #ifdef CONFIG_WIRELESS_EXT
 	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan &&
 	    wrap_is_pci_bus(wnd->wd->dev_bus)) {
-		mutex_unlock(&wnd->ndis_req_mutex);
+		ndis_req_unlock(wnd);
 		disassociate(wnd, 0);
-		mutex_lock(&wnd->ndis_req_mutex);
+		ndis_req_lock(wnd);
 	}
 #endif
+	/* return any received packets still held before halting;
+	 * ntos_wq also runs other devices' DPCs and work items, so
+	 * only this device's work is waited for */
+	flush_work(&wnd->return_packets_work);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	TRACE1("halt: %p", mp->mp_halt);
 	LIN2WIN1(mp->mp_halt, wnd->nmb->mp_ctx);
@@ -310,20 +699,23 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 	TRACE1("%d", state);
 	if (state == NdisDeviceStateD0) {
 		status = NDIS_STATUS_SUCCESS;
-		mutex_unlock(&wnd->ndis_req_mutex);
+		ndis_req_unlock(wnd);
 		if (test_and_clear_bit(HW_HALTED, &wnd->wd->hw_status)) {
 			status = mp_init(wnd);
 			if (status == NDIS_STATUS_SUCCESS) {
 				set_packet_filter(wnd, wnd->packet_filter);
 				set_multicast_list(wnd);
 			}
-		} else if (test_and_clear_bit(HW_SUSPENDED,
-					      &wnd->wd->hw_status)) {
+		} else if (test_bit(HW_SUSPENDED, &wnd->wd->hw_status)) {
+			/* asynchronous requests are held until miniport
+			 * is powered up */
 			status = mp_set_int(wnd, OID_PNP_SET_POWER, state);
+			clear_bit(HW_SUSPENDED, &wnd->wd->hw_status);
 			if (status != NDIS_STATUS_SUCCESS)
 				WARNING("%s: setting power to state %d failed? "
 					"%08X", wnd->net_dev->name, state,
 					status);
+			queue_work(wnd->wq, &wnd->oid_req_work);
 		} else
 			return NDIS_STATUS_FAILURE;
 
@@ -361,10 +753,11 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 			} else
 				WARNING("couldn't set wake-on-lan options: "
 					"0x%x, %08X", wnd->ndis_wolopts, status);
+			/* set before the request, so asynchronous
+			 * requests queued when it is done are held */
+			set_bit(HW_SUSPENDED, &wnd->wd->hw_status);
 			status = mp_set_int(wnd, OID_PNP_SET_POWER, state);
-			if (status == NDIS_STATUS_SUCCESS)
-				set_bit(HW_SUSPENDED, &wnd->wd->hw_status);
-			else
+			if (status != NDIS_STATUS_SUCCESS)
 				WARNING("suspend failed: %08X", status);
 		}
 		if (status != NDIS_STATUS_SUCCESS) {
@@ -372,9 +765,10 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 				"halting the device", wnd->net_dev->name);
 			mp_halt(wnd);
 			set_bit(HW_HALTED, &wnd->wd->hw_status);
+			clear_bit(HW_SUSPENDED, &wnd->wd->hw_status);
 			status = STATUS_SUCCESS;
 		}
-		mutex_lock(&wnd->ndis_req_mutex);
+		ndis_req_lock(wnd);
 		EXIT1(return status);
 	}
 }
@@ -580,11 +974,10 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	buffer = packet->private.buffer_head;
 	TRACE4("%p, %p, %p, %08X", packet, buffer, skb, status);
 	if (status == NDIS_STATUS_SUCCESS) {
-		pre_atomic_add(wnd->net_stats.tx_bytes, packet->private.len);
-		atomic_inc_var(wnd->net_stats.tx_packets);
+		ndis_stats_packet(wnd, tx, packet->private.len);
 	} else {
 		TRACE1("packet dropped: %08X", status);
-		atomic_inc_var(wnd->net_stats.tx_dropped);
+		ndis_stats_inc(wnd, tx_dropped);
 	}
 	if (wnd->sg_dma_size)
 		free_tx_sg_list(wnd, oob_data);
@@ -596,14 +989,14 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	    ((pool->max_descr - pool->num_used_descr) >=
 	     (wnd->max_tx_packets / 4))) {
 		set_bit(NETIF_WAKEQ, &wnd->ndis_pending_work);
-		queue_work(wrapndis_wq, &wnd->ndis_work);
+		queue_ndis_work(wnd);
 	}
 	EXIT4(return);
 }
 
 /* MiniportSend and MiniportSendPackets */
 /* this function is called holding tx_ring_mutex. start and n are such
- * that start + n < TX_RING_SIZE; i.e., packets don't wrap around
+ * that start + n <= tx_ring_size; i.e., packets don't wrap around
  * ring */
 static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 {
@@ -614,12 +1007,15 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	KIRQL irql;
 
 	ENTER3("%d, %d", start, n);
+	trace_ndis_send_begin(wnd, n);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	if (mp->send_packets) {
 		if (deserialized_driver(wnd)) {
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
 				 &wnd->tx_ring[start], n);
 			sent = n;
+			/* all are completed with NdisMSendComplete */
+			ndis_stats_add(wnd, tx_pending, n);
 		} else {
 			irql = serialize_lock_irql(wnd);
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
@@ -637,8 +1033,10 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 						       NDIS_STATUS_SUCCESS);
 					break;
 				case NDIS_STATUS_PENDING:
+					ndis_stats_inc(wnd, tx_pending);
 					break;
 				case NDIS_STATUS_RESOURCES:
+					ndis_stats_inc(wnd, tx_resources);
 					wnd->tx_ok = 0;
 					/* resubmit this packet and
 					 * the rest when resources
@@ -675,8 +1073,10 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 				free_tx_packet(wnd, packet, res);
 				break;
 			case NDIS_STATUS_PENDING:
+				ndis_stats_inc(wnd, tx_pending);
 				break;
 			case NDIS_STATUS_RESOURCES:
+				ndis_stats_inc(wnd, tx_resources);
 				wnd->tx_ok = 0;
 				/* resend this packet when resources
 				 * become available */
@@ -692,15 +1092,58 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 			}
 		}
 	}
+	trace_ndis_send_end(wnd, sent);
 	EXIT3(return sent);
 }
 
+/* queue work of a device in its own workqueue, so a slow device
+ * doesn't hold up others; queued is where the time of queuing is
+ * recorded for the work */
+void wrapndis_queue_work(struct ndis_device *wnd, struct work_struct *work,
+			 u64 *queued)
+{
+	int depth;
+
+	if (!work_pending(work))
+		*queued = ktime_to_ns(ktime_get());
+	depth = post_atomic_add(wnd->wq_stats.depth, 1);
+	if (queue_work(wnd->wq, work)) {
+		atomic_inc_var(wnd->wq_stats.queued);
+		if (depth > wnd->wq_stats.max_depth)
+			wnd->wq_stats.max_depth = depth;
+	} else
+		atomic_dec_var(wnd->wq_stats.depth);
+}
+
+/* work queued with wrapndis_queue_work and cancelled before it ran
+ * no longer counts in depth */
+void wrapndis_cancel_work(struct ndis_device *wnd, struct work_struct *work)
+{
+	if (cancel_work_sync(work))
+		atomic_dec_var(wnd->wq_stats.depth);
+}
+
+/* works of a device are run one at a time, so stats other than
+ * depth don't need atomic updates */
+static void wrapndis_work_started(struct ndis_device *wnd, u64 queued)
+{
+	u64 latency = ktime_to_ns(ktime_get()) - queued;
+
+	atomic_dec_var(wnd->wq_stats.depth);
+	wnd->wq_stats.run++;
+	wnd->wq_stats.total_latency += latency;
+	if (latency > wnd->wq_stats.max_latency)
+		wnd->wq_stats.max_latency = latency;
+	wrap_latency_hist_add(wnd->wq_stats.latency_hist, latency);
+}
+
 static void tx_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
-	s8 n;
+	int n;
 
 	wnd = container_of(work, struct ndis_device, tx_work);
+	wrapndis_work_started(wnd, wnd->tx_work_queued);
 	ENTER3("tx_ok %d", wnd->tx_ok);
 	while (wnd->tx_ok) {
 		mutex_lock(&wnd->tx_ring_mutex);
@@ -711,14 +1154,14 @@ static void tx_worker(struct work_struct *work)
 		 * the latter case is_tx_ring_full is set */
 		if (n == 0) {
 			if (wnd->is_tx_ring_full)
-				n = TX_RING_SIZE - wnd->tx_ring_start;
+				n = wnd->tx_ring_size - wnd->tx_ring_start;
 			else {
 				spin_unlock_bh(&wnd->tx_ring_lock);
 				mutex_unlock(&wnd->tx_ring_mutex);
 				break;
 			}
 		} else if (n < 0)
-			n = TX_RING_SIZE - wnd->tx_ring_start;
+			n = wnd->tx_ring_size - wnd->tx_ring_start;
 		spin_unlock_bh(&wnd->tx_ring_lock);
 		if (unlikely(n > wnd->max_tx_packets))
 			n = wnd->max_tx_packets;
@@ -726,7 +1169,7 @@ static void tx_worker(struct work_struct *work)
 		if (n) {
 			netif_trans_update(wnd->net_dev);
 			wnd->tx_ring_start =
-				(wnd->tx_ring_start + n) % TX_RING_SIZE;
+				(wnd->tx_ring_start + n) % wnd->tx_ring_size;
 			wnd->is_tx_ring_full = 0;
 		}
 		mutex_unlock(&wnd->tx_ring_mutex);
@@ -735,10 +1178,33 @@ static void tx_worker(struct work_struct *work)
 	EXIT3(return);
 }
 
+/* called with tx_ring_lock held */
+static int tx_ring_pending(struct ndis_device *wnd)
+{
+	int n = wnd->tx_ring_end - wnd->tx_ring_start;
+
+	if (n < 0)
+		n += wnd->tx_ring_size;
+	else if (n == 0 && wnd->is_tx_ring_full)
+		n = wnd->tx_ring_size;
+	return n;
+}
+
+/* max_tx_packets is limited by size of tx_ring and by what serialized
+ * miniport accepts; tx pools are sized to it */
+static void set_max_tx_packets(struct ndis_device *wnd)
+{
+	wnd->max_tx_packets = wnd->tx_ring_size;
+	if (wnd->mp_max_tx_packets &&
+	    wnd->mp_max_tx_packets < wnd->max_tx_packets)
+		wnd->max_tx_packets = wnd->mp_max_tx_packets;
+}
+
 static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
 	struct ndis_packet *packet;
+	int n;
 
 	packet = alloc_tx_packet(wnd, skb);
 	if (!packet) {
@@ -750,17 +1216,22 @@ static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 	}
 	spin_lock(&wnd->tx_ring_lock);
 	wnd->tx_ring[wnd->tx_ring_end++] = packet;
-	if (wnd->tx_ring_end == TX_RING_SIZE)
+	if (wnd->tx_ring_end == wnd->tx_ring_size)
 		wnd->tx_ring_end = 0;
 	if (wnd->tx_ring_end == wnd->tx_ring_start) {
+		ndis_stats_inc(wnd, tx_ring_full);
 		netif_tx_lock(dev);
 		wnd->is_tx_ring_full = 1;
 		netif_stop_queue(dev);
 		netif_tx_unlock(dev);
 	}
+	n = fls(tx_ring_pending(wnd)) - 1;
+	if (n >= TX_RING_OCCUPANCY_BUCKETS)
+		n = TX_RING_OCCUPANCY_BUCKETS - 1;
+	wnd->tx_ring_occupancy[n]++;
 	spin_unlock(&wnd->tx_ring_lock);
 	TRACE4("ring: %d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	queue_tx_work(wnd);
 	return NETDEV_TX_OK;
 }
 
@@ -825,9 +1296,10 @@ void set_media_state(struct ndis_device *wnd, enum ndis_media_state state)
 		wnd->tx_ok = 1;
 		if (netif_queue_stopped(net_dev))
 			netif_wake_queue(net_dev);
+		nl_ndis_link_event(wnd, 1);
 		if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
 			set_bit(LINK_STATUS_ON, &wnd->ndis_pending_work);
-			queue_work(wrapndis_wq, &wnd->ndis_work);
+			queue_ndis_work(wnd);
 		}
 		break;
 	case NdisMediaStateDisconnected:
@@ -836,10 +1308,11 @@ void set_media_state(struct ndis_device *wnd, enum ndis_media_state state)
 		netif_carrier_off(net_dev);
 		netif_stop_queue(net_dev);
 		wnd->tx_ok = 0;
+		nl_ndis_link_event(wnd, 0);
 		if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
 			memset(&wnd->essid, 0, sizeof(wnd->essid));
 			set_bit(LINK_STATUS_OFF, &wnd->ndis_pending_work);
-			queue_work(wrapndis_wq, &wnd->ndis_work);
+			queue_ndis_work(wnd);
 		}
 		break;
 	default:
@@ -884,6 +1357,7 @@ static int ndis_net_dev_open(struct net_device *net_dev)
 static int ndis_net_dev_close(struct net_device *net_dev)
 {
 	ENTER1("%p", netdev_priv(net_dev));
+	cfg_ndis_stop(netdev_priv(net_dev));
 	netif_poll_disable(net_dev);
 	netif_tx_disable(net_dev);
 	EXIT1(return 0);
@@ -920,11 +1394,59 @@ static void ndis_poll_controller(struct net_device *dev)
 }
 #endif
 
+void get_ndis_counters(struct ndis_device *wnd, struct ndis_counters *sum)
+{
+	struct ndis_pcpu_stats *stats;
+	struct ndis_counters c;
+	unsigned int start;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(wnd->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			c = stats->c;
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+		sum->tx_packets += c.tx_packets;
+		sum->tx_bytes += c.tx_bytes;
+		sum->tx_dropped += c.tx_dropped;
+		sum->rx_packets += c.rx_packets;
+		sum->rx_bytes += c.rx_bytes;
+		sum->rx_dropped += c.rx_dropped;
+		sum->tx_ring_full += c.tx_ring_full;
+		sum->tx_resources += c.tx_resources;
+		sum->tx_pending += c.tx_pending;
+	}
+}
+
 /* called from BH context */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+static void ndis_get_stats64(struct net_device *dev,
+			     struct rtnl_link_stats64 *stats)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+static struct rtnl_link_stats64 *
+ndis_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+#else
 static struct net_device_stats *ndis_get_stats(struct net_device *dev)
+#endif
 {
 	struct ndis_device *wnd = netdev_priv(dev);
-	return &wnd->net_stats;
+	struct ndis_counters sum;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+	struct net_device_stats *stats = &wnd->net_stats;
+#endif
+
+	get_ndis_counters(wnd, &sum);
+	stats->tx_packets = sum.tx_packets;
+	stats->tx_bytes = sum.tx_bytes;
+	stats->tx_dropped = sum.tx_dropped;
+	stats->rx_packets = sum.rx_packets;
+	stats->rx_bytes = sum.rx_bytes;
+	stats->rx_dropped = sum.rx_dropped;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	return stats;
+#endif
 }
 
 /* called from BH context */
@@ -932,32 +1454,29 @@ static void ndis_set_multicast_list(struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
 	set_bit(SET_MULTICAST_LIST, &wnd->ndis_pending_work);
-	queue_work(wrapndis_wq, &wnd->ndis_work);
+	queue_ndis_work(wnd);
 }
 
-/* called from BH context */
+/* called from BH context; stats older than IW_STATS_MIN_AGE are
+ * collected by worker, so this read returns previous values */
 struct iw_statistics *get_iw_stats(struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
+
+	wnd->iw_stats_read = jiffies;
+	if (wnd->iw_stats_interval > 0 &&
+	    time_after(jiffies, wnd->iw_stats_updated + IW_STATS_MIN_AGE) &&
+	    !test_and_set_bit(COLLECT_IW_STATS, &wnd->ndis_pending_work))
+		queue_ndis_work(wnd);
 	return &wnd->iw_stats;
 }
 
-static void update_iw_stats(struct ndis_device *wnd)
+static void set_iw_stats_rssi(struct ndis_device *wnd, ndis_rssi rssi)
 {
 	struct iw_statistics *iw_stats = &wnd->iw_stats;
-	struct ndis_wireless_stats ndis_stats;
-	NDIS_STATUS res;
-	ndis_rssi rssi;
 	int qual;
 
-	ENTER2("%p", wnd);
-	if (wnd->iw_stats_enabled == FALSE || !netif_carrier_ok(wnd->net_dev)) {
-		memset(iw_stats, 0, sizeof(*iw_stats));
-		EXIT2(return);
-	}
-	res = mp_query(wnd, OID_802_11_RSSI, &rssi, sizeof(rssi));
-	if (res == NDIS_STATUS_SUCCESS)
-		iw_stats->qual.level = rssi;
+	iw_stats->qual.level = rssi;
 
 	qual = 100 * (rssi - WL_NOISE) / (WL_SIGMAX - WL_NOISE);
 	if (qual < 0)
@@ -967,18 +1486,67 @@ static void update_iw_stats(struct ndis_device *wnd)
 
 	iw_stats->qual.noise = WL_NOISE;
 	iw_stats->qual.qual = qual;
+}
 
-	res = mp_query(wnd, OID_802_11_STATISTICS,
-		       &ndis_stats, sizeof(ndis_stats));
-	if (res != NDIS_STATUS_SUCCESS)
-		EXIT2(return);
-	iw_stats->discard.retries = (unsigned long)ndis_stats.retry +
-		(unsigned long)ndis_stats.multi_retry;
-	iw_stats->discard.misc = (unsigned long)ndis_stats.fcs_err +
-		(unsigned long)ndis_stats.rtss_fail +
-		(unsigned long)ndis_stats.ack_fail +
-		(unsigned long)ndis_stats.frame_dup;
+static void iw_stats_rssi_done(struct ndis_device *wnd,
+			       struct ndis_oid_request *req)
+{
+	if (req->status != NDIS_STATUS_SUCCESS)
+		return;
+	set_iw_stats_rssi(wnd, *(ndis_rssi *)req->buf);
+}
+
+/* miniports with OID_802_11_RSSI_TRIGGER programmed (by
+ * link_status_on or SIOCSIWSENS) indicate RSSI with
+ * NDIS_STATUS_MEDIA_SPECIFIC_INDICATION; while these are recent, RSSI
+ * is not polled */
+void iw_stats_rssi_indication(struct ndis_device *wnd, ndis_rssi rssi)
+{
+	TRACE2("%d", rssi);
+	if (!netif_carrier_ok(wnd->net_dev))
+		return;
+	set_iw_stats_rssi(wnd, rssi);
+	wnd->iw_stats_rssi_indicated = jiffies;
+	wnd->iw_stats_rssi_indications++;
+}
 
+static void iw_stats_done(struct ndis_device *wnd,
+			  struct ndis_oid_request *req)
+{
+	struct iw_statistics *iw_stats = &wnd->iw_stats;
+	struct ndis_wireless_stats *ndis_stats;
+
+	if (req->status != NDIS_STATUS_SUCCESS)
+		return;
+	ndis_stats = (struct ndis_wireless_stats *)req->buf;
+	iw_stats->discard.retries = (unsigned long)ndis_stats->retry +
+		(unsigned long)ndis_stats->multi_retry;
+	iw_stats->discard.misc = (unsigned long)ndis_stats->fcs_err +
+		(unsigned long)ndis_stats->rtss_fail +
+		(unsigned long)ndis_stats->ack_fail +
+		(unsigned long)ndis_stats->frame_dup;
+}
+
+/* iw_stats are updated when queries complete, so a slow miniport
+ * doesn't hold up wrapndis_worker */
+static void update_iw_stats(struct ndis_device *wnd)
+{
+	struct iw_statistics *iw_stats = &wnd->iw_stats;
+
+	ENTER2("%p", wnd);
+	if (wnd->iw_stats_enabled == FALSE || !netif_carrier_ok(wnd->net_dev)) {
+		memset(iw_stats, 0, sizeof(*iw_stats));
+		EXIT2(return);
+	}
+	wnd->iw_stats_updated = jiffies;
+	wnd->iw_stats_collected++;
+	if (!wnd->iw_stats_rssi_indications ||
+	    time_after(jiffies, wnd->iw_stats_rssi_indicated +
+		       wnd->iw_stats_interval))
+		mp_query_async(wnd, OID_802_11_RSSI, sizeof(ndis_rssi),
+			       iw_stats_rssi_done, NULL);
+	mp_query_async(wnd, OID_802_11_STATISTICS,
+		       sizeof(struct ndis_wireless_stats), iw_stats_done, NULL);
 	EXIT2(return);
 }
 
@@ -1051,7 +1619,13 @@ static void link_status_off(struct ndis_device *wnd)
 {
 #ifdef CONFIG_WIRELESS_EXT
 	union iwreq_data wrqu;
+#endif
 
+	if (wnd->wdev) {
+		cfg_ndis_link_off(wnd);
+		EXIT2(return);
+	}
+#ifdef CONFIG_WIRELESS_EXT
 	memset(&wrqu, 0, sizeof(wrqu));
 	wrqu.ap_addr.sa_family = ARPHRD_ETHER;
 	wireless_send_event(wnd->net_dev, SIOCGIWAP, &wrqu, NULL);
@@ -1059,30 +1633,38 @@ static void link_status_off(struct ndis_device *wnd)
 	EXIT2(return);
 }
 
-static void link_status_on(struct ndis_device *wnd)
-{
 #ifdef CONFIG_WIRELESS_EXT
+static void link_status_ap_done(struct ndis_device *wnd,
+				struct ndis_oid_request *req)
+{
+	union iwreq_data wrqu;
+
+	/* link may have gone down while query was pending, in which
+	 * case link_status_off has sent event already */
+	if (!netif_carrier_ok(wnd->net_dev))
+		return;
+	memset(&wrqu, 0, sizeof(wrqu));
+	if (req->status == NDIS_STATUS_SUCCESS)
+		memcpy(wrqu.ap_addr.sa_data, req->buf, ETH_ALEN);
+	else
+		TRACE2("res: %08X", req->status);
+	wrqu.ap_addr.sa_family = ARPHRD_ETHER;
+	TRACE2(MACSTRSEP, MAC2STR(wrqu.ap_addr.sa_data));
+	wireless_send_event(wnd->net_dev, SIOCGIWAP, &wrqu, NULL);
+}
+
+static void link_status_assoc_done(struct ndis_device *wnd,
+				   struct ndis_oid_request *req)
+{
 	struct ndis_assoc_info *ndis_assoc_info;
 	union iwreq_data wrqu;
-	NDIS_STATUS res;
-	const int assoc_size = sizeof(*ndis_assoc_info) + IW_CUSTOM_MAX + 32;
-#endif
 
-	ENTER2("");
-#ifdef CONFIG_WIRELESS_EXT
 	memset(&wrqu, 0, sizeof(wrqu));
-	ndis_assoc_info = kzalloc(assoc_size, GFP_KERNEL);
-	if (!ndis_assoc_info) {
-		ERROR("couldn't allocate memory");
-		goto send_assoc_event;
-	}
-	res = mp_query(wnd, OID_802_11_ASSOCIATION_INFORMATION,
-		       ndis_assoc_info, assoc_size);
-	if (res) {
-		TRACE2("query assoc_info failed (%08X)", res);
-		kfree(ndis_assoc_info);
+	if (req->status != NDIS_STATUS_SUCCESS) {
+		TRACE2("query assoc_info failed (%08X)", req->status);
 		goto send_assoc_event;
 	}
+	ndis_assoc_info = (struct ndis_assoc_info *)req->buf;
 	TRACE2("%u, 0x%x, %u, 0x%x, %u", ndis_assoc_info->length,
 	       ndis_assoc_info->req_ies, ndis_assoc_info->req_ie_length,
 	       ndis_assoc_info->resp_ies, ndis_assoc_info->resp_ie_length);
@@ -1098,13 +1680,38 @@ static void link_status_on(struct ndis_device *wnd)
 				    ((char *)ndis_assoc_info) +
 				    ndis_assoc_info->offset_resp_ies);
 	}
-	kfree(ndis_assoc_info);
 
 send_assoc_event:
-	get_ap_address(wnd, wrqu.ap_addr.sa_data);
-	wrqu.ap_addr.sa_family = ARPHRD_ETHER;
-	TRACE2(MACSTRSEP, MAC2STR(wrqu.ap_addr.sa_data));
-	wireless_send_event(wnd->net_dev, SIOCGIWAP, &wrqu, NULL);
+	if (mp_query_async(wnd, OID_802_11_BSSID, ETH_ALEN,
+			   link_status_ap_done, NULL))
+		ERROR("couldn't allocate memory");
+}
+#endif
+
+static void link_status_on(struct ndis_device *wnd)
+{
+	ndis_rssi rssi_trigger;
+
+	ENTER2("");
+	/* association has invalidated OID cache already, so setting
+	 * trigger here doesn't cost cached queries */
+	if (wnd->rssi_trigger) {
+		rssi_trigger = wnd->rssi_trigger;
+		if (mp_set(wnd, OID_802_11_RSSI_TRIGGER,
+			   &rssi_trigger, sizeof(rssi_trigger))) {
+			TRACE2("RSSI trigger not supported");
+			wnd->rssi_trigger = 0;
+		}
+	}
+	if (wnd->wdev) {
+		cfg_ndis_link_on(wnd);
+		EXIT2(return);
+	}
+#ifdef CONFIG_WIRELESS_EXT
+	if (mp_query_async(wnd, OID_802_11_ASSOCIATION_INFORMATION,
+			   sizeof(struct ndis_assoc_info) + IW_CUSTOM_MAX + 32,
+			   link_status_assoc_done, NULL))
+		ERROR("couldn't allocate memory");
 #endif
 	EXIT2(return);
 }
@@ -1121,12 +1728,20 @@ static void iw_stats_timer_proc(unsigned long data)
 	struct ndis_device *wnd = (struct ndis_device *)data;
 #endif
 
-	ENTER2("%d", wnd->iw_stats_interval);
+	ENTER2("%d, %d", wnd->iw_stats_interval, wnd->iw_stats_backoff);
 	if (wnd->iw_stats_interval > 0) {
-		set_bit(COLLECT_IW_STATS, &wnd->ndis_pending_work);
-		queue_work(wrapndis_wq, &wnd->ndis_work);
+		if (time_before(jiffies, wnd->iw_stats_read +
+				wnd->iw_stats_backoff)) {
+			wnd->iw_stats_backoff = wnd->iw_stats_interval;
+			set_bit(COLLECT_IW_STATS, &wnd->ndis_pending_work);
+			queue_ndis_work(wnd);
+		} else
+			/* nobody read stats since last time */
+			wnd->iw_stats_backoff =
+				min_t(int, 2 * wnd->iw_stats_backoff,
+				      IW_STATS_MAX_BACKOFF);
 	}
-	mod_timer(&wnd->iw_stats_timer, jiffies + wnd->iw_stats_interval);
+	mod_timer(&wnd->iw_stats_timer, jiffies + wnd->iw_stats_backoff);
 }
 
 static void add_iw_stats_timer(struct ndis_device *wnd)
@@ -1135,6 +1750,9 @@ static void add_iw_stats_timer(struct ndis_device *wnd)
 		return;
 	if (wnd->iw_stats_interval < 0)
 		wnd->iw_stats_interval *= -1;
+	wnd->iw_stats_backoff = wnd->iw_stats_interval;
+	wnd->iw_stats_read = jiffies;
+	wnd->iw_stats_updated = jiffies - IW_STATS_MIN_AGE - 1;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
 	timer_setup(&wnd->iw_stats_timer, iw_stats_timer_proc, 0);
 #else
@@ -1167,7 +1785,7 @@ static void hangcheck_proc(unsigned long data)
 	ENTER3("%d", wnd->hangcheck_interval);
 	if (wnd->hangcheck_interval > 0) {
 		set_bit(HANGCHECK, &wnd->ndis_pending_work);
-		queue_work(wrapndis_wq, &wnd->ndis_work);
+		queue_ndis_work(wnd);
 	}
 	mod_timer(&wnd->hangcheck_timer, jiffies + wnd->hangcheck_interval);
 	EXIT3(return);
@@ -1208,6 +1826,7 @@ static void wrapndis_worker(struct work_struct *work)
 	struct ndis_device *wnd;
 
 	wnd = container_of(work, struct ndis_device, ndis_work);
+	wrapndis_work_started(wnd, wnd->ndis_work_queued);
 	WORKTRACE("0x%lx", wnd->ndis_pending_work);
 
 	if (test_and_clear_bit(NETIF_WAKEQ, &wnd->ndis_pending_work)) {
@@ -1264,7 +1883,18 @@ NDIS_STATUS ndis_reinit(struct ndis_device *wnd)
 	return status;
 }
 
-#ifdef CONFIG_WIRELESS_EXT
+/* set authentication or encryption mode and return what miniport
+ * reports back, or -1 if either fails; capabilities are probed with
+ * OIDs directly, as they are needed by cfg80211 without wireless
+ * extensions, too */
+static int probe_ndis_mode(struct ndis_device *wnd, ndis_oid oid,
+			   ULONG mode)
+{
+	if (mp_set_int(wnd, oid, mode) || mp_query_int(wnd, oid, &mode))
+		return -1;
+	return mode;
+}
+
 static void get_encryption_capa(struct ndis_device *wnd, char *buf,
 				const int buf_len)
 {
@@ -1296,39 +1926,37 @@ static void get_encryption_capa(struct ndis_device *wnd, char *buf,
 		mp_set_int(wnd, OID_802_11_NETWORK_TYPE_IN_USE, mode);
 	}
 	/* check if WEP is supported */
-	if (set_iw_encr_mode(wnd, IW_AUTH_CIPHER_WEP104,
-			     IW_AUTH_CIPHER_NONE) == 0 &&
-	    get_ndis_encr_mode(wnd) == Ndis802_11Encryption1KeyAbsent)
+	if (probe_ndis_mode(wnd, OID_802_11_ENCRYPTION_STATUS,
+			    Ndis802_11Encryption1Enabled) ==
+	    Ndis802_11Encryption1KeyAbsent)
 		set_bit(Ndis802_11Encryption1Enabled, &wnd->capa.encr);
 
 	/* check if WPA is supported */
-	if (set_ndis_auth_mode(wnd, Ndis802_11AuthModeWPA) == 0 &&
-	    get_ndis_auth_mode(wnd) == Ndis802_11AuthModeWPA)
+	if (probe_ndis_mode(wnd, OID_802_11_AUTHENTICATION_MODE,
+			    Ndis802_11AuthModeWPA) == Ndis802_11AuthModeWPA)
 		set_bit(Ndis802_11AuthModeWPA, &wnd->capa.encr);
 	else
 		EXIT1(return);
 
-	if (set_ndis_auth_mode(wnd, Ndis802_11AuthModeWPAPSK) == 0 &&
-	    get_ndis_auth_mode(wnd) == Ndis802_11AuthModeWPAPSK)
+	if (probe_ndis_mode(wnd, OID_802_11_AUTHENTICATION_MODE,
+			    Ndis802_11AuthModeWPAPSK) ==
+	    Ndis802_11AuthModeWPAPSK)
 		set_bit(Ndis802_11AuthModeWPAPSK, &wnd->capa.encr);
 
 	/* check for highest encryption */
 	mode = 0;
-	if (set_iw_encr_mode(wnd, IW_AUTH_CIPHER_CCMP,
-			     IW_AUTH_CIPHER_NONE) == 0 &&
-	    (i = get_ndis_encr_mode(wnd)) > 0 &&
+	if ((i = probe_ndis_mode(wnd, OID_802_11_ENCRYPTION_STATUS,
+				 Ndis802_11Encryption3Enabled)) > 0 &&
 	    (i == Ndis802_11Encryption3KeyAbsent ||
 	     i == Ndis802_11Encryption3Enabled))
 		mode = Ndis802_11Encryption3Enabled;
-	else if (set_iw_encr_mode(wnd, IW_AUTH_CIPHER_TKIP,
-				  IW_AUTH_CIPHER_NONE) == 0 &&
-		 (i = get_ndis_encr_mode(wnd)) > 0 &&
+	else if ((i = probe_ndis_mode(wnd, OID_802_11_ENCRYPTION_STATUS,
+				      Ndis802_11Encryption2Enabled)) > 0 &&
 		 (i == Ndis802_11Encryption2KeyAbsent ||
 		  i == Ndis802_11Encryption2Enabled))
 		mode = Ndis802_11Encryption2Enabled;
-	else if (set_iw_encr_mode(wnd, IW_AUTH_CIPHER_WEP104,
-				  IW_AUTH_CIPHER_NONE) == 0 &&
-		 (i = get_ndis_encr_mode(wnd)) > 0 &&
+	else if ((i = probe_ndis_mode(wnd, OID_802_11_ENCRYPTION_STATUS,
+				      Ndis802_11Encryption1Enabled)) > 0 &&
 		 (i == Ndis802_11Encryption1KeyAbsent ||
 		  i == Ndis802_11Encryption1Enabled))
 		mode = Ndis802_11Encryption1Enabled;
@@ -1403,7 +2031,6 @@ static void get_encryption_capa(struct ndis_device *wnd, char *buf,
 	}
 	EXIT1(return);
 }
-#endif
 
 wstdcall NTSTATUS NdisDispatchDeviceControl(struct device_object *fdo,
 					    struct irp *irp)
@@ -1619,6 +2246,49 @@ static void set_task_offload(struct ndis_device *wnd, void *buf,
 	EXIT1(return);
 }
 
+/* BSSID list may be large in dense areas; buffer is sized from what
+ * was needed last time, so usually one query is enough */
+struct ndis_bssid_list *query_bssid_list(struct ndis_device *wnd,
+					 ULONG *written)
+{
+	struct ndis_bssid_list *bssid_list;
+	ULONG buf_len, needed;
+	NDIS_STATUS res;
+	int i;
+
+	buf_len = max_t(ULONG, wnd->bssid_list_hint, sizeof(ULONG) +
+			offsetof(struct ndis_wlan_bssid_ex, var) * 8);
+	/* needed space may grow between queries */
+	for (i = 0; i < 10; i++) {
+		bssid_list = kmalloc(buf_len, GFP_KERNEL);
+		if (!bssid_list) {
+			ERROR("couldn't allocate %u bytes for scan results",
+			      buf_len);
+			return NULL;
+		}
+		/* some drivers don't set num_items to 0 if there are
+		 * no items (prism54 driver, e.g.,) */
+		bssid_list->num_items = 0;
+		needed = 0;
+		*written = 0;
+		res = mp_query_info(wnd, OID_802_11_BSSID_LIST, bssid_list,
+				    buf_len, written, &needed);
+		TRACE2("try %d: given %u bytes, needed %u, written %u",
+		       i, buf_len, needed, *written);
+		if (res == NDIS_STATUS_SUCCESS) {
+			wnd->bssid_list_hint = *written + *written / 4;
+			return bssid_list;
+		}
+		kfree(bssid_list);
+		if (needed <= buf_len) {
+			WARNING("getting BSSID list failed (%08X)", res);
+			return NULL;
+		}
+		buf_len = needed + needed / 4;
+	}
+	return NULL;
+}
+
 static void get_supported_oids(struct ndis_device *wnd)
 {
 	NDIS_STATUS res;
@@ -1786,11 +2456,156 @@ static int ndis_set_sg(struct net_device *dev, u32 data)
 }
 #endif
 
+static const char ndis_ethtool_stats_keys[][ETH_GSTRING_LEN] = {
+	"tx_ring_full", "tx_resources", "tx_pending",
+	"tx_packet_pool_allocs", "tx_packet_pool_hits",
+	"rx_copy_bytes", "rx_deferred_returns", "rx_return_batches",
+	"tx_ring_occupancy_1", "tx_ring_occupancy_2_3",
+	"tx_ring_occupancy_4_7", "tx_ring_occupancy_8_15",
+	"tx_ring_occupancy_16_31", "tx_ring_occupancy_32_63",
+	"tx_ring_occupancy_64_127", "tx_ring_occupancy_128_255",
+};
+
+static int ndis_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(ndis_ethtool_stats_keys);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void ndis_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, ndis_ethtool_stats_keys,
+		       sizeof(ndis_ethtool_stats_keys));
+}
+
+static void ndis_get_ethtool_stats(struct net_device *dev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_packet_pool *pool = wnd->tx_packet_pool;
+	struct ndis_counters sum;
+	int i, n = 0;
+
+	get_ndis_counters(wnd, &sum);
+	data[n++] = sum.tx_ring_full;
+	data[n++] = sum.tx_resources;
+	data[n++] = sum.tx_pending;
+	data[n++] = pool ? pool->allocs : 0;
+	data[n++] = pool ? pool->hits : 0;
+	/* every received packet is copied into an skb */
+	data[n++] = sum.rx_bytes;
+	data[n++] = wnd->rx_deferred_returns;
+	data[n++] = wnd->rx_return_batches;
+	for (i = 0; i < TX_RING_OCCUPANCY_BUCKETS; i++)
+		data[n++] = wnd->tx_ring_occupancy[i];
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,17,0)
+static void ndis_get_ringparam(struct net_device *dev,
+			       struct ethtool_ringparam *ring,
+			       struct kernel_ethtool_ringparam *kernel_ring,
+			       struct netlink_ext_ack *extack)
+#else
+static void ndis_get_ringparam(struct net_device *dev,
+			       struct ethtool_ringparam *ring)
+#endif
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+
+	/* ethtool core clears ring, except cmd, before calling us */
+	ring->tx_max_pending = TX_RING_MAX_SIZE;
+	ring->tx_pending = wnd->tx_ring_size;
+}
+
+/* packets already in tx_ring are moved to new ring, so it can't be
+ * smaller than number of pending packets */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,17,0)
+static int ndis_set_ringparam(struct net_device *dev,
+			      struct ethtool_ringparam *ring,
+			      struct kernel_ethtool_ringparam *kernel_ring,
+			      struct netlink_ext_ack *extack)
+#else
+static int ndis_set_ringparam(struct net_device *dev,
+			      struct ethtool_ringparam *ring)
+#endif
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_packet **tx_ring, **old_ring;
+	int i, n, ret = 0;
+
+	ENTER2("%u", ring->tx_pending);
+	if (ring->rx_pending || ring->rx_mini_pending ||
+	    ring->rx_jumbo_pending)
+		return -EINVAL;
+	if (ring->tx_pending < 2 || ring->tx_pending > TX_RING_MAX_SIZE)
+		return -EINVAL;
+	if (ring->tx_pending == wnd->tx_ring_size)
+		return 0;
+	/* tx_ring_mutex is held while device is suspended */
+	if (!netif_device_present(dev))
+		return -EBUSY;
+	tx_ring = kmalloc(ring->tx_pending * sizeof(tx_ring[0]), GFP_KERNEL);
+	if (!tx_ring)
+		return -ENOMEM;
+
+	/* tx_skbuff and tx_worker don't use tx_ring while queue is
+	 * stopped and tx_ring_mutex is held */
+	netif_tx_disable(dev);
+	mutex_lock(&wnd->tx_ring_mutex);
+	spin_lock_bh(&wnd->tx_ring_lock);
+	n = tx_ring_pending(wnd);
+	/* pending packets must leave room in new ring, else it would
+	 * start out full */
+	if (n >= ring->tx_pending) {
+		spin_unlock_bh(&wnd->tx_ring_lock);
+		old_ring = tx_ring;
+		ret = -EBUSY;
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		tx_ring[i] = wnd->tx_ring[(wnd->tx_ring_start + i) %
+					  wnd->tx_ring_size];
+	old_ring = wnd->tx_ring;
+	wnd->tx_ring = tx_ring;
+	wnd->tx_ring_size = ring->tx_pending;
+	wnd->tx_ring_start = 0;
+	wnd->tx_ring_end = n % wnd->tx_ring_size;
+	wnd->is_tx_ring_full = 0;
+	set_max_tx_packets(wnd);
+	if (wnd->tx_packet_pool)
+		wnd->tx_packet_pool->max_descr = wnd->max_tx_packets;
+	if (wnd->tx_buffer_pool)
+		wnd->tx_buffer_pool->max_descr = wnd->max_tx_packets + 4;
+	spin_unlock_bh(&wnd->tx_ring_lock);
+	TRACE2("tx_ring: %u, max_tx_packets: %u", wnd->tx_ring_size,
+	       wnd->max_tx_packets);
+
+out:
+	mutex_unlock(&wnd->tx_ring_mutex);
+	if (!wnd->is_tx_ring_full && netif_running(dev) &&
+	    netif_carrier_ok(dev))
+		netif_wake_queue(dev);
+	if (n)
+		queue_tx_work(wnd);
+	kfree(old_ring);
+	EXIT2(return ret);
+}
+
 static struct ethtool_ops ndis_ethtool_ops = {
 	.get_drvinfo	= ndis_get_drvinfo,
 	.get_link	= ndis_get_link,
 	.get_wol	= ndis_get_wol,
 	.set_wol	= ndis_set_wol,
+	.get_sset_count	= ndis_get_sset_count,
+	.get_strings	= ndis_get_strings,
+	.get_ethtool_stats = ndis_get_ethtool_stats,
+	.get_ringparam	= ndis_get_ringparam,
+	.set_ringparam	= ndis_set_ringparam,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0)
 	.get_tx_csum	= ndis_get_tx_csum,
 	.get_rx_csum	= ndis_get_rx_csum,
@@ -1826,6 +2641,14 @@ static struct notifier_block netdev_notifier = {
 	.notifier_call = notifier_event,
 };
 
+/* returns device of net_dev, or NULL if net_dev is not ours */
+struct ndis_device *get_ndis_device(struct net_device *net_dev)
+{
+	if (net_dev->ethtool_ops != &ndis_ethtool_ops)
+		return NULL;
+	return netdev_priv(net_dev);
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
 static const struct net_device_ops ndis_netdev_ops = {
 	.ndo_init = ndis_net_dev_init,
@@ -1840,7 +2663,11 @@ static const struct net_device_ops ndis_netdev_ops = {
 	.ndo_set_multicast_list = ndis_set_multicast_list,
 #endif
 	.ndo_set_mac_address = ndis_set_mac_address,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	.ndo_get_stats64 = ndis_get_stats64,
+#else
 	.ndo_get_stats = ndis_get_stats,
+#endif
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller = ndis_poll_controller,
 #endif
@@ -1901,11 +2728,6 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	net_dev->poll_controller = ndis_poll_controller;
 #endif
-#endif
-#ifdef CONFIG_WIRELESS_EXT
-	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
-		net_dev->wireless_handlers = &ndis_handler_def;
-	}
 #endif
 	net_dev->ethtool_ops = &ndis_ethtool_ops;
 	if (wnd->mp_interrupt)
@@ -1932,6 +2754,19 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	net_dev->features |= NETIF_F_LLTX;
 #endif
 
+	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
+		mp_set_int(wnd, OID_802_11_POWER_MODE, NDIS_POWER_OFF);
+		get_encryption_capa(wnd, buf, buf_len);
+		TRACE1("capabilities = %ld", wnd->capa.encr);
+		/* wiphy must be registered before net device; if
+		 * cfg80211 is not available, use wireless extensions */
+		if (cfg_ndis_register(wnd)) {
+#ifdef CONFIG_WIRELESS_EXT
+			net_dev->wireless_handlers = &ndis_handler_def;
+#endif
+		}
+	}
+
 	if (register_netdev(net_dev)) {
 		ERROR("cannot register net device %s", net_dev->name);
 		goto err_register;
@@ -1955,16 +2790,15 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 
 	if (deserialized_driver(wnd)) {
 		/* deserialized drivers don't have a limit, but we
-		 * keep max at TX_RING_SIZE */
-		wnd->max_tx_packets = TX_RING_SIZE;
+		 * keep max at size of tx_ring */
+		wnd->mp_max_tx_packets = 0;
 	} else {
 		status = mp_query_int(wnd, OID_GEN_MAXIMUM_SEND_PACKETS,
-				      &wnd->max_tx_packets);
-		if (status != NDIS_STATUS_SUCCESS)
-			wnd->max_tx_packets = 1;
-		if (wnd->max_tx_packets > TX_RING_SIZE)
-			wnd->max_tx_packets = TX_RING_SIZE;
+				      &wnd->mp_max_tx_packets);
+		if (status != NDIS_STATUS_SUCCESS || !wnd->mp_max_tx_packets)
+			wnd->mp_max_tx_packets = 1;
 	}
+	set_max_tx_packets(wnd);
 	TRACE2("maximum send packets: %d", wnd->max_tx_packets);
 	NdisAllocatePacketPoolEx(&status, &wnd->tx_packet_pool,
 				 wnd->max_tx_packets, 0,
@@ -2002,9 +2836,6 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 
 #ifdef CONFIG_WIRELESS_EXT
 	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
-		mp_set_int(wnd, OID_802_11_POWER_MODE, NDIS_POWER_OFF);
-		get_encryption_capa(wnd, buf, buf_len);
-		TRACE1("capabilities = %ld", wnd->capa.encr);
 		printk(KERN_INFO "%s: encryption modes supported: "
 		       "%s%s%s%s%s%s%s\n", net_dev->name,
 		       test_bit(Ndis802_11Encryption1Enabled, &wnd->capa.encr) ?
@@ -2042,6 +2873,7 @@ packet_pool_err:
 	unregister_netdev(net_dev);
 	wnd->max_tx_packets = 0;
 err_register:
+	cfg_ndis_unregister(wnd);
 	kfree(buf);
 err_start:
 	mp_halt(wnd);
@@ -2065,11 +2897,7 @@ static int ndis_remove_device(struct ndis_device *wnd)
 	if (!our_mutex)
 		WARNING("couldn't obtain tx_ring_mutex");
 	spin_lock_bh(&wnd->tx_ring_lock);
-	tx_pending = wnd->tx_ring_end - wnd->tx_ring_start;
-	if (tx_pending < 0)
-		tx_pending += TX_RING_SIZE;
-	else if (tx_pending == 0 && wnd->is_tx_ring_full)
-		tx_pending = TX_RING_SIZE - 1;
+	tx_pending = tx_ring_pending(wnd);
 	wnd->is_tx_ring_full = 0;
 	/* throw away pending packets */
 	while (tx_pending-- > 0) {
@@ -2077,13 +2905,23 @@ static int ndis_remove_device(struct ndis_device *wnd)
 
 		packet = wnd->tx_ring[wnd->tx_ring_start];
 		free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
-		wnd->tx_ring_start = (wnd->tx_ring_start + 1) % TX_RING_SIZE;
+		wnd->tx_ring_start = (wnd->tx_ring_start + 1) %
+			wnd->tx_ring_size;
 	}
 	spin_unlock_bh(&wnd->tx_ring_lock);
 	if (our_mutex)
 		mutex_unlock(&wnd->tx_ring_mutex);
+#ifdef CONFIG_WIRELESS_EXT
+	bss_cache_free(wnd);
+#endif
 	mp_halt(wnd);
+	/* work queued for halted miniport is not run */
+	wrapndis_cancel_work(wnd, &wnd->tx_work);
+	wrapndis_cancel_work(wnd, &wnd->ndis_work);
+	oid_req_cancel_all(wnd, NDIS_STATUS_CLOSING);
+	cfg_ndis_unregister(wnd);
 	ndis_exit_device(wnd);
+	destroy_workqueue(wnd->wq);
 
 	if (wnd->tx_packet_pool) {
 		NdisFreePacketPool(wnd->tx_packet_pool);
@@ -2097,6 +2935,8 @@ static int ndis_remove_device(struct ndis_device *wnd)
 	printk(KERN_INFO "%s: device %s removed\n", DRIVER_NAME,
 	       wnd->net_dev->name);
 	kfree(wnd->nmb);
+	kfree(wnd->tx_ring);
+	free_percpu(wnd->stats);
 	free_netdev(wnd->net_dev);
 	EXIT2(return 0);
 }
@@ -2111,6 +2951,7 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	struct net_device *net_dev;
 	struct wrap_device *wd;
 	unsigned long i;
+	int cpu;
 
 	ENTER2("%p, %p", drv_obj, pdo);
 	if (strlen(if_name) >= IFNAMSIZ) {
@@ -2157,7 +2998,38 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	wnd->net_dev = net_dev;
 	fdo->reserved = wnd;
 	nmb->fdo = fdo;
-	if (ndis_init_device(wnd)) {
+	/* device name first, as thread names are truncated */
+	snprintf(wnd->wq_name, sizeof(wnd->wq_name), "%s/%s",
+		 net_dev->dev.parent ? dev_name(net_dev->dev.parent) : "",
+		 wd->driver->name);
+	wnd->wq = wrap_create_ordered_wq(wnd->wq_name, 0);
+	if (!wnd->wq) {
+		ERROR("couldn't create workqueue");
+		IoDeleteDevice(fdo);
+		kfree(nmb);
+		free_netdev(net_dev);
+		EXIT1(return STATUS_RESOURCES);
+	}
+	memset(&wnd->wq_stats, 0, sizeof(wnd->wq_stats));
+	memset(wnd->dpc_latency_hist, 0, sizeof(wnd->dpc_latency_hist));
+	wnd->stats = alloc_percpu(struct ndis_pcpu_stats);
+	if (!wnd->stats) {
+		ERROR("couldn't allocate stats");
+		destroy_workqueue(wnd->wq);
+		IoDeleteDevice(fdo);
+		kfree(nmb);
+		free_netdev(net_dev);
+		EXIT1(return STATUS_RESOURCES);
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(wnd->stats, cpu)->syncp);
+	wnd->tx_ring_size = TX_RING_SIZE;
+	wnd->tx_ring = kmalloc(wnd->tx_ring_size * sizeof(wnd->tx_ring[0]),
+			       GFP_KERNEL);
+	if (!wnd->tx_ring || ndis_init_device(wnd)) {
+		kfree(wnd->tx_ring);
+		free_percpu(wnd->stats);
+		destroy_workqueue(wnd->wq);
 		IoDeleteDevice(fdo);
 		kfree(nmb);
 		free_netdev(net_dev);
@@ -2167,17 +3039,34 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	spin_lock_init(&wnd->tx_ring_lock);
 	mutex_init(&wnd->tx_ring_mutex);
 	mutex_init(&wnd->ndis_req_mutex);
+	InitializeListHead(&wnd->oid_req_list);
+	InitializeListHead(&wnd->oid_req_done_list);
+	wnd->oid_req_active = NULL;
+	spin_lock_init(&wnd->oid_req_lock);
+	init_waitqueue_head(&wnd->oid_req_wait);
+	INIT_WORK(&wnd->oid_req_work, oid_req_worker);
+	wnd->oid_req_queued = 0;
+	wnd->oid_req_deduped = 0;
+	oid_cache_init(wnd);
 	wnd->ndis_req_done = 0;
 	INIT_WORK(&wnd->tx_work, tx_worker);
+	spin_lock_init(&wnd->return_packets_lock);
+	wnd->return_packets_head = NULL;
+	wnd->return_packets_tail = NULL;
+	INIT_WORK(&wnd->return_packets_work, return_packets_worker);
 	wnd->tx_ring_start = 0;
 	wnd->tx_ring_end = 0;
 	wnd->is_tx_ring_full = 0;
+	memset(wnd->tx_ring_occupancy, 0, sizeof(wnd->tx_ring_occupancy));
+	wnd->rx_deferred_returns = 0;
+	wnd->rx_return_batches = 0;
 	wnd->capa.encr = 0;
 	wnd->capa.auth = 0;
 	wnd->attributes = 0;
 	wnd->dma_map_count = 0;
 	wnd->dma_map_addr = NULL;
 	wnd->nick[0] = 0;
+	wnd->wdev = NULL;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
 	timer_setup(&wnd->hangcheck_timer, hangcheck_proc, 0);
 	timer_setup(&wnd->iw_stats_timer, hangcheck_proc, 0);
@@ -2186,6 +3075,10 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	init_timer(&wnd->iw_stats_timer);
 #endif
 	wnd->scan_timestamp = 0;
+	wnd->bssid_list_hint = 0;
+#ifdef CONFIG_WIRELESS_EXT
+	bss_cache_init(wnd);
+#endif
 	wnd->iw_stats_interval = 10 * HZ;
 	wnd->ndis_pending_work = 0;
 	memset(&wnd->essid, 0, sizeof(wnd->essid));
@@ -2193,6 +3086,9 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	wnd->infrastructure_mode = Ndis802_11Infrastructure;
 	INIT_WORK(&wnd->ndis_work, wrapndis_worker);
 	wnd->iw_stats_enabled = TRUE;
+	wnd->iw_stats_collected = 0;
+	wnd->iw_stats_rssi_indications = 0;
+	wnd->rssi_trigger = IW_STATS_RSSI_TRIGGER;
 
 	TRACE1("nmb: %p, pdo: %p, fdo: %p, attached: %p, next: %p",
 	       nmb, pdo, fdo, fdo->attached, nmb->next_device);
@@ -2219,17 +3115,17 @@ int init_ndis_driver(struct driver_object *drv_obj)
 
 int wrapndis_init(void)
 {
-	wrapndis_wq = create_singlethread_workqueue("wrapndis_wq");
-	if (!wrapndis_wq)
-		EXIT1(return -ENOMEM);
-	TRACE1("wrapndis_wq: %p", wrapndis_wq);
+	int ret;
+
 	register_netdevice_notifier(&netdev_notifier);
-	return 0;
+	ret = nl_ndis_init();
+	if (ret)
+		unregister_netdevice_notifier(&netdev_notifier);
+	return ret;
 }
 
 void wrapndis_exit(void)
 {
+	nl_ndis_exit();
 	unregister_netdevice_notifier(&netdev_notifier);
-	if (wrapndis_wq)
-		destroy_workqueue(wrapndis_wq);
 }
@@ -27,6 +27,13 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd);
 NDIS_STATUS mp_request(enum ndis_request_type request,
 		       struct ndis_device *wnd, ndis_oid oid,
 		       void *buf, ULONG buflen, ULONG *written, ULONG *needed);
+int mp_request_async(enum ndis_request_type request,
+		     struct ndis_device *wnd, ndis_oid oid, void *buf,
+		     ULONG buflen, ndis_oid_callback callback, void *ctx);
+BOOLEAN oid_req_complete(struct ndis_device *wnd, NDIS_STATUS status);
+void oid_cache_invalidate(struct ndis_device *wnd);
+int oid_cache_set_ttl(struct ndis_device *wnd, ndis_oid oid,
+		      unsigned int msec);
 
 static inline NDIS_STATUS mp_query_info(struct ndis_device *wnd,
 					ndis_oid oid, void *buf, ULONG buflen,
@@ -58,6 +65,15 @@ static inline NDIS_STATUS mp_query_int(struct ndis_device *wnd,
 			  data, sizeof(ULONG), NULL, NULL);
 }
 
+/* callback is called from device's workqueue with result in req->buf */
+static inline int mp_query_async(struct ndis_device *wnd, ndis_oid oid,
+				 ULONG buflen, ndis_oid_callback callback,
+				 void *ctx)
+{
+	return mp_request_async(NdisRequestQueryInformation, wnd, oid,
+				NULL, buflen, callback, ctx);
+}
+
 static inline NDIS_STATUS mp_set(struct ndis_device *wnd, ndis_oid oid,
 				 void *buf, ULONG buflen)
 {
@@ -72,15 +88,61 @@ static inline NDIS_STATUS mp_set_int(struct ndis_device *wnd,
 			  &data, sizeof(ULONG), NULL, NULL);
 }
 
+struct ndis_bssid_list *query_bssid_list(struct ndis_device *wnd,
+					 ULONG *written);
 void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 		    NDIS_STATUS status);
 int init_ndis_driver(struct driver_object *drv_obj);
 NDIS_STATUS ndis_reinit(struct ndis_device *wnd);
 void set_media_state(struct ndis_device *wnd, enum ndis_media_state state);
 
+void wrapndis_queue_work(struct ndis_device *wnd, struct work_struct *work,
+			 u64 *queued);
+void wrapndis_cancel_work(struct ndis_device *wnd, struct work_struct *work);
+#define queue_tx_work(wnd)						\
+	wrapndis_queue_work(wnd, &(wnd)->tx_work, &(wnd)->tx_work_queued)
+#define queue_ndis_work(wnd)						\
+	wrapndis_queue_work(wnd, &(wnd)->ndis_work, &(wnd)->ndis_work_queued)
+
+/* per-CPU counters are updated with interrupts disabled, as packets
+ * are completed in interrupt, BH and process contexts */
+#define ndis_stats_add(wnd, counter, n)					\
+do {									\
+	struct ndis_pcpu_stats *__stats;				\
+	unsigned long __flags;						\
+									\
+	local_irq_save(__flags);					\
+	__stats = this_cpu_ptr((wnd)->stats);				\
+	u64_stats_update_begin(&__stats->syncp);			\
+	__stats->c.counter += (n);					\
+	u64_stats_update_end(&__stats->syncp);				\
+	local_irq_restore(__flags);					\
+} while (0)
+
+#define ndis_stats_inc(wnd, counter) ndis_stats_add(wnd, counter, 1)
+
+/* dir is tx or rx */
+#define ndis_stats_packet(wnd, dir, len)				\
+do {									\
+	struct ndis_pcpu_stats *__stats;				\
+	unsigned long __flags;						\
+									\
+	local_irq_save(__flags);					\
+	__stats = this_cpu_ptr((wnd)->stats);				\
+	u64_stats_update_begin(&__stats->syncp);			\
+	__stats->c.dir##_packets++;					\
+	__stats->c.dir##_bytes += (len);				\
+	u64_stats_update_end(&__stats->syncp);				\
+	local_irq_restore(__flags);					\
+} while (0)
+
+void get_ndis_counters(struct ndis_device *wnd, struct ndis_counters *sum);
+struct ndis_device *get_ndis_device(struct net_device *net_dev);
+
 void hangcheck_add(struct ndis_device *wnd);
 void hangcheck_del(struct ndis_device *wnd);
 
 struct iw_statistics *get_iw_stats(struct net_device *dev);
+void iw_stats_rssi_indication(struct ndis_device *wnd, ndis_rssi rssi);
 
 #endif
@@ -19,9 +19,16 @@
 #include "pnp.h"
 #include "wrapper.h"
 
+/* tracepoints are instantiated here */
+#define CREATE_TRACE_POINTS
+#include "trace_ndis.h"
+
 char *if_name = "wlan%d";
 int proc_uid, proc_gid;
 int hangcheck_interval;
+int timer_slack;
+int usb_sg;
+static int selftest;
 static char *utils_version = UTILS_VERSION;
 int debug = DEBUG;
 
@@ -45,6 +52,24 @@ module_param(hangcheck_interval, int, 0600);
 MODULE_PARM_DESC(hangcheck_interval, "The interval, in seconds, for checking"
 		 " if driver is hung. (default: 0)");
 
+/* 0 - periodic timers expire exactly as requested by driver,
+ * positive value - periodic timers may be delayed by up to that many
+ * milliseconds (but no more than a quarter of the period) so that
+ * timers fire together and wake up CPU less often
+ */
+module_param(timer_slack, int, 0600);
+MODULE_PARM_DESC(timer_slack, "The tolerance, in milliseconds, for "
+		 "coalescing periodic timers (default: 0)");
+
+module_param(usb_sg, int, 0600);
+MODULE_PARM_DESC(usb_sg, "Transfer USB bulk data directly from/to "
+		 "vmalloc'ed buffers with scatter-gather, instead of "
+		 "bounce buffers, if host controller allows (default: 0)");
+
+module_param(selftest, int, 0400);
+MODULE_PARM_DESC(selftest, "Run self-tests and benchmarks at load time "
+		 "and report results in kernel log (default: 0)");
+
 module_param(utils_version, charp, 0400);
 MODULE_PARM_DESC(utils_version, "Compatible version of utils "
 		 "(read only: " UTILS_VERSION ")");
@@ -98,6 +123,11 @@ static int __init wrapper_init(void)
 		ERROR("%s: initialization failed", DRIVER_NAME);
 		return -EINVAL;
 	}
+	if (selftest && wrap_selftest()) {
+		module_cleanup();
+		ERROR("%s: self-test failed", DRIVER_NAME);
+		return -EINVAL;
+	}
 	EXIT1(return 0);
 }
 
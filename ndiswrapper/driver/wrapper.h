@@ -20,5 +20,14 @@ extern char *if_name;
 extern int proc_uid;
 extern int proc_gid;
 extern int hangcheck_interval;
+extern int timer_slack;
+extern int usb_sg;
+
+/* timer_slack setting and per-device value written to proc are in
+ * msec; a positive value is at least one jiffy */
+static inline unsigned long timer_slack_jiffies(int msec)
+{
+	return (msec > 0) ? msecs_to_jiffies(msec) : 0;
+}
 
 #endif /* WRAPPER_H */
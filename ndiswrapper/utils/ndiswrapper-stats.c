@@ -0,0 +1,405 @@
+/*
+ *  Copyright (C) 2026 ndiswrapper contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* dumps statistics of ndiswrapper devices from its generic netlink
+ * family, or with '-m', prints link events of devices */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "ndiswrapper.h"
+#include "nl_ndis.h"
+
+#define PROG_NAME "ndiswrapper-stats"
+
+#ifndef UTILS_VERSION
+#error "compile this file with 'make' in the 'utils' directory only"
+#endif
+
+#define NL_BUF_SIZE 16384
+
+#define NLA_DATA(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_PAYLOAD(nla) ((int)(nla)->nla_len - NLA_HDRLEN)
+#define GENL_ATTRS(nlh) ((struct nlattr *)((char *)NLMSG_DATA(nlh) + \
+					    GENL_HDRLEN))
+#define GENL_ATTRS_LEN(nlh) ((int)(nlh)->nlmsg_len - NLMSG_HDRLEN - \
+			     GENL_HDRLEN)
+
+static int nl_seq;
+
+/* attributes are indexed by type; a pointer to an attribute that
+ * isn't present is NULL */
+static void parse_attrs(struct nlattr *nla, int len, struct nlattr **tb,
+			int max)
+{
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	while (len >= (int)NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	       nla->nla_len <= len) {
+		int type = nla->nla_type & NLA_TYPE_MASK;
+
+		if (type <= max)
+			tb[type] = nla;
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+}
+
+/* attributes are only 4-byte aligned, so they are copied out */
+static int get_attr(struct nlattr *nla, void *data, size_t size)
+{
+	if (!nla)
+		return -1;
+	memset(data, 0, size);
+	if ((size_t)NLA_PAYLOAD(nla) < size)
+		size = NLA_PAYLOAD(nla);
+	memcpy(data, NLA_DATA(nla), size);
+	return 0;
+}
+
+static int put_attr(struct nlmsghdr *nlh, int type, const void *data,
+		    int len)
+{
+	struct nlattr *nla;
+
+	nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(NLA_DATA(nla), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return 0;
+}
+
+static int send_genl(int sock, int family, int cmd, int flags,
+		     int attr_type, const void *attr, int attr_len)
+{
+	char buf[256];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct genlmsghdr *genl;
+	struct sockaddr_nl addr;
+
+	memset(buf, 0, sizeof(buf));
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	nlh->nlmsg_type = family;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = ++nl_seq;
+	genl = NLMSG_DATA(nlh);
+	genl->cmd = cmd;
+	genl->version = NDIS_GENL_VERSION;
+	if (attr)
+		put_attr(nlh, attr_type, attr, attr_len);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (sendto(sock, buf, nlh->nlmsg_len, 0, (struct sockaddr *)&addr,
+		   sizeof(addr)) < 0) {
+		perror("sendto");
+		return -1;
+	}
+	return 0;
+}
+
+/* finds family id and id of link multicast group */
+static int get_family(int sock, int *family, int *mcgrp)
+{
+	static char buf[NL_BUF_SIZE];
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	struct nlmsghdr *nlh;
+	int len;
+
+	if (send_genl(sock, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0,
+		      CTRL_ATTR_FAMILY_NAME, NDIS_GENL_NAME,
+		      strlen(NDIS_GENL_NAME) + 1))
+		return -1;
+	len = recv(sock, buf, sizeof(buf), 0);
+	if (len < 0) {
+		perror("recv");
+		return -1;
+	}
+	nlh = (struct nlmsghdr *)buf;
+	if (!NLMSG_OK(nlh, len))
+		return -1;
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		fprintf(stderr, "%s: netlink family '%s' not found; "
+			"is %s module loaded?\n", PROG_NAME, NDIS_GENL_NAME,
+			DRIVER_NAME);
+		return -1;
+	}
+	parse_attrs(GENL_ATTRS(nlh), GENL_ATTRS_LEN(nlh), tb, CTRL_ATTR_MAX);
+	if (!tb[CTRL_ATTR_FAMILY_ID])
+		return -1;
+	*family = *(__u16 *)NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+	*mcgrp = -1;
+	if (tb[CTRL_ATTR_MCAST_GROUPS]) {
+		struct nlattr *grp = NLA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+		int grps_len = NLA_PAYLOAD(tb[CTRL_ATTR_MCAST_GROUPS]);
+
+		while (grps_len >= (int)NLA_HDRLEN &&
+		       grp->nla_len >= NLA_HDRLEN) {
+			struct nlattr *gtb[CTRL_ATTR_MCAST_GRP_MAX + 1];
+
+			parse_attrs(NLA_DATA(grp), NLA_PAYLOAD(grp), gtb,
+				    CTRL_ATTR_MCAST_GRP_MAX);
+			if (gtb[CTRL_ATTR_MCAST_GRP_NAME] &&
+			    gtb[CTRL_ATTR_MCAST_GRP_ID] &&
+			    !strcmp(NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_NAME]),
+				    NDIS_GENL_MCGRP_LINK))
+				*mcgrp = *(__u32 *)
+					NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_ID]);
+			grps_len -= NLA_ALIGN(grp->nla_len);
+			grp = (struct nlattr *)((char *)grp +
+						NLA_ALIGN(grp->nla_len));
+		}
+	}
+	return 0;
+}
+
+static void print_hist(const char *name, struct nlattr *nla)
+{
+	__u64 hist[NDIS_LATENCY_BUCKETS];
+	int i;
+
+	if (get_attr(nla, hist, sizeof(hist)))
+		return;
+	printf("  %s:", name);
+	for (i = 0; i < NDIS_LATENCY_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == 0)
+			printf(" <1us=%llu", (unsigned long long)hist[i]);
+		else if (i == NDIS_LATENCY_BUCKETS - 1)
+			printf(" >=%uus=%llu", 1U << (i - 1),
+			       (unsigned long long)hist[i]);
+		else
+			printf(" <%uus=%llu", 1U << i,
+			       (unsigned long long)hist[i]);
+	}
+	printf("\n");
+}
+
+static void print_stats(struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[NDIS_ATTR_MAX + 1];
+	struct ndis_genl_counters counters;
+	struct ndis_genl_tx_ring ring;
+	struct ndis_genl_wq wq;
+	struct ndis_genl_oid oid;
+	struct ndis_genl_memory mem;
+	__u32 ifindex = 0;
+	__u8 link = 0;
+
+	parse_attrs(GENL_ATTRS(nlh), GENL_ATTRS_LEN(nlh), tb, NDIS_ATTR_MAX);
+	get_attr(tb[NDIS_ATTR_IFINDEX], &ifindex, sizeof(ifindex));
+	get_attr(tb[NDIS_ATTR_LINK], &link, sizeof(link));
+	printf("%s (ifindex %u): link %s\n",
+	       tb[NDIS_ATTR_IFNAME] ? (char *)NLA_DATA(tb[NDIS_ATTR_IFNAME]) :
+	       "?", ifindex, link ? "up" : "down");
+	if (!get_attr(tb[NDIS_ATTR_COUNTERS], &counters, sizeof(counters))) {
+		printf("  tx: packets=%llu bytes=%llu dropped=%llu\n",
+		       (unsigned long long)counters.tx_packets,
+		       (unsigned long long)counters.tx_bytes,
+		       (unsigned long long)counters.tx_dropped);
+		printf("  rx: packets=%llu bytes=%llu dropped=%llu\n",
+		       (unsigned long long)counters.rx_packets,
+		       (unsigned long long)counters.rx_bytes,
+		       (unsigned long long)counters.rx_dropped);
+		printf("  tx_ring_full=%llu tx_resources=%llu "
+		       "tx_pending=%llu\n",
+		       (unsigned long long)counters.tx_ring_full,
+		       (unsigned long long)counters.tx_resources,
+		       (unsigned long long)counters.tx_pending);
+	}
+	if (!get_attr(tb[NDIS_ATTR_TX_RING], &ring, sizeof(ring)))
+		printf("  tx_ring: size=%u start=%u end=%u full=%u tx_ok=%u "
+		       "max_tx_packets=%u queue_stopped=%u\n", ring.size,
+		       ring.start, ring.end, ring.full, ring.tx_ok,
+		       ring.max_tx_packets, ring.queue_stopped);
+	if (!get_attr(tb[NDIS_ATTR_WQ], &wq, sizeof(wq)))
+		printf("  wq: queued=%llu run=%llu depth=%u max_depth=%u "
+		       "avg_latency=%lluus max_latency=%lluus\n",
+		       (unsigned long long)wq.queued,
+		       (unsigned long long)wq.run, wq.depth, wq.max_depth,
+		       (unsigned long long)(wq.run ? wq.total_latency_ns /
+					    wq.run / 1000 : 0),
+		       (unsigned long long)wq.max_latency_ns / 1000);
+	print_hist("wq_latency", tb[NDIS_ATTR_WQ_LATENCY]);
+	print_hist("dpc_latency", tb[NDIS_ATTR_DPC_LATENCY]);
+	if (!get_attr(tb[NDIS_ATTR_OID], &oid, sizeof(oid)))
+		printf("  oid_requests: queued=%llu deduped=%llu\n",
+		       (unsigned long long)oid.requests_queued,
+		       (unsigned long long)oid.requests_deduped);
+	if (tb[NDIS_ATTR_OID_CACHE]) {
+		struct ndis_genl_oid_cache entry;
+		char *p = NLA_DATA(tb[NDIS_ATTR_OID_CACHE]);
+		int len = NLA_PAYLOAD(tb[NDIS_ATTR_OID_CACHE]);
+
+		for (; len >= (int)sizeof(entry); len -= sizeof(entry)) {
+			memcpy(&entry, p, sizeof(entry));
+			p += sizeof(entry);
+			printf("  oid_cache: %08X ttl=%ums hits=%llu "
+			       "misses=%llu\n", entry.oid, entry.ttl_ms,
+			       (unsigned long long)entry.hits,
+			       (unsigned long long)entry.misses);
+		}
+	}
+	if (!get_attr(tb[NDIS_ATTR_MEMORY], &mem, sizeof(mem))) {
+		printf("  memory: tx_packets=%u/%u bss_cache_entries=%u\n",
+		       mem.tx_packets_used, mem.tx_packets_max,
+		       mem.bss_cache_entries);
+		if (mem.kmalloc || mem.vmalloc || mem.slack || mem.pages)
+			printf("  allocated: kmalloc=%llu vmalloc=%llu "
+			       "slack=%llu pages=%llu\n",
+			       (unsigned long long)mem.kmalloc,
+			       (unsigned long long)mem.vmalloc,
+			       (unsigned long long)mem.slack,
+			       (unsigned long long)mem.pages);
+	}
+}
+
+static void print_link_event(struct nlmsghdr *nlh)
+{
+	struct nlattr *tb[NDIS_ATTR_MAX + 1];
+	__u8 link = 0;
+
+	parse_attrs(GENL_ATTRS(nlh), GENL_ATTRS_LEN(nlh), tb, NDIS_ATTR_MAX);
+	get_attr(tb[NDIS_ATTR_LINK], &link, sizeof(link));
+	printf("%s: link %s\n",
+	       tb[NDIS_ATTR_IFNAME] ? (char *)NLA_DATA(tb[NDIS_ATTR_IFNAME]) :
+	       "?", link ? "up" : "down");
+	fflush(stdout);
+}
+
+/* returns 1 when all replies have been received */
+static int recv_msgs(int sock, int family)
+{
+	static char buf[NL_BUF_SIZE];
+	struct nlmsghdr *nlh;
+	int len;
+
+	len = recv(sock, buf, sizeof(buf), 0);
+	if (len < 0) {
+		perror("recv");
+		return -1;
+	}
+	for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type == NLMSG_DONE)
+			return 1;
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+			if (err->error == 0)
+				return 1;
+			fprintf(stderr, "%s: %s\n", PROG_NAME,
+				strerror(-err->error));
+			return -1;
+		}
+		if (nlh->nlmsg_type != family)
+			continue;
+		switch (((struct genlmsghdr *)NLMSG_DATA(nlh))->cmd) {
+		case NDIS_CMD_GET_STATS:
+			print_stats(nlh);
+			if (!(nlh->nlmsg_flags & NLM_F_MULTI))
+				return 1;
+			break;
+		case NDIS_CMD_LINK_EVENT:
+			print_link_event(nlh);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-m] [interface]\n"
+		"  dumps statistics of all ndiswrapper interfaces or "
+		"given interface\n"
+		"  -m: print link events instead\n", PROG_NAME);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_nl addr;
+	int sock, family, mcgrp, monitor = 0, opt, ret;
+
+	while ((opt = getopt(argc, argv, "mh")) != -1) {
+		switch (opt) {
+		case 'm':
+			monitor = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	if (get_family(sock, &family, &mcgrp))
+		return 1;
+
+	if (monitor) {
+		if (mcgrp < 0) {
+			fprintf(stderr, "%s: no link multicast group\n",
+				PROG_NAME);
+			return 1;
+		}
+		if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+			       &mcgrp, sizeof(mcgrp)) < 0) {
+			perror("setsockopt");
+			return 1;
+		}
+		while (recv_msgs(sock, family) >= 0)
+			;
+		return 1;
+	}
+
+	if (optind < argc) {
+		__u32 ifindex = if_nametoindex(argv[optind]);
+
+		if (!ifindex) {
+			fprintf(stderr, "%s: unknown interface '%s'\n",
+				PROG_NAME, argv[optind]);
+			return 1;
+		}
+		ret = send_genl(sock, family, NDIS_CMD_GET_STATS, 0,
+				NDIS_ATTR_IFINDEX, &ifindex, sizeof(ifindex));
+	} else
+		ret = send_genl(sock, family, NDIS_CMD_GET_STATS, NLM_F_DUMP,
+				0, NULL, 0);
+	if (ret)
+		return 1;
+	while ((ret = recv_msgs(sock, family)) == 0)
+		;
+	close(sock);
+	return ret < 0;
+}